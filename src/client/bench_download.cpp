@@ -0,0 +1,67 @@
+// Download benchmark: single stream against parallel ranges over the same server
+// Usage: ./bench_download <ip> <port> <user> <password> <from> <file_id> [streams] [rounds]
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#include "range_fetch.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Best of rounds, in MB/s
+static double measure(const RangeSource &source, uint64_t size, int streams, int rounds, int fd)
+{
+    double best = 0;
+    for (int i = 0; i < rounds; ++i)
+    {
+        auto start = Clock::now();
+        if (!fetchParallel(source, size, streams, fd))
+        {
+            std::cerr << "Download failed" << std::endl;
+            return 0;
+        }
+        best = std::max(best, size / 1e6 / elapsed(start));
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 7)
+    {
+        std::cerr << "Usage: " << argv[0] << " <ip> <port> <user> <password> <from> <file_id> [streams] [rounds]" << std::endl;
+        return 1;
+    }
+
+    RangeSource source{argv[1], std::stoi(argv[2]), argv[3], argv[4], argv[5], argv[6]};
+    int streams = argc > 7 ? std::stoi(argv[7]) : 4;
+    int rounds = argc > 8 ? std::stoi(argv[8]) : 5;
+    const std::string path = "bench_download.out";
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    uint64_t size = 0;
+    if (fd < 0 or !fetchRange(source, 0, 0, fd, &size))
+    {
+        std::cerr << "File not found" << std::endl;
+        return 1;
+    }
+    std::cout << "File size: " << size << " bytes" << std::endl;
+
+    double single = measure(source, size, 1, rounds, fd);
+    std::cout << "1 stream: " << single << " MB/s" << std::endl;
+
+    double parallel = measure(source, size, streams, rounds, fd);
+    std::cout << streams << " streams: " << parallel << " MB/s (" << (single > 0 ? parallel / single : 0) << "x)" << std::endl;
+
+    close(fd);
+    std::remove(path.c_str());
+    return 0;
+}
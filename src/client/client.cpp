@@ -1,145 +1,429 @@
-#include "client.hpp"
-
-Client::Client(const std::string &ip, int port)
-    : IP(ip), port(port), clientSd(-1), stopReceiving(false), channel(""), user("") {}
-
-Client::~Client()
-{
-    stopReceiving = true;
-    if (receiveThread.joinable())
-    {
-        receiveThread.join();
-    }
-    if (clientSd >= 0)
-    {
-        close(clientSd);
-    }
-}
-
-bool Client::connectToServer()
-{
-    struct addrinfo hints, *res;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    int err = getaddrinfo(IP.c_str(), std::to_string(port).c_str(), &hints, &res);
-    if (err != 0)
-    {
-        std::cerr << "Error resolving hostname: " << gai_strerror(err) << std::endl;
-        return false;
-    }
-
-    clientSd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (clientSd < 0)
-    {
-        std::cerr << "Error creating socket!" << std::endl;
-        freeaddrinfo(res);
-        return false;
-    }
-
-    if (connect(clientSd, res->ai_addr, res->ai_addrlen) < 0)
-    {
-        std::cerr << "Error connecting to server!" << std::endl;
-        close(clientSd);
-        freeaddrinfo(res);
-        return false;
-    }
-
-    freeaddrinfo(res);
-    return true;
-}
-
-void Client::receiveMessages()
-{
-    std::vector<uint8_t> buffer(1024);
-    ssize_t sz;
-
-    while (!stopReceiving && (sz = recv(clientSd, buffer.data(), buffer.size(), 0)) > 0)
-    {
-        Message response;
-        try
-        {
-            response = Message::deserialize(buffer);
-        }
-        catch (const std::exception &e)
-        {
-            std::cerr << "Deserialization Error: " << e.what() << std::endl;
-            continue;
-        }
-        Client::handleResponse(response);
-    }
-
-    if (sz < 0 && !stopReceiving)
-    {
-        std::cerr << "Error receiving message!" << std::endl;
-    }
-}
-
-void Client::sendMessageLoop()
-{
-    while (true)
-    {
-        std::string data;
-        std::getline(std::cin, data);
-
-        if (data == "!exit")
-        {
-            stopReceiving = true;
-            shutdown(clientSd, SHUT_RDWR);
-            close(clientSd); // Close the socket to unblock recv in receiveMessages
-            break;
-        }
-
-        // Check if the first character is '!', then call handleCommand
-        if (!data.empty() && data[0] == '!')
-        {
-            Message *msg = handleCommand(data);
-            if (msg != NULL)
-            {
-                Client::sendMessage(*msg);
-                delete msg;
-            }
-        }
-        else
-        {
-            std::cerr << "Not a command" << std::endl;
-        }
-    }
-}
-
-void Client::sendMessage(Message &msg)
-{
-    std::vector<uint8_t> serialized = msg.serialize();
-    ssize_t bytesSent = send(clientSd, serialized.data(), serialized.size(), 0);
-    if (bytesSent < 0)
-    {
-        std::cerr << "Message not sent" << std::endl;
-    }
-}
-
-void Client::run()
-{
-    if (!connectToServer())
-    {
-        return;
-    }
-
-    std::cout << "Connected to " << IP << " on port " << port << std::endl;
-
-    try
-    {
-        receiveThread = std::thread(&Client::receiveMessages, this);
-    }
-    catch (const std::exception &e)
-    {
-        throw std::runtime_error("Error creating receive thread: " + std::string(e.what()));
-    }
-
-    sendMessageLoop();
-
-    if (receiveThread.joinable())
-    {
-        receiveThread.join();
-    }
-}
+#include "client.hpp"
+
+Client::Client(const std::string &ip, int port)
+    : IP(ip), port(port), clientSd(-1), stopReceiving(false), uploading(false), downloadRemaining(0), downloadStreams(1), channel(""), user("") {}
+
+Client::~Client()
+{
+    stopReceiving = true;
+    uploading = false;
+    if (receiveThread.joinable())
+    {
+        receiveThread.join();
+    }
+    if (uploadThread.joinable())
+    {
+        uploadThread.join();
+    }
+    if (downloadThread.joinable())
+    {
+        downloadThread.join();
+    }
+    if (clientSd >= 0)
+    {
+        close(clientSd);
+    }
+}
+
+bool Client::connectToServer()
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err = getaddrinfo(IP.c_str(), std::to_string(port).c_str(), &hints, &res);
+    if (err != 0)
+    {
+        std::cerr << "Error resolving hostname: " << gai_strerror(err) << std::endl;
+        return false;
+    }
+
+    clientSd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (clientSd < 0)
+    {
+        std::cerr << "Error creating socket!" << std::endl;
+        freeaddrinfo(res);
+        return false;
+    }
+
+    if (connect(clientSd, res->ai_addr, res->ai_addrlen) < 0)
+    {
+        std::cerr << "Error connecting to server!" << std::endl;
+        close(clientSd);
+        freeaddrinfo(res);
+        return false;
+    }
+
+    freeaddrinfo(res);
+    return true;
+}
+
+void Client::receiveMessages()
+{
+    std::vector<uint8_t> chunk(16384);
+    std::vector<uint8_t> buffer; // Bytes of frames that have not been handled yet
+    Message continued;           // Response reassembled from continued frames
+    bool continuing = false;
+    ssize_t sz;
+
+    while (!stopReceiving && (sz = recv(clientSd, chunk.data(), chunk.size(), 0)) > 0)
+    {
+        buffer.insert(buffer.end(), chunk.begin(), chunk.begin() + sz);
+
+        // Several frames can arrive in one read, and a frame can span reads
+        size_t used = 0;
+        while (true)
+        {
+            if (downloadRemaining > 0)
+            {
+                used += Client::receiveDownload(buffer.data() + used, buffer.size() - used);
+                if (downloadRemaining > 0)
+                {
+                    break;
+                }
+                continue;
+            }
+
+            size_t size;
+            Message response;
+            try
+            {
+                const Cipher *cipher = session.load()->cipher.get();
+                size = Message::frameSize(buffer.data() + used, buffer.size() - used, MAX_FRAME, cipher);
+                if (size == 0)
+                {
+                    break;
+                }
+                response = Message::deserialize(buffer.data() + used, size, cipher);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Deserialization Error: " << e.what() << std::endl;
+                used = buffer.size();
+                break;
+            }
+            used += size;
+
+            // Every frame is compressed on its own
+            if (response.isCompressed())
+            {
+                std::shared_ptr<const LzDictionary> dictionary;
+                if (response.dictionaryId())
+                {
+                    std::lock_guard<std::mutex> lock(dictionaryMutex);
+                    auto it = dictionaries.find(response.dictionaryId());
+                    if (it != dictionaries.end())
+                    {
+                        dictionary = it->second;
+                    }
+                }
+
+                if (!response.decompress(dictionary.get()))
+                {
+                    std::cerr << "Decompression Error: frame of command " << response.getCommand() << std::endl;
+                    continue;
+                }
+            }
+
+            // Oversize responses arrive as continued frames
+            if (continuing)
+            {
+                continued.append(response);
+                if (continued.isContinued())
+                {
+                    continue;
+                }
+                continuing = false;
+                response = std::move(continued);
+            }
+            else if (response.isContinued())
+            {
+                continued = std::move(response);
+                continuing = true;
+                continue;
+            }
+            Client::handleResponse(response);
+        }
+        buffer.erase(buffer.begin(), buffer.begin() + used);
+    }
+
+    if (sz < 0 && !stopReceiving)
+    {
+        std::cerr << "Error receiving message!" << std::endl;
+    }
+}
+
+void Client::sendMessageLoop()
+{
+    while (true)
+    {
+        std::string data;
+        std::getline(std::cin, data);
+
+        if (data == "!exit")
+        {
+            stopReceiving = true;
+            shutdown(clientSd, SHUT_RDWR);
+            close(clientSd); // Close the socket to unblock recv in receiveMessages
+            break;
+        }
+
+        // Check if the first character is '!', then call handleCommand
+        if (!data.empty() && data[0] == '!')
+        {
+            Message *msg = handleCommand(data);
+            if (msg != NULL)
+            {
+                Client::sendMessage(*msg);
+                delete msg;
+            }
+        }
+        else
+        {
+            std::cerr << "Not a command" << std::endl;
+        }
+    }
+}
+
+void Client::sendMessage(Message &msg)
+{
+    // Requests are never compressed
+    std::shared_ptr<const Session> current = session.load();
+    std::vector<uint8_t> serialized = msg.serialize({.maxFrame = current->maxFrame, .cipher = current->cipher.get()});
+
+    // The upload thread sends too
+    std::lock_guard<std::mutex> lock(sendMutex);
+    ssize_t bytesSent = send(clientSd, serialized.data(), serialized.size(), 0);
+    if (bytesSent < 0)
+    {
+        std::cerr << "Message not sent" << std::endl;
+    }
+}
+
+void Client::setRequest(Message &msg, const HistoryRequest &request)
+{
+    if (session.load()->has(FEATURE_COMPACT))
+    {
+        msg.setBody(request);
+        return;
+    }
+
+    // [channel or user, page], [page] for every conversation
+    if (!request.target.empty())
+    {
+        msg.addArg(request.target);
+    }
+    msg.addArg(std::to_string(request.page));
+}
+
+void Client::setRequest(Message &msg, const SearchRequest &request)
+{
+    if (session.load()->has(FEATURE_COMPACT))
+    {
+        msg.setBody(request);
+        return;
+    }
+
+    // [query, cursor], the cursor is left out for the first page
+    msg.addArg(request.query);
+    if (!request.cursor.empty())
+    {
+        msg.addArg(request.cursor);
+    }
+}
+
+void Client::setRequest(Message &msg, const ListRequest &request)
+{
+    if (session.load()->has(FEATURE_COMPACT))
+    {
+        msg.setBody(request);
+    }
+}
+
+// Requests sent this way do not wait for each other, their responses are told apart by id
+void Client::sendRequest(Message &msg, const std::string &label)
+{
+    if (session.load()->has(FEATURE_CORRELATION))
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        uint32_t id = nextCorrelation++;
+        msg.setCorrelation(id);
+        pending[id] = label;
+    }
+    Client::sendMessage(msg);
+}
+
+void Client::startDownload(const Message &msg)
+{
+    std::vector<std::string> args = msg.getArgs();
+    if (args.size() < 3)
+    {
+        return;
+    }
+
+    downloadName = args[0];
+    uint64_t size = std::stoull(args[1]);
+    uint64_t offset = std::stoull(args[2]);
+
+    // Header only answer, the ranges are fetched on their own connections
+    if (downloadStreams > 1)
+    {
+        Client::parallelDownload(downloadName, size);
+        downloadStreams = 1;
+        return;
+    }
+
+    // A non zero offset continues a partial file
+    downloadFile.open(downloadName, offset ? std::ios::binary | std::ios::in | std::ios::out : std::ios::binary | std::ios::out | std::ios::trunc);
+    downloadFile.seekp(offset);
+    downloadRemaining = args.size() >= 4 ? std::stoull(args[3]) : size - offset;
+
+    if (downloadRemaining == 0)
+    {
+        downloadFile.close();
+        std::cout << "Content saved to " << downloadName << std::endl;
+    }
+}
+
+size_t Client::receiveDownload(const uint8_t *data, size_t size)
+{
+    size_t n = std::min<uint64_t>(size, downloadRemaining);
+    downloadFile.write(reinterpret_cast<const char *>(data), n);
+    downloadRemaining -= n;
+
+    if (downloadRemaining == 0)
+    {
+        downloadFile.close();
+        std::cout << "Content saved to " << downloadName << std::endl;
+    }
+    return n;
+}
+
+void Client::parallelDownload(const std::string &filename, uint64_t size)
+{
+    if (downloadThread.joinable())
+    {
+        downloadThread.join();
+    }
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 or ftruncate(fd, size) != 0)
+    {
+        std::cerr << "Error opening file: " << filename << std::endl;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
+    }
+
+    RangeSource source{IP, port, tmp, tmpPassword, downloadFrom, downloadUid};
+    int streams = downloadStreams;
+    downloadThread = std::thread([source, filename, size, streams, fd]()
+                                 {
+                                     auto start = std::chrono::steady_clock::now();
+                                     bool ok = fetchParallel(source, size, streams, fd);
+                                     double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                                     close(fd);
+
+                                     if (!ok)
+                                     {
+                                         std::cerr << "File download failed: " << filename << std::endl;
+                                         return;
+                                     }
+                                     std::cout << "Content saved to " << filename << " (" << streams << " streams, "
+                                               << size / 1e6 / std::max(seconds, 1e-9) << " MB/s)" << std::endl; });
+}
+
+void Client::startUpload(const Message &msg)
+{
+    std::vector<std::string> args = msg.getArgs();
+    if (args.size() < 2 or uploadPath.empty())
+    {
+        return;
+    }
+
+    if (uploadThread.joinable())
+    {
+        uploadThread.join();
+    }
+
+    uploading = true;
+    uploadThread = std::thread(&Client::streamUpload, this, args[0], std::stoull(args[1]));
+}
+
+void Client::streamUpload(std::string transferId, uint64_t offset)
+{
+    std::ifstream file(uploadPath, std::ios::binary);
+    file.seekg(offset);
+
+    // [transfer_id, offset, bytes] as typed fields, each field costs a kind byte and a length
+    // Chunks fill a negotiated frame, up to the largest typed field, and a version 1 frame otherwise
+    size_t maxFrame = session.load()->maxFrame;
+    size_t overhead = 3 * 3 + transferId.size() + sizeof(uint64_t);
+    size_t room = maxFrame > MAX_PAYLOAD ? std::min<size_t>(maxFrame - overhead, MAX_FIELD) : MAX_PAYLOAD - overhead;
+    std::vector<uint8_t> buffer(room);
+    while (uploading && file)
+    {
+        file.read(reinterpret_cast<char *>(buffer.data()), room);
+        size_t n = file.gcount();
+        if (n == 0)
+        {
+            break;
+        }
+
+        Message chunk;
+        chunk.setType(0x01);
+        chunk.setCommand(0x75);
+        chunk.setTyped(true);
+        chunk.addArg(transferId);
+        chunk.addUint(offset);
+        chunk.addBytes(buffer.data(), n);
+        Client::sendMessage(chunk);
+        offset += n;
+    }
+
+    if (uploading)
+    {
+        Message end;
+        end.setType(0x01);
+        end.setCommand(0x76);
+        end.addArg(transferId);
+        Client::sendMessage(end);
+    }
+    uploading = false;
+}
+
+void Client::run()
+{
+    if (!connectToServer())
+    {
+        return;
+    }
+
+    std::cout << "Connected to " << IP << " on port " << port << std::endl;
+
+    try
+    {
+        receiveThread = std::thread(&Client::receiveMessages, this);
+    }
+    catch (const std::exception &e)
+    {
+        throw std::runtime_error("Error creating receive thread: " + std::string(e.what()));
+    }
+
+    // Ask for large frames and compressed responses, an older server answers 0x00 and frames stay at 1020 bytes
+    Message hello;
+    hello.setType(0x01);
+    hello.setCommand(0x01);
+    hello.setBody(Hello{PROTOCOL_VERSION, MAX_FRAME, {"lz"}, FEATURES});
+    Client::sendMessage(hello);
+
+    sendMessageLoop();
+
+    if (receiveThread.joinable())
+    {
+        receiveThread.join();
+    }
+}
@@ -7,17 +7,24 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <vector>
 #include <string>
 #include <atomic>
+#include <mutex>
 #include <thread>
 #include <sstream>
 #include <fstream>
 #include <filesystem>
 #include <algorithm>
+#include <chrono>
+#include <map>
 
 #include "../protocol/message.hpp"
+#include "../protocol/schema.hpp"
+#include "../protocol/session.hpp"
+#include "range_fetch.hpp"
 
 class Client
 {
@@ -27,12 +34,45 @@ private:
     int clientSd;
     std::atomic<bool> stopReceiving;
     std::thread receiveThread;
+    std::mutex sendMutex;
+    // Agreed with the server by the hello, version 1 until it is answered
+    std::atomic<std::shared_ptr<const Session>> session{std::make_shared<const Session>()};
+
+    // Outstanding requests sent with a correlation id, labelled for their responses
+    std::mutex pendingMutex;
+    std::map<uint32_t, std::string> pending;
+    uint32_t nextCorrelation = 1;
+
+    // Dictionaries registered with the server by id, compressed responses name the one they use
+    std::mutex dictionaryMutex;
+    std::map<uint32_t, std::shared_ptr<const LzDictionary>> dictionaries;
+
+    // Streaming upload, one at a time
+    std::atomic<bool> uploading;
+    std::string uploadPath;
+    std::thread uploadThread;
+
+    // Raw body of a streamed download, it follows its 0x77 header
+    std::ofstream downloadFile;
+    std::string downloadName;
+    uint64_t downloadRemaining;
+
+    // Parallel download, the 0x77 header gives the size to split into ranges
+    int downloadStreams;
+    std::string downloadFrom;
+    std::string downloadUid;
+    std::thread downloadThread;
 
     std::string channel;
     std::string user;
 
     std::string nick;
     std::string tmp;
+    std::string tmpPassword; // Range connections log in with it
+
+    // Last search, continued with !more
+    std::string searchQuery;
+    std::string searchCursor;
 
 private:
     void receiveMessages();
@@ -40,13 +80,25 @@ private:
     void sendMessageLoop();
 
     void sendMessage(Message &msg);
+    void sendRequest(Message &msg, const std::string &label);
+
+    // Compact body when the server agreed to them, the text arguments otherwise
+    void setRequest(Message &msg, const HistoryRequest &request);
+    void setRequest(Message &msg, const SearchRequest &request);
+    void setRequest(Message &msg, const ListRequest &request);
     Message *handleCommand(const std::string &data);
 
     void handleResponse(Message &response);
 
     void channelMessage(const Message &msg);
     void userMessage(const Message &msg);
+    void searchResults(const Message &msg);
     void saveToFile(const Message &msg);
+    void startDownload(const Message &msg);
+    size_t receiveDownload(const uint8_t *data, size_t size);
+    void parallelDownload(const std::string &filename, uint64_t size);
+    void startUpload(const Message &msg);
+    void streamUpload(std::string transferId, uint64_t offset);
 
 public:
     Client(const std::string &ip, int port);
@@ -32,6 +32,28 @@ Message *Client::handleCommand(const std::string &data)
             std::string recipient = tokens[1];                                                  // The second token is the recipient
             std::string message = command.substr(command.find(' ', command.find(' ') + 1) + 1); // Everything after the first space (recipient) is the message text
 
+            // !msg alice,bob,#general text, one request per recipient, all sent without waiting
+            if (recipient.find(',') != std::string::npos)
+            {
+                std::istringstream recipients(recipient);
+                std::string name;
+                while (std::getline(recipients, name, ','))
+                {
+                    if (name.empty())
+                    {
+                        continue;
+                    }
+                    Message each;
+                    each.setType(0x01);
+                    each.setCommand(name[0] == '#' ? 0x30 : 0x31);
+                    each.addArg(name);
+                    each.addArg(message);
+                    Client::sendRequest(each, "msg " + name);
+                }
+                delete request;
+                return NULL;
+            }
+
             if (recipient[0] == '#')
             {
                 request->setCommand(0x30); // channels
@@ -57,6 +79,7 @@ Message *Client::handleCommand(const std::string &data)
             std::string username = tokens[1];
             this->tmp = username;
             std::string password = tokens[2];
+            this->tmpPassword = password;
             request->setCommand(0x10); // Login command
             request->addArg(username); // Add username
             request->addArg(password); // Add password
@@ -101,11 +124,45 @@ Message *Client::handleCommand(const std::string &data)
     {
         // No arguments for listchannels
         request->setCommand(0x20); // List channels command
+        Client::setRequest(*request, ListRequest{});
     }
     else if (cmd == "listu")
     {
         // No arguments for listusers
         request->setCommand(0x21); // List users command
+        Client::setRequest(*request, ListRequest{});
+    }
+    else if (cmd == "stats")
+    {
+        // No arguments for stats
+        request->setCommand(0x24); // Server statistics command
+    }
+    else if (cmd == "search")
+    {
+        // Expect the words to search for
+        if (tokens.size() >= 2)
+        {
+            this->searchQuery = command.substr(command.find(' ') + 1); // Everything after the command
+            this->searchCursor.clear();
+            request->setCommand(0x25);                       // Search messages
+            Client::setRequest(*request, SearchRequest{this->searchQuery, ""}); // First page, no cursor
+        }
+        else
+        {
+            std::cerr << "Invalid command format for !search. Expected: !search <words>" << std::endl;
+            return NULL;
+        }
+    }
+    else if (cmd == "more")
+    {
+        // Next page of the last search
+        if (this->searchCursor.empty())
+        {
+            std::cerr << "No more search results" << std::endl;
+            return NULL;
+        }
+        request->setCommand(0x25); // Search messages
+        Client::setRequest(*request, SearchRequest{this->searchQuery, this->searchCursor});
     }
     else if (cmd == "getMsgU")
     {
@@ -129,8 +186,8 @@ Message *Client::handleCommand(const std::string &data)
                 return NULL;
             }
 
-            request->setCommand(0x22);             // Get user messages
-            request->addArg(std::to_string(page)); // Add page number
+            request->setCommand(0x22); // Get user messages
+            Client::setRequest(*request, HistoryRequest{"", uint32_t(page)});
         }
         // Expect two arguments: username (string) and page (integer)
         else if (tokens.size() == 3) // tokens[1] is username, tokens[2] is page
@@ -152,9 +209,8 @@ Message *Client::handleCommand(const std::string &data)
                 return NULL;
             }
 
-            request->setCommand(0x22);             // Get user messages
-            request->addArg(username);             // Add username name
-            request->addArg(std::to_string(page)); // Add page number
+            request->setCommand(0x22); // Get user messages
+            Client::setRequest(*request, HistoryRequest{username, uint32_t(page)});
         }
         else
         {
@@ -169,10 +225,15 @@ Message *Client::handleCommand(const std::string &data)
         {
             std::string channel = tokens[1];
             int page = 0;
+            int last = 0;
 
             try
             {
                 page = std::stoi(tokens[2]); // Convert page to integer
+
+                // !getMsgC #general 0-4, the pages are requested together and arrive as they are ready
+                size_t dash = tokens[2].find('-', 1);
+                last = dash == std::string::npos ? page : std::stoi(tokens[2].substr(dash + 1));
             }
             catch (const std::invalid_argument &e)
             {
@@ -185,9 +246,22 @@ Message *Client::handleCommand(const std::string &data)
                 return NULL;
             }
 
-            request->setCommand(0x23);             // Get channel messages
-            request->addArg(channel);              // Add channel name
-            request->addArg(std::to_string(page)); // Add page number
+            if (last > page)
+            {
+                for (int each = page; each <= last; ++each)
+                {
+                    Message history;
+                    history.setType(0x01);
+                    history.setCommand(0x23);
+                    Client::setRequest(history, HistoryRequest{channel, uint32_t(each)});
+                    Client::sendRequest(history, channel + " page " + std::to_string(each));
+                }
+                delete request;
+                return NULL;
+            }
+
+            request->setCommand(0x23); // Get channel messages
+            Client::setRequest(*request, HistoryRequest{channel, uint32_t(page)});
         }
         else
         {
@@ -293,80 +367,140 @@ Message *Client::handleCommand(const std::string &data)
             return NULL;
         }
     }
-    else if (cmd == "ul")
+    else if (cmd == "dict")
     {
-        if (tokens.size() == 3)
+        // !dict <file>, sample text the server compresses later responses against
+        std::ifstream file(tokens.size() >= 2 ? tokens[1] : "", std::ios::binary);
+        if (!file)
         {
-            std::string recipient = tokens[1]; // The second token is the recipient (user or channel)
-            std::string filename = tokens[2];  // The third token is the filename
+            std::cerr << "Invalid command format for !dict. Expected: !dict <file>" << std::endl;
+            return NULL;
+        }
+        if (session.load()->compressAbove == 0)
+        {
+            std::cerr << "The server does not compress responses" << std::endl;
+            return NULL;
+        }
 
-            // Check if the file exists
-            if (!std::filesystem::exists(filename))
+        // Only the end of a long sample is kept
+        std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (bytes.size() > LZ_MAX_DICTIONARY)
+        {
+            bytes.erase(bytes.begin(), bytes.end() - LZ_MAX_DICTIONARY);
+        }
+
+        // Known before the server can use it
+        uint32_t id;
+        {
+            std::lock_guard<std::mutex> lock(dictionaryMutex);
+            id = dictionaries.size() + 1;
+            dictionaries[id] = std::make_shared<const LzDictionary>(id, bytes.data(), bytes.size());
+        }
+
+        request->setCommand(0x05);
+        request->setTyped(true);
+        request->addUint(id);
+        request->addBytes(bytes.data(), bytes.size());
+    }
+    else if (cmd == "batch")
+    {
+        // !batch <file>, every line of the file is a command, sent together in one request
+        std::ifstream file(tokens.size() >= 2 ? tokens[1] : "");
+        if (!file)
+        {
+            std::cerr << "Invalid command format for !batch. Expected: !batch <file>" << std::endl;
+            return NULL;
+        }
+
+        if (!session.load()->has(FEATURE_BATCH))
+        {
+            std::cerr << "The server does not take batches" << std::endl;
+            return NULL;
+        }
+
+        BatchRequest batch;
+        std::string line;
+        while (std::getline(file, line) and batch.requests.size() < MAX_BATCH)
+        {
+            if (line.empty() or line[0] != '!' or line.starts_with("!batch"))
             {
-                std::cerr << "File does not exist: " << filename << std::endl;
-                return NULL;
+                continue;
             }
 
-            // Open the file for reading
-            std::ifstream file(filename, std::ios::binary);
-            if (!file)
+            // Commands that send by themselves, like !msg a,b text, return nothing to add
+            Message *sub = handleCommand(line);
+            if (sub != NULL)
             {
-                std::cerr << "Failed to open file: " << filename << std::endl;
-                return NULL;
+                batch.requests.push_back(batchEntry(*sub));
+                delete sub;
             }
+        }
 
-            // Read the first 512 bytes from the file
-            std::vector<char> buffer(512);
-            file.read(buffer.data(), buffer.size());
+        request->setCommand(0x02);
+        request->setBody(batch);
+    }
+    else if (cmd == "ul")
+    {
+        if (tokens.size() == 3 or tokens.size() == 4)
+        {
+            std::string recipient = tokens[1];                            // The second token is the recipient (user or channel)
+            std::string filename = tokens[2];                             // The third token is the filename
+            std::string transferId = tokens.size() == 4 ? tokens[3] : ""; // The optional fourth resumes an upload
 
-            // Check how many bytes were actually read
-            std::streamsize bytesRead = file.gcount();
-            if (bytesRead == 0)
+            // Check if the file exists
+            if (!std::filesystem::exists(filename))
             {
-                std::cerr << "Failed to read from file or file is empty: " << filename << std::endl;
+                std::cerr << "File does not exist: " << filename << std::endl;
                 return NULL;
             }
 
-            // Check for null bytes in the data
-            bool containsNullByte = std::any_of(buffer.begin(), buffer.begin() + bytesRead, [](char c)
-                                                { return c == '\0'; });
-            if (containsNullByte)
+            if (uploading)
             {
-                std::cerr << "Invalid file: contains null byte(s)" << std::endl;
+                std::cerr << "Another upload is in progress" << std::endl;
                 return NULL;
             }
 
-            // Set the command for the request
-            request->setCommand(0x60);
+            // The file is streamed in chunks once the server answers with a transfer id
+            uploadPath = filename;
 
-            // Add the recipient (user/channel) and filename
+            request->setCommand(0x60);
+            request->setTyped(true);
             request->addArg(recipient);
-            request->addArg(filename);
-
-            // Add the read data (up to 512 bytes)
-            request->addArg(std::string(buffer.begin(), buffer.begin() + bytesRead));
-
-            std::cout << "File data sent successfully." << std::endl;
+            request->addArg(std::filesystem::path(filename).filename().string());
+            request->addUint(std::filesystem::file_size(filename));
+            request->addArg(transferId);
         }
         else
         {
-            std::cerr << "Invalid command format for !send" << std::endl;
+            std::cerr << "Invalid command format for !ul" << std::endl;
             return NULL;
         }
     }
     else if (cmd == "dl")
     {
-        if (tokens.size() == 3)
+        if (tokens.size() == 3 or tokens.size() == 4)
         {
             std::string from = tokens[1]; // The second token is the (user or channel)
             std::string uid = tokens[2];  // The third token is the uuid
+            int streams = tokens.size() == 4 ? std::atoi(tokens[3].c_str()) : 1; // The optional fourth fetches ranges in parallel
 
             // Set the command for the request
             request->setCommand(0x61);
 
-            // Add the (user/channel) and uid
+            // Add the (user/channel) and uid, the file is streamed from offset 0
+            request->setTyped(true);
             request->addArg(from);
             request->addArg(uid);
+            request->addUint(0);
+
+            // A zero length range only returns the size, the ranges follow on their own connections
+            downloadStreams = std::max(1, std::min(streams, DL_MAX_STREAMS));
+            if (downloadStreams > 1)
+            {
+                downloadFrom = from;
+                downloadUid = uid;
+                request->addUint(0);
+            }
         }
         else
         {
@@ -0,0 +1,214 @@
+#include "range_fetch.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../protocol/message.hpp"
+
+static int connectTo(const std::string &ip, int port)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(ip.c_str(), std::to_string(port).c_str(), &hints, &res) != 0)
+    {
+        return -1;
+    }
+
+    int sd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sd >= 0 and connect(sd, res->ai_addr, res->ai_addrlen) < 0)
+    {
+        close(sd);
+        sd = -1;
+    }
+    freeaddrinfo(res);
+    return sd;
+}
+
+static bool sendAll(int sd, const Message &msg)
+{
+    std::vector<uint8_t> bytes = msg.serialize();
+    size_t sent = 0;
+    while (sent < bytes.size())
+    {
+        ssize_t n = send(sd, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+// Next frame from the connection, buffer keeps bytes read past it
+static bool readFrame(int sd, std::vector<uint8_t> &buffer, Message &msg)
+{
+    std::vector<uint8_t> chunk(16384);
+    while (true)
+    {
+        size_t size = Message::frameSize(buffer.data(), buffer.size());
+        if (size > 0)
+        {
+            msg = Message::deserialize(buffer.data(), size);
+            buffer.erase(buffer.begin(), buffer.begin() + size);
+            return true;
+        }
+
+        ssize_t n = recv(sd, chunk.data(), chunk.size(), 0);
+        if (n <= 0)
+        {
+            return false;
+        }
+        buffer.insert(buffer.end(), chunk.begin(), chunk.begin() + n);
+    }
+}
+
+static bool writeAt(int fd, const uint8_t *data, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n < 0)
+        {
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+bool fetchRange(const RangeSource &source, uint64_t offset, uint64_t length, int fd, uint64_t *size)
+{
+    int sd = connectTo(source.ip, source.port);
+    if (sd < 0)
+    {
+        std::cerr << "Error connecting to server!" << std::endl;
+        return false;
+    }
+
+    std::vector<uint8_t> buffer;
+    Message msg;
+    bool ok = false;
+
+    try
+    {
+        Message login;
+        login.setType(0x01);
+        login.setCommand(0x10);
+        login.addArg(source.user);
+        login.addArg(source.password);
+
+        // Downloads are refused until the login has been answered
+        if (!sendAll(sd, login) or !readFrame(sd, buffer, msg) or (msg.getCommand() != 0x10 and msg.getCommand() != 0x11))
+        {
+            close(sd);
+            return false;
+        }
+
+        Message request;
+        request.setType(0x01);
+        request.setCommand(0x61);
+        request.setTyped(true);
+        request.addArg(source.from);
+        request.addArg(source.uid);
+        request.addUint(offset);
+        request.addUint(length);
+
+        // Other frames, such as chat traffic, may arrive before the header
+        bool header = false;
+        if (sendAll(sd, request))
+        {
+            while (readFrame(sd, buffer, msg))
+            {
+                if (msg.getCommand() == 0x77 or msg.getCommand() == 0x73)
+                {
+                    header = msg.getCommand() == 0x77;
+                    break;
+                }
+            }
+        }
+
+        std::vector<std::string> args = msg.getArgs();
+        if (header and args.size() >= 4)
+        {
+            if (size)
+            {
+                *size = std::stoull(args[1]);
+            }
+
+            // Raw body right after the header
+            uint64_t remaining = std::stoull(args[3]);
+            uint64_t position = offset;
+            std::vector<uint8_t> chunk(1 << 16);
+            ok = true;
+            while (ok and remaining > 0)
+            {
+                size_t n = std::min<uint64_t>(buffer.size(), remaining);
+                if (n == 0)
+                {
+                    ssize_t got = recv(sd, chunk.data(), std::min<uint64_t>(chunk.size(), remaining), 0);
+                    if (got <= 0)
+                    {
+                        ok = false;
+                        break;
+                    }
+                    ok = writeAt(fd, chunk.data(), got, position);
+                    n = got;
+                }
+                else
+                {
+                    ok = writeAt(fd, buffer.data(), n, position);
+                    buffer.erase(buffer.begin(), buffer.begin() + n);
+                }
+                position += n;
+                remaining -= n;
+            }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Deserialization Error: " << e.what() << std::endl;
+        ok = false;
+    }
+
+    close(sd);
+    return ok;
+}
+
+bool fetchParallel(const RangeSource &source, uint64_t size, int streams, int fd)
+{
+    streams = std::max(1, std::min(streams, DL_MAX_STREAMS));
+    if (size < static_cast<uint64_t>(streams))
+    {
+        streams = 1;
+    }
+
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < streams; ++i)
+    {
+        uint64_t begin = size * i / streams;
+        uint64_t end = size * (i + 1) / streams;
+        threads.emplace_back([&source, &ok, begin, end, fd]()
+                             {
+                                 if (!fetchRange(source, begin, end - begin, fd))
+                                     ok = false; });
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    return ok;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#define DL_MAX_STREAMS 16 // Upper bound of parallel range connections
+
+// Where a file is fetched from, each range logs in on its own connection
+struct RangeSource
+{
+    std::string ip;
+    int port;
+    std::string user;
+    std::string password;
+    std::string from; // User or #channel the file was sent to
+    std::string uid;
+};
+
+// Fetch [offset, offset + length) into fd at the same offset, size receives the file size
+// A zero length fetches only the header
+bool fetchRange(const RangeSource &source, uint64_t offset, uint64_t length, int fd, uint64_t *size = nullptr);
+
+// Split [0, size) into streams ranges fetched concurrently
+bool fetchParallel(const RangeSource &source, uint64_t size, int streams, int fd);
@@ -10,6 +10,18 @@ void Client::handleResponse(Message &response)
     int command = response.getCommand();
     std::vector<std::string> args = response.getArgs();
 
+    // Answer to one of several outstanding requests
+    if (response.isCorrelated())
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        auto it = pending.find(response.getCorrelation());
+        if (it != pending.end())
+        {
+            std::cerr << INFO << "[" << it->second << "]" << std::endl;
+            pending.erase(it);
+        }
+    }
+
     switch (command)
     {
     case 0x00:
@@ -24,6 +36,65 @@ void Client::handleResponse(Message &response)
         std::cerr << ERROR << "Not Authenticated" << std::endl;
         break;
 
+    case 0x04:
+    {
+        // Batch answer, the responses of each sub-request in request order
+        BatchResponse batch;
+        if (!response.getBody(batch))
+        {
+            std::cerr << ERROR << "Malformed batch response" << std::endl;
+            break;
+        }
+
+        for (size_t i = 0; i < batch.results.size(); ++i)
+        {
+            for (const BatchEntry &entry : batch.results[i].responses)
+            {
+                std::cerr << INFO << "[batch " << i << "]" << std::endl;
+                Message sub = batchMessage(entry, 0x02);
+                Client::handleResponse(sub);
+            }
+        }
+        break;
+    }
+
+    case 0x05:
+        std::cerr << INFO << "Dictionary set" << std::endl;
+        break;
+
+    case 0x03:
+    {
+        // Hello answer, a compact Hello, or [version, max_frame, codec] from older servers
+        Hello agreed;
+        if (response.isCompact())
+        {
+            if (!response.getBody(agreed))
+            {
+                break;
+            }
+        }
+        else if (args.size() >= 2)
+        {
+            agreed.version = std::stoul(args[0]);
+            agreed.maxFrame = std::stoul(args[1]);
+            if (args.size() >= 3)
+            {
+                agreed.codecs.push_back(args[2]);
+            }
+            agreed.features = agreed.version >= 3 ? FEATURES : 0;
+        }
+
+        // The connection keeps its cipher, only the framing changes
+        auto next = std::make_shared<Session>();
+        next->cipher = session.load()->cipher;
+        next->version = agreed.version;
+        next->maxFrame = agreed.version >= 2 ? agreed.maxFrame : 0;
+        next->compressAbove = !agreed.codecs.empty() and agreed.codecs[0] == "lz" ? COMPRESS_THRESHOLD : 0;
+        next->features = agreed.features;
+        session = std::move(next);
+        break;
+    }
+
     // Login and User Management
     case 0x10:
         std::cerr << INFO << "Login successful" << std::endl;
@@ -75,25 +146,59 @@ void Client::handleResponse(Message &response)
         std::cerr << ERROR << "Failed to receive message" << std::endl;
         break;
 
+    case 0x35:
+        Client::searchResults(response);
+        break;
+
+    case 0x36:
+        std::cerr << ERROR << "Search failed" << std::endl;
+        break;
+
     // Channel management
     case 0x40:
+    {
+        NameList list{args};
+        if (response.isCompact() and !response.getBody(list))
+        {
+            std::cerr << ERROR << "Malformed channel list" << std::endl;
+            break;
+        }
+
         std::cerr << INFO << "List of channels: " << std::endl;
         std::cout << "Channels: ";
-        for (auto &ch : args)
+        for (auto &ch : list.names)
         {
             std::cout << "#" << ch << " ";
         }
         std::cout << std::endl;
         break;
+    }
 
     case 0x41:
+    {
+        NameList list{args};
+        if (response.isCompact() and !response.getBody(list))
+        {
+            std::cerr << ERROR << "Malformed user list" << std::endl;
+            break;
+        }
+
         std::cerr << INFO << "List of users: ";
-        for (auto &ch : args)
+        for (auto &ch : list.names)
         {
             std::cout << ch << " ";
         }
         std::cout << std::endl;
         break;
+    }
+
+    case 0x42:
+        std::cerr << INFO << "Server statistics: " << std::endl;
+        for (auto &line : args)
+        {
+            std::cout << line << std::endl;
+        }
+        break;
 
     case 0x50:
         std::cerr << INFO << "You have joined the channel" << std::endl;
@@ -173,12 +278,27 @@ void Client::handleResponse(Message &response)
 
     case 0x72:
         std::cerr << ERROR << "File upload failed" << std::endl;
+        uploading = false;
         break;
 
     case 0x73:
         std::cerr << ERROR << "File download failed" << std::endl;
         break;
 
+    case 0x74:
+        std::cerr << INFO << "Uploading, resume with transfer id " << response.getArgs()[0] << std::endl;
+        Client::startUpload(response);
+        break;
+
+    case 0x75:
+        // Chunk acknowledgement
+        break;
+
+    case 0x77:
+        std::cerr << INFO << "File downloading" << std::endl;
+        Client::startDownload(response);
+        break;
+
     default:
         std::cerr << "Type: 0x" << std::setw(2) << std::setfill('0') << std::hex << (int)type
                   << ", Command: 0x" << std::setw(2) << std::setfill('0') << std::hex << (int)command
@@ -196,6 +316,26 @@ void Client::handleResponse(Message &response)
 
 void Client::channelMessage(const Message &msg)
 {
+    if (msg.isCompact())
+    {
+        HistoryPage page;
+        if (!msg.getBody(page))
+        {
+            std::cerr << "Malformed history page." << std::endl;
+            return;
+        }
+
+        for (const ChatMessage &message : page.messages)
+        {
+            std::cout << "Channel: " << page.target
+                      << "  Sender: " << message.sender
+                      << "  Message: " << message.text
+                      << "  Timestamp: " << epochText(message.sentAt)
+                      << std::endl;
+        }
+        return;
+    }
+
     std::vector<std::string> args = msg.getArgs();
 
     // Check if there's at least one argument (the number of messages)
@@ -206,7 +346,7 @@ void Client::channelMessage(const Message &msg)
     }
 
     // The first argument is the number of messages
-    int numMessages = std::stoi(args[0]);
+    size_t numMessages = std::stoul(args[0]);
 
     // Ensure there are enough arguments for the number of messages
     if (args.size() != 1 + numMessages * 4)
@@ -217,9 +357,9 @@ void Client::channelMessage(const Message &msg)
     }
 
     // Process each message
-    for (int i = 0; i < numMessages; ++i)
+    for (size_t i = 0; i < numMessages; ++i)
     {
-        int baseIndex = 1 + i * 4; // Calculate the starting index for each message's data
+        size_t baseIndex = 1 + i * 4; // Calculate the starting index for each message's data
 
         // Check if we have enough arguments for the current message
         if (baseIndex + 3 >= args.size())
@@ -245,6 +385,25 @@ void Client::channelMessage(const Message &msg)
 
 void Client::userMessage(const Message &msg)
 {
+    if (msg.isCompact())
+    {
+        HistoryPage page;
+        if (!msg.getBody(page))
+        {
+            std::cerr << "Malformed history page." << std::endl;
+            return;
+        }
+
+        for (const ChatMessage &message : page.messages)
+        {
+            std::cout << "Sender: " << message.sender
+                      << "  Message: " << message.text
+                      << "  Timestamp: " << epochText(message.sentAt)
+                      << std::endl;
+        }
+        return;
+    }
+
     std::vector<std::string> args = msg.getArgs();
 
     // Check if there's at least one argument (the number of messages)
@@ -255,7 +414,7 @@ void Client::userMessage(const Message &msg)
     }
 
     // The first argument is the number of messages
-    int numMessages = std::stoi(args[0]);
+    size_t numMessages = std::stoul(args[0]);
 
     // Ensure there are enough arguments for the number of messages
     if (args.size() != 1 + numMessages * 3)
@@ -266,9 +425,9 @@ void Client::userMessage(const Message &msg)
     }
 
     // Process each message
-    for (int i = 0; i < numMessages; ++i)
+    for (size_t i = 0; i < numMessages; ++i)
     {
-        int baseIndex = 1 + i * 3; // Calculate the starting index for each message's data
+        size_t baseIndex = 1 + i * 3; // Calculate the starting index for each message's data
 
         // Check if we have enough arguments for the current message
         if (baseIndex + 2 >= args.size())
@@ -290,6 +449,71 @@ void Client::userMessage(const Message &msg)
     }
 }
 
+void Client::searchResults(const Message &msg)
+{
+    if (msg.isCompact())
+    {
+        SearchPage page;
+        if (!msg.getBody(page))
+        {
+            std::cerr << "Malformed search results." << std::endl;
+            return;
+        }
+
+        this->searchCursor = page.cursor;
+        for (const SearchHit &hit : page.hits)
+        {
+            std::cout << "In: " << hit.target
+                      << "  Sender: " << hit.message.sender
+                      << "  Message: " << hit.message.text
+                      << "  Timestamp: " << epochText(hit.message.sentAt)
+                      << std::endl;
+        }
+
+        if (!this->searchCursor.empty())
+        {
+            std::cout << "More results available, use !more" << std::endl;
+        }
+        return;
+    }
+
+    std::vector<std::string> args = msg.getArgs();
+
+    // Number of results and the cursor of the next page
+    if (args.size() < 2)
+    {
+        std::cerr << "No arguments in the message." << std::endl;
+        return;
+    }
+
+    size_t numResults = std::stoul(args[0]);
+    this->searchCursor = args[1];
+
+    // Ensure there are enough arguments for the number of results
+    if (args.size() != 2 + numResults * 4)
+    {
+        std::cerr << "Invalid number of arguments. Expected " << (2 + numResults * 4)
+                  << " arguments for " << numResults << " results, got " << args.size() << "." << std::endl;
+        return;
+    }
+
+    for (size_t i = 0; i < numResults; ++i)
+    {
+        size_t baseIndex = 2 + i * 4;
+
+        std::cout << "In: " << args[baseIndex]
+                  << "  Sender: " << args[baseIndex + 1]
+                  << "  Message: " << args[baseIndex + 2]
+                  << "  Timestamp: " << args[baseIndex + 3]
+                  << std::endl;
+    }
+
+    if (!this->searchCursor.empty())
+    {
+        std::cout << "More results available, use !more" << std::endl;
+    }
+}
+
 void Client::saveToFile(const Message &msg)
 {
     std::vector<std::string> args = msg.getArgs();
@@ -305,7 +529,7 @@ void Client::saveToFile(const Message &msg)
     std::string content = args[1];
 
     // Open the file in output mode (creates the file if it doesn't exist)
-    std::ofstream file(filename);
+    std::ofstream file(filename, std::ios::binary);
 
     // Check if the file was successfully opened
     if (file.is_open())
@@ -0,0 +1,141 @@
+// Codec benchmark: serialize, deserialize, addArg and getArgs over payload sizes and argument counts
+// Usage: ./bench_codec [megabytes]
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "message.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// Every heap allocation of the process is counted, the benchmark is single threaded
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    if (void *p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+struct Sample
+{
+    double ns;     // Per operation
+    double allocs; // Per operation
+};
+
+// ops operations run by fn, after a warm up round
+template <typename Fn>
+static Sample measure(size_t ops, Fn fn)
+{
+    fn();
+
+    size_t before = allocations;
+    auto start = Clock::now();
+    fn();
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    return {ns / ops, double(allocations - before) / ops};
+}
+
+static void report(const char *name, size_t args, size_t bytes, const Sample &s)
+{
+    std::cout << std::left << std::setw(13) << name << std::right << std::setw(5) << args << " args"
+              << std::setw(9) << bytes << " B" << std::fixed << std::setprecision(1)
+              << std::setw(11) << s.ns << " ns/op" << std::setw(8) << s.allocs << " allocs/op" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t total = (argc > 1 ? std::stoul(argv[1]) : 256) << 20; // Payload bytes processed per case
+    const size_t sizes[] = {16, 256, MAX_PAYLOAD, 16384, 262144};
+    const size_t counts[] = {1, 4, 16};
+
+    size_t sink = 0;
+    for (size_t size : sizes)
+    {
+        for (size_t count : counts)
+        {
+            // Arguments are NUL terminated, together they fill the payload
+            if (size / count < 2)
+            {
+                continue;
+            }
+            const std::string arg(size / count - 1, 'x');
+            size_t bytes = count * (arg.size() + 1);
+            size_t rounds = std::clamp<size_t>(total / bytes, 1000, 1000000);
+
+            // Larger payloads go in one wide version 2 frame
+            size_t maxFrame = bytes > MAX_PAYLOAD ? MAX_FRAME : 0;
+
+            Message msg;
+            msg.setType(0x02);
+            msg.setCommand(0x33);
+            for (size_t i = 0; i < count; ++i)
+            {
+                msg.addArg(arg);
+            }
+            const std::vector<uint8_t> frame = msg.serialize(maxFrame);
+
+            // A fresh message per round, as handlers build their responses
+            Sample s = measure(rounds * count, [&]
+                               {
+                                   for (size_t r = 0; r < rounds; ++r)
+                                   {
+                                       Message m;
+                                       for (size_t i = 0; i < count; ++i)
+                                       {
+                                           m.addArg(arg);
+                                       }
+                                       sink += m.getPayload().size();
+                                   } });
+            report("addArg", count, bytes, s);
+
+            s = measure(rounds, [&]
+                        {
+                            for (size_t r = 0; r < rounds; ++r)
+                            {
+                                sink += msg.getArgs().size();
+                            } });
+            report("getArgs", count, bytes, s);
+
+            // Frames go back to the pool once sent, as the server does
+            s = measure(rounds, [&]
+                        {
+                            for (size_t r = 0; r < rounds; ++r)
+                            {
+                                std::vector<uint8_t> frames = msg.serialize(maxFrame);
+                                sink += frames.size();
+                                BufferPool::give(std::move(frames));
+                            } });
+            report("serialize", count, bytes, s);
+
+            s = measure(rounds, [&]
+                        {
+                            for (size_t r = 0; r < rounds; ++r)
+                            {
+                                sink += Message::deserialize(frame.data(), frame.size()).getPayload().size();
+                            } });
+            report("deserialize", count, bytes, s);
+        }
+    }
+
+    return sink == 0;
+}
@@ -0,0 +1,254 @@
+// Protocol benchmark: cipher kernels, frame decoding, payload encodings and compression
+// Usage: ./bench_protocol [megabytes]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <vector>
+
+#include "message.hpp"
+#include "schema.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+// Heap allocations of the process are counted, every case reports them per operation
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    if (void *p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+// Time stamp counter cycles, nominal frequency on current CPUs
+static uint64_t cycles()
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+struct Sample
+{
+    double seconds;
+    uint64_t cycles;
+    size_t allocs; // Heap allocations of the timed run
+};
+
+template <typename Fn>
+static Sample measure(Fn fn)
+{
+    // Warm up caches and the vector units first
+    fn();
+
+    size_t before = allocations;
+    auto start = Clock::now();
+    uint64_t c0 = cycles();
+    fn();
+    uint64_t c1 = cycles();
+    return {std::chrono::duration<double>(Clock::now() - start).count(), c1 - c0, allocations - before};
+}
+
+static void report(const std::string &name, size_t size, size_t bytes, const Sample &s)
+{
+    std::cout << std::left << std::setw(18) << name << std::right << std::setw(9) << size << " B"
+              << std::fixed << std::setprecision(2) << std::setw(10) << bytes / s.seconds / 1e9 << " GB/s";
+    if (s.cycles)
+    {
+        std::cout << std::setw(10) << double(bytes) / s.cycles << " B/cycle";
+    }
+    std::cout << std::setw(8) << std::setprecision(1) << double(s.allocs) * size / bytes << " allocs/op" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t total = (argc > 1 ? std::stoul(argv[1]) : 512) << 20; // Bytes processed per case
+    const size_t sizes[] = {64, MAX_PAYLOAD, 16384, 1 << 20};
+
+    std::cout << "active cipher: " << Cipher::active().name() << std::endl;
+
+    // Each kernel over frames of typical sizes
+    for (const XorCipher::KernelInfo &kernel : XorCipher::kernels())
+    {
+        XorCipher cipher(0xFF, kernel);
+        for (size_t size : sizes)
+        {
+            std::vector<uint8_t> buffer(size, 0x5A);
+            size_t rounds = std::max<size_t>(total / size, 1);
+            Sample s = measure([&]
+                               {
+                                   for (size_t i = 0; i < rounds; ++i)
+                                   {
+                                       cipher.apply(buffer.data(), size, 0);
+                                   } });
+            report(kernel.name, size, rounds * size, s);
+        }
+    }
+
+    // A full frame, decoded into an owning message and in place
+    Message msg;
+    msg.setType(0x01);
+    msg.setCommand(0x30);
+    msg.addArg("#general");
+    msg.addArg(std::string(MAX_PAYLOAD - 10, 'x'));
+    const std::vector<uint8_t> frame = msg.serialize();
+    size_t rounds = total / frame.size();
+
+    size_t sink = 0;
+    Sample s = measure([&]
+                       {
+                           for (size_t i = 0; i < rounds; ++i)
+                           {
+                               sink += Message::deserialize(frame.data(), frame.size()).getArgs().size();
+                           } });
+    report("deserialize", frame.size(), rounds * frame.size(), s);
+
+    std::vector<uint8_t> buffer = frame;
+    s = measure([&]
+                {
+                    for (size_t i = 0; i < rounds; ++i)
+                    {
+                        // Encrypted again for the next round, so this times two passes of the cipher
+                        sink += MessageView::decode(buffer.data(), buffer.size()).args().size();
+                        Cipher::active().apply(buffer.data(), buffer.size(), 0);
+                    } });
+    report("decode in place", frame.size(), rounds * frame.size(), s);
+
+    // A history page of PAGE rows as text arguments and as a compact body
+    const int PAGE = 10;
+    HistoryPage page{"#general", {}};
+    for (int i = 0; i < PAGE; ++i)
+    {
+        page.messages.push_back({"user" + std::to_string(i), "message number " + std::to_string(i) + " about the weekly release", 1760000000u + i * 61});
+    }
+
+    // The server holds timestamps as text, as they come from the database
+    std::vector<std::string> sentAt;
+    for (const ChatMessage &row : page.messages)
+    {
+        sentAt.push_back(epochText(row.sentAt));
+    }
+
+    auto textPage = [&]
+    {
+        Message m;
+        m.addArg(std::to_string(page.messages.size()));
+        for (size_t i = 0; i < page.messages.size(); ++i)
+        {
+            m.addArg(page.target);
+            m.addArg(page.messages[i].sender);
+            m.addArg(page.messages[i].text);
+            m.addArg(sentAt[i]);
+        }
+        return m;
+    };
+    auto compactPage = [&]
+    {
+        Message m;
+        m.setBody(page);
+        return m;
+    };
+
+    const size_t pages = std::max<size_t>(total / 65536, 1000);
+    auto perPage = [&](const char *name, size_t bytes, const Sample &s)
+    {
+        std::cout << std::left << std::setw(18) << name << std::right << std::setw(9) << bytes << " B"
+                  << std::fixed << std::setprecision(0) << std::setw(10) << s.seconds * 1e9 / pages << " ns/page"
+                  << std::setw(8) << std::setprecision(1) << double(s.allocs) / pages << " allocs/page" << std::endl;
+    };
+
+    size_t textBytes = textPage().getPayload().size();
+    size_t compactBytes = compactPage().getPayload().size();
+
+    s = measure([&]
+                {
+                    for (size_t i = 0; i < pages; ++i)
+                    {
+                        sink += textPage().getPayload().size();
+                    } });
+    perPage("text encode", textBytes, s);
+
+    s = measure([&]
+                {
+                    for (size_t i = 0; i < pages; ++i)
+                    {
+                        sink += compactPage().getPayload().size();
+                    } });
+    perPage("compact encode", compactBytes, s);
+
+    // Decoding parses numbers and timestamps back, as the client does
+    const Message text = textPage();
+    s = measure([&]
+                {
+                    for (size_t i = 0; i < pages; ++i)
+                    {
+                        std::vector<std::string> args = text.getArgs();
+                        size_t count = std::stoul(args[0]);
+                        for (size_t row = 0; row < count; ++row)
+                        {
+                            sink += epochSeconds(args[4 + row * 4]);
+                        }
+                    } });
+    perPage("text decode", textBytes, s);
+
+    const Message compact = compactPage();
+    s = measure([&]
+                {
+                    for (size_t i = 0; i < pages; ++i)
+                    {
+                        HistoryPage decoded;
+                        compact.getBody(decoded);
+                        sink += decoded.messages.size();
+                    } });
+    perPage("compact decode", compactBytes, s);
+
+    // The built in LZ codec over the text page, as compressed responses are sent
+    const std::vector<uint8_t> &plain = text.getPayload();
+    std::vector<uint8_t> packed;
+    lzCompress(plain.data(), plain.size(), packed);
+
+    s = measure([&]
+                {
+                    std::vector<uint8_t> out;
+                    for (size_t i = 0; i < pages; ++i)
+                    {
+                        out.clear();
+                        lzCompress(plain.data(), plain.size(), out);
+                        sink += out.size();
+                    } });
+    perPage("lz compress", packed.size(), s);
+
+    s = measure([&]
+                {
+                    std::vector<uint8_t> out;
+                    for (size_t i = 0; i < pages; ++i)
+                    {
+                        out.clear();
+                        sink += lzDecompress(packed.data(), packed.size(), out, plain.size());
+                    } });
+    perPage("lz decompress", plain.size(), s);
+
+    return sink == 0;
+}
@@ -0,0 +1,75 @@
+#include "buffer_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+
+// Free buffers of one thread, by class
+struct PoolLists
+{
+    std::array<std::vector<std::vector<uint8_t>>, POOL_MAX_CLASS + 1> classes;
+    size_t bytes = 0;
+};
+
+static PoolLists &lists()
+{
+    thread_local PoolLists pool;
+    return pool;
+}
+
+std::vector<uint8_t> BufferPool::take(size_t size)
+{
+    // Smallest class that holds size bytes, every buffer of class c has room for 2^c
+    size_t c = std::max<size_t>(std::bit_width(size > 0 ? size - 1 : 0), POOL_MIN_CLASS);
+    if (c <= POOL_MAX_CLASS)
+    {
+        PoolLists &pool = lists();
+        std::vector<std::vector<uint8_t>> &free = pool.classes[c];
+        if (!free.empty())
+        {
+            std::vector<uint8_t> buffer = std::move(free.back());
+            free.pop_back();
+            pool.bytes -= buffer.capacity();
+            return buffer;
+        }
+    }
+
+    std::vector<uint8_t> buffer;
+    buffer.reserve(c <= POOL_MAX_CLASS ? size_t(1) << c : size);
+    return buffer;
+}
+
+void BufferPool::give(std::vector<uint8_t> &&buffer)
+{
+    // Largest class the capacity covers
+    size_t capacity = buffer.capacity();
+    size_t c = std::bit_width(capacity) - 1;
+    PoolLists &pool = lists();
+    if (capacity == 0 or c < POOL_MIN_CLASS or c > POOL_MAX_CLASS or pool.bytes + capacity > POOL_BYTES)
+    {
+        std::vector<uint8_t>().swap(buffer);
+        return;
+    }
+
+    std::vector<std::vector<uint8_t>> &free = pool.classes[c];
+    if (free.size() >= POOL_BUFFERS)
+    {
+        std::vector<uint8_t>().swap(buffer);
+        return;
+    }
+
+    // The lists reserve their slots once, so keeping a buffer does not allocate either
+    if (free.capacity() < POOL_BUFFERS)
+    {
+        free.reserve(POOL_BUFFERS);
+    }
+    buffer.clear();
+    pool.bytes += capacity;
+    free.push_back(std::move(buffer));
+}
+
+size_t &BufferPool::hint()
+{
+    thread_local size_t reserve = 0;
+    return reserve;
+}
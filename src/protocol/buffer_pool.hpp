@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Per thread free lists of byte buffers by power of two capacity, so payloads and frames reuse their memory
+// Buffers keep their capacity while pooled, a buffer given back on another thread joins that thread's lists
+
+#define POOL_MIN_CLASS 6  // 64 bytes, smaller requests get a buffer of this size
+#define POOL_MAX_CLASS 21 // 2 MiB, a MAX_FRAME frame with its header, larger buffers are freed
+#define POOL_BUFFERS 64   // Buffers kept per class and thread
+#define POOL_BYTES (8 << 20) // Bytes kept per thread, past this buffers are freed
+
+class BufferPool
+{
+public:
+    // Empty buffer with room for at least size bytes
+    static std::vector<uint8_t> take(size_t size);
+
+    // Returns the memory of the buffer to the pool of this thread, the buffer is left empty
+    static void give(std::vector<uint8_t> &&buffer);
+
+    // Room new payloads start with on this thread, set from the command table while a request is handled
+    static size_t &hint();
+
+    BufferPool() = delete;
+};
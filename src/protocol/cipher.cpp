@@ -0,0 +1,133 @@
+#include "cipher.hpp"
+
+#include <atomic>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CIPHER_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define CIPHER_NEON
+#endif
+
+static void xorScalar(uint8_t *data, size_t size, uint8_t key)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        data[i] ^= key;
+    }
+}
+
+#ifdef CIPHER_X86
+// SSE2 is part of x86-64, the tail goes byte by byte
+static void xorSse2(uint8_t *data, size_t size, uint8_t key)
+{
+    const __m128i k = _mm_set1_epi8(static_cast<char>(key));
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i *p = reinterpret_cast<__m128i *>(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), k));
+    }
+    xorScalar(data + i, size - i, key);
+}
+
+// Compiled for AVX2 on its own, only called when the CPU reports it
+// The tail stays in this function, calling legacy SSE code with dirty upper halves stalls
+__attribute__((target("avx2"))) static void xorAvx2(uint8_t *data, size_t size, uint8_t key)
+{
+    const __m256i k = _mm256_set1_epi8(static_cast<char>(key));
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i *p = reinterpret_cast<__m256i *>(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), k));
+    }
+    if (i + 16 <= size)
+    {
+        __m128i *p = reinterpret_cast<__m128i *>(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), _mm256_castsi256_si128(k)));
+        i += 16;
+    }
+    for (; i < size; ++i)
+    {
+        data[i] ^= key;
+    }
+    _mm256_zeroupper();
+}
+#endif
+
+#ifdef CIPHER_NEON
+static void xorNeon(uint8_t *data, size_t size, uint8_t key)
+{
+    const uint8x16_t k = vdupq_n_u8(key);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), k));
+    }
+    xorScalar(data + i, size - i, key);
+}
+#endif
+
+std::vector<XorCipher::KernelInfo> XorCipher::kernels()
+{
+    std::vector<KernelInfo> available;
+#ifdef CIPHER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        available.push_back({"avx2", xorAvx2});
+    }
+    available.push_back({"sse2", xorSse2});
+#endif
+#ifdef CIPHER_NEON
+    available.push_back({"neon", xorNeon});
+#endif
+    available.push_back({"scalar", xorScalar});
+    return available;
+}
+
+XorCipher::XorCipher(uint8_t key) : XorCipher(key, kernels().front()) {}
+
+XorCipher::XorCipher(uint8_t key, const KernelInfo &kernel) : key(key), kernel(kernel) {}
+
+void XorCipher::apply(uint8_t *data, size_t size, uint64_t) const
+{
+    kernel.run(data, size, key);
+}
+
+const char *XorCipher::name() const
+{
+    return kernel.name;
+}
+
+// Chosen once and never replaced, threads encrypting frames read it without a lock
+static std::atomic<const Cipher *> chosen{nullptr};
+
+const Cipher &Cipher::active()
+{
+    if (const Cipher *cipher = chosen.load(std::memory_order_acquire))
+    {
+        return *cipher;
+    }
+
+    // First frame without an installed cipher, set up on first use so frames can be handled during static initialisation
+    static const XorCipher fallback;
+    const Cipher *expected = nullptr;
+    chosen.compare_exchange_strong(expected, &fallback, std::memory_order_acq_rel);
+    return *chosen.load(std::memory_order_acquire);
+}
+
+void Cipher::install(std::unique_ptr<Cipher> cipher)
+{
+    const Cipher *expected = nullptr;
+    if (!cipher or !chosen.compare_exchange_strong(expected, cipher.get(), std::memory_order_acq_rel))
+    {
+        throw std::logic_error("The frame cipher must be installed once, before the first frame");
+    }
+
+    // Kept for the life of the process, frames may still be in flight at exit
+    cipher.release();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Frame cipher, applied in place to a whole frame or to any part of one
+class Cipher
+{
+public:
+    virtual ~Cipher() = default;
+
+    // Transform size bytes that start offset bytes into the frame, stream ciphers encrypt and decrypt alike
+    virtual void apply(uint8_t *data, size_t size, uint64_t offset) const = 0;
+    virtual const char *name() const = 0;
+
+    // Cipher of connections without one of their own in their Session
+    // XOR with 0xFF unless another one is installed before the first frame
+    // The choice is fixed by the first of the two calls, a later install throws std::logic_error
+    static const Cipher &active();
+    static void install(std::unique_ptr<Cipher> cipher);
+};
+
+// XOR with a fixed byte, runs the widest kernel the CPU supports
+class XorCipher : public Cipher
+{
+public:
+    using Kernel = void (*)(uint8_t *data, size_t size, uint8_t key);
+
+    struct KernelInfo
+    {
+        const char *name;
+        Kernel run;
+    };
+
+    explicit XorCipher(uint8_t key = 0xFF);
+    XorCipher(uint8_t key, const KernelInfo &kernel);
+
+    void apply(uint8_t *data, size_t size, uint64_t offset) const override;
+    const char *name() const override;
+
+    // Kernels this CPU can run, widest first
+    static std::vector<KernelInfo> kernels();
+
+private:
+    uint8_t key;
+    KernelInfo kernel;
+};
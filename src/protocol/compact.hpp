@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+// Compact payload encoding, driven by the schemas in schema.hpp
+// Fields follow the order of their schema without tags:
+// unsigned integers are LEB128 varints, signed ones are zigzag encoded first,
+// strings are a varint length and the bytes, repeated fields a varint count and the elements
+// Fields missing at the end of a payload keep their defaults, so a schema can grow at its end
+
+// A struct is encoded through a static fields() returning a tuple of member pointers
+template <typename T>
+concept CompactSchema = requires { T::fields(); };
+
+template <typename T>
+struct IsVector : std::false_type
+{
+};
+
+template <typename T>
+struct IsVector<std::vector<T>> : std::true_type
+{
+};
+
+class CompactWriter
+{
+private:
+    std::vector<uint8_t> &out;
+
+    void varint(uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<uint8_t>(value) | 0x80);
+            value >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(value));
+    }
+
+public:
+    explicit CompactWriter(std::vector<uint8_t> &out) : out(out) {}
+
+    template <typename T>
+    void write(const T &value)
+    {
+        if constexpr (CompactSchema<T>)
+        {
+            std::apply([&](auto... member)
+                       { (write(value.*member), ...); }, T::fields());
+        }
+        else if constexpr (IsVector<T>::value)
+        {
+            varint(value.size());
+            for (const auto &element : value)
+            {
+                write(element);
+            }
+        }
+        else if constexpr (std::is_same_v<T, std::string>)
+        {
+            varint(value.size());
+            out.insert(out.end(), value.begin(), value.end());
+        }
+        else if constexpr (std::is_integral_v<T> and std::is_signed_v<T>)
+        {
+            int64_t v = value;
+            varint((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+        }
+        else
+        {
+            static_assert(std::is_integral_v<T>, "Field type has no compact encoding");
+            varint(value);
+        }
+    }
+};
+
+class CompactReader
+{
+private:
+    const uint8_t *pos;
+    const uint8_t *end;
+    bool ok = true;
+    int depth = 0;
+
+    bool varint(uint64_t &value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (pos == end)
+            {
+                return ok = false;
+            }
+            uint8_t byte = *pos++;
+            value |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+            {
+                return true;
+            }
+        }
+        return ok = false;
+    }
+
+public:
+    CompactReader(const uint8_t *data, size_t size) : pos(data), end(data + size) {}
+
+    // False when the payload is truncated or malformed
+    bool good() const { return ok; }
+
+    template <typename T>
+    bool read(T &value)
+    {
+        if (!ok)
+        {
+            return false;
+        }
+
+        if constexpr (CompactSchema<T>)
+        {
+            // Only the outermost struct may end early
+            bool outer = depth++ == 0;
+            std::apply([&](auto... member)
+                       { ((ok and !(outer and pos == end) and read(value.*member)), ...); }, T::fields());
+            --depth;
+        }
+        else if constexpr (IsVector<T>::value)
+        {
+            uint64_t count;
+            // Every element takes at least one byte, a larger count is malformed
+            if (!varint(count) or count > uint64_t(end - pos))
+            {
+                return ok = false;
+            }
+            value.resize(count);
+            for (auto &element : value)
+            {
+                if (!read(element))
+                {
+                    break;
+                }
+            }
+        }
+        else if constexpr (std::is_same_v<T, std::string>)
+        {
+            uint64_t size;
+            if (!varint(size) or size > uint64_t(end - pos))
+            {
+                return ok = false;
+            }
+            value.assign(reinterpret_cast<const char *>(pos), size);
+            pos += size;
+        }
+        else
+        {
+            static_assert(std::is_integral_v<T>, "Field type has no compact encoding");
+            uint64_t v;
+            if (varint(v))
+            {
+                if constexpr (std::is_signed_v<T>)
+                {
+                    value = static_cast<T>(static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1));
+                }
+                else
+                {
+                    value = static_cast<T>(v);
+                }
+            }
+        }
+        return ok;
+    }
+};
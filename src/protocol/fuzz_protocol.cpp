@@ -0,0 +1,289 @@
+// Fuzz target for the frame decoders: Message::deserialize, and the streaming decoder the server reads with
+// libFuzzer: define LIBFUZZER and link with -fsanitize=fuzzer, it provides main
+// AFL and plain runs: ./fuzz_protocol [files...], stdin without files
+//                     ./fuzz_protocol --mutate [rounds], random mutations of built in frames
+//                     ./fuzz_protocol --seeds <dir>, writes the built in frames as a starting corpus
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "message.hpp"
+#include "schema.hpp"
+
+// Dictionary compressed frames of the seeds refer to, decoders get it when the id matches
+static const LzDictionary &dictionary()
+{
+    static const std::string sample = "message number about the weekly release #general user";
+    static const LzDictionary dict(7, reinterpret_cast<const uint8_t *>(sample.data()), sample.size());
+    return dict;
+}
+
+// Decoding every schema must fail cleanly on any payload
+static void bodies(const Message &msg)
+{
+    HistoryRequest history;
+    HistoryPage page;
+    SearchPage search;
+    NameList names;
+    BatchRequest request;
+    BatchResponse response;
+    Hello hello;
+    msg.getBody(history);
+    msg.getBody(page);
+    msg.getBody(search);
+    msg.getBody(names);
+    msg.getBody(request);
+    msg.getBody(response);
+    msg.getBody(hello);
+}
+
+// A decoded message encodes back to the same content
+static void roundTrip(const Message &msg)
+{
+    if (msg.isCompressed() or msg.isContinued())
+    {
+        return;
+    }
+    std::vector<uint8_t> frame = msg.serialize(MAX_FRAME);
+    Message back = Message::deserialize(frame);
+    if (back.getPayload() != msg.getPayload() or back.getCommand() != msg.getCommand() or back.encoding() != msg.encoding())
+    {
+        std::abort();
+    }
+}
+
+static void message(Message &msg)
+{
+    const LzDictionary *dict = msg.dictionaryId() == dictionary().id() ? &dictionary() : nullptr;
+    if (!msg.decompress(dict))
+    {
+        return;
+    }
+    msg.getArgs();
+    msg.view().args();
+    bodies(msg);
+    roundTrip(msg);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    // Whole frame, as the client reads
+    try
+    {
+        Message msg = Message::deserialize(data, size);
+        message(msg);
+    }
+    catch (const std::exception &)
+    {
+    }
+
+    // Stream of frames decoded in place, continued ones joined, as the server reads
+    std::vector<uint8_t> buffer(data, data + size);
+    Message continued;
+    bool continuing = false;
+    size_t used = 0;
+    try
+    {
+        while (size_t frame = Message::frameSize(buffer.data() + used, buffer.size() - used, MAX_FRAME))
+        {
+            MessageView view = MessageView::decode(buffer.data() + used, frame);
+            used += frame;
+
+            MessageView::Args args = view.args();
+            for (size_t i = 0; i < args.size(); ++i)
+            {
+                args.number(i);
+            }
+
+            if (continuing or view.isContinued())
+            {
+                if (!continuing)
+                {
+                    continued = view.toMessage();
+                    continuing = true;
+                }
+                else
+                {
+                    continued.append(view.toMessage());
+                }
+                if (continued.getPayload().size() > MAX_MESSAGE)
+                {
+                    break;
+                }
+                if (continued.isContinued())
+                {
+                    continue;
+                }
+                continuing = false;
+                message(continued);
+                continue;
+            }
+
+            Message msg = view.toMessage();
+            message(msg);
+        }
+    }
+    catch (const std::exception &)
+    {
+    }
+    return 0;
+}
+
+#ifndef LIBFUZZER
+
+// Valid frames of every encoding, mutated by --mutate and written by --seeds
+static std::vector<std::vector<uint8_t>> seeds()
+{
+    std::vector<std::vector<uint8_t>> frames;
+
+    Message text;
+    text.setType(0x01);
+    text.setCommand(0x30);
+    text.addArg("#general");
+    text.addArg("hello everyone");
+    frames.push_back(text.serialize());
+    frames.push_back(text.serialize(MAX_FRAME, 42));
+
+    Message typed;
+    typed.setType(0x01);
+    typed.setCommand(0x75);
+    typed.setTyped(true);
+    typed.addArg("0A93T98TW0000");
+    typed.addUint(4096);
+    std::vector<uint8_t> bytes(300, 0xA5);
+    typed.addBytes(bytes.data(), bytes.size());
+    frames.push_back(typed.serialize());
+
+    HistoryPage page{"#general", {}};
+    for (int i = 0; i < 15; ++i)
+    {
+        page.messages.push_back({"user" + std::to_string(i % 3), "message number " + std::to_string(i) + " about the weekly release", 1760000000u + i * 61});
+    }
+    Message compact;
+    compact.setType(0x02);
+    compact.setCommand(0x33);
+    compact.setBody(page);
+    frames.push_back(compact.serialize());
+
+    // Compressed, then split over continued frames
+    frames.push_back(compact.serialize(FrameOptions{MAX_FRAME, COMPRESS_THRESHOLD, nullptr, nullptr}));
+    frames.push_back(compact.serialize(FrameOptions{MAX_FRAME, COMPRESS_THRESHOLD, &dictionary(), nullptr}, 7));
+    frames.push_back(compact.serialize(256));
+
+    BatchRequest batch;
+    batch.requests.push_back(batchEntry(text));
+    batch.requests.push_back(batchEntry(compact));
+    Message batched;
+    batched.setType(0x01);
+    batched.setCommand(0x02);
+    batched.setBody(batch);
+    frames.push_back(batched.serialize(MAX_FRAME));
+
+    Message hello;
+    hello.setType(0x01);
+    hello.setCommand(0x01);
+    hello.setBody(Hello{PROTOCOL_VERSION, MAX_FRAME, {"lz"}, FEATURES});
+    frames.push_back(hello.serialize());
+    return frames;
+}
+
+// xorshift, runs are repeatable
+static uint64_t next(uint64_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static void mutate(std::vector<uint8_t> &data, uint64_t &state)
+{
+    size_t edits = 1 + next(state) % 4;
+    for (size_t e = 0; e < edits and !data.empty(); ++e)
+    {
+        size_t at = next(state) % data.size();
+        switch (next(state) % 5)
+        {
+        case 0: // Flip a bit
+            data[at] ^= 1 << (next(state) % 8);
+            break;
+        case 1: // Random byte
+            data[at] = next(state);
+            break;
+        case 2: // Truncate
+            data.resize(at);
+            break;
+        case 3: // Insert bytes
+            data.insert(data.begin() + at, 1 + next(state) % 8, uint8_t(next(state)));
+            break;
+        case 4: // Interesting value in a header byte
+        {
+            static const uint8_t values[] = {0x00, 0x7F, 0x80, 0xFF, 0x40, 0x20, 0x08, 0x04};
+            data[at % 10] = values[next(state) % sizeof(values)];
+            break;
+        }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> args(argv + 1, argv + argc);
+
+    if (!args.empty() and args[0] == "--mutate")
+    {
+        size_t rounds = args.size() > 1 ? std::stoul(args[1]) : 100000;
+        std::vector<std::vector<uint8_t>> corpus = seeds();
+        uint64_t state = 0x9E3779B97F4A7C15;
+        for (size_t i = 0; i < rounds; ++i)
+        {
+            std::vector<uint8_t> data = corpus[next(state) % corpus.size()];
+            mutate(data, state);
+
+            // Two frames back to back exercise the stream decoder
+            if (next(state) % 4 == 0)
+            {
+                const std::vector<uint8_t> &other = corpus[next(state) % corpus.size()];
+                data.insert(data.end(), other.begin(), other.end());
+            }
+            LLVMFuzzerTestOneInput(data.data(), data.size());
+        }
+        std::cout << rounds << " mutated inputs" << std::endl;
+        return 0;
+    }
+
+    if (args.size() == 2 and args[0] == "--seeds")
+    {
+        std::vector<std::vector<uint8_t>> corpus = seeds();
+        for (size_t i = 0; i < corpus.size(); ++i)
+        {
+            std::ofstream out(args[1] + "/seed" + std::to_string(i), std::ios::binary);
+            out.write(reinterpret_cast<const char *>(corpus[i].data()), corpus[i].size());
+            if (!out)
+            {
+                std::cerr << "Can not write the seeds to " << args[1] << std::endl;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // Each file is one input, stdin when there are none, as AFL runs it
+    if (args.empty())
+    {
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(std::cin)), std::istreambuf_iterator<char>());
+        return LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    for (const std::string &path : args)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    return 0;
+}
+
+#endif // LIBFUZZER
@@ -0,0 +1,234 @@
+#include "lz.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+static constexpr int HASH_BITS = 12;
+static constexpr size_t MIN_MATCH = 4;
+static constexpr size_t MAX_DISTANCE = 65535;
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+LzDictionary::LzDictionary(uint32_t id, const uint8_t *data, size_t size) : identifier(id), table(1 << HASH_BITS, 0)
+{
+    size_t keep = std::min<size_t>(size, LZ_MAX_DICTIONARY);
+    bytes.assign(data + size - keep, data + size);
+
+    // Later positions win, they are closer to the data
+    for (size_t pos = 0; pos + MIN_MATCH <= bytes.size(); ++pos)
+    {
+        table[hash(read32(bytes.data() + pos))] = pos + 1;
+    }
+}
+
+static void extendLength(std::vector<uint8_t> &out, size_t n)
+{
+    while (n >= 255)
+    {
+        out.push_back(255);
+        n -= 255;
+    }
+    out.push_back(static_cast<uint8_t>(n));
+}
+
+// Literals followed by a match, a match of 0 ends the block
+static void sequence(std::vector<uint8_t> &out, const uint8_t *literals, size_t count, size_t match, size_t distance)
+{
+    size_t extra = match ? match - MIN_MATCH : 0;
+    out.push_back(static_cast<uint8_t>(std::min<size_t>(count, 15) << 4 | std::min<size_t>(extra, 15)));
+    if (count >= 15)
+    {
+        extendLength(out, count - 15);
+    }
+    out.insert(out.end(), literals, literals + count);
+
+    if (match)
+    {
+        out.push_back(static_cast<uint8_t>(distance));
+        out.push_back(static_cast<uint8_t>(distance >> 8));
+        if (extra >= 15)
+        {
+            extendLength(out, extra - 15);
+        }
+    }
+}
+
+void lzCompress(const uint8_t *data, size_t size, std::vector<uint8_t> &out, const LzDictionary *dictionary)
+{
+    thread_local std::vector<uint32_t> table(1 << HASH_BITS);
+    std::fill(table.begin(), table.end(), 0);
+
+    const uint8_t *dict = dictionary ? dictionary->data().data() : nullptr;
+    size_t dictSize = dictionary ? dictionary->data().size() : 0;
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + MIN_MATCH <= size)
+    {
+        uint32_t current = read32(data + pos);
+        uint32_t h = hash(current);
+        size_t match = 0;
+        size_t distance = 0;
+
+        // The data seen so far first, then the dictionary
+        uint32_t candidate = table[h];
+        table[h] = pos + 1;
+        if (candidate and pos - (candidate - 1) <= MAX_DISTANCE and read32(data + candidate - 1) == current)
+        {
+            size_t from = candidate - 1;
+            match = MIN_MATCH;
+            while (pos + match < size and data[from + match] == data[pos + match])
+            {
+                ++match;
+            }
+            distance = pos - from;
+        }
+        else if (dictionary and (candidate = dictionary->find(h)))
+        {
+            size_t from = candidate - 1;
+            if (pos + dictSize - from <= MAX_DISTANCE and read32(dict + from) == current)
+            {
+                match = MIN_MATCH;
+                while (pos + match < size and from + match < dictSize and dict[from + match] == data[pos + match])
+                {
+                    ++match;
+                }
+                distance = pos + dictSize - from;
+            }
+        }
+
+        if (!match)
+        {
+            // Skip faster through data that does not compress
+            pos += 1 + ((pos - anchor) >> 5);
+            continue;
+        }
+
+        sequence(out, data + anchor, pos - anchor, match, distance);
+        pos += match;
+        anchor = pos;
+
+        // Positions inside the match are seen too
+        if (pos >= 2 and pos + 2 <= size)
+        {
+            table[hash(read32(data + pos - 2))] = pos - 1;
+        }
+    }
+
+    sequence(out, data + anchor, size - anchor, 0, 0);
+}
+
+bool lzDecompress(const uint8_t *data, size_t size, std::vector<uint8_t> &out, size_t expected, const LzDictionary *dictionary)
+{
+    const uint8_t *dict = dictionary ? dictionary->data().data() : nullptr;
+    size_t dictSize = dictionary ? dictionary->data().size() : 0;
+
+    size_t start = out.size();
+    out.resize(start + expected);
+    uint8_t *dst = out.data() + start;
+    size_t produced = 0;
+    size_t in = 0;
+
+    auto fail = [&]()
+    {
+        out.resize(start);
+        return false;
+    };
+    auto extendLength = [&](size_t &n)
+    {
+        uint8_t byte;
+        do
+        {
+            if (in == size)
+            {
+                return false;
+            }
+            byte = data[in++];
+            n += byte;
+        } while (byte == 255);
+        return true;
+    };
+
+    while (in < size)
+    {
+        uint8_t token = data[in++];
+
+        size_t count = token >> 4;
+        if ((count == 15 and !extendLength(count)) or count > size - in or count > expected - produced)
+        {
+            return fail();
+        }
+        std::memcpy(dst + produced, data + in, count);
+        produced += count;
+        in += count;
+
+        if (in == size)
+        {
+            break;
+        }
+
+        if (size - in < 2)
+        {
+            return fail();
+        }
+        size_t distance = data[in] | (data[in + 1] << 8);
+        in += 2;
+
+        size_t match = token & 15;
+        if (match == 15 and !extendLength(match))
+        {
+            return fail();
+        }
+        match += MIN_MATCH;
+        if (distance == 0 or distance > produced + dictSize or match > expected - produced)
+        {
+            return fail();
+        }
+
+        // The part of the match before the data comes from the dictionary
+        size_t k = 0;
+        if (distance > produced)
+        {
+            size_t fromDict = distance - produced;
+            size_t n = std::min(match, fromDict);
+            std::memcpy(dst + produced, dict + dictSize - fromDict, n);
+            k = n;
+        }
+
+        // The rest may overlap the bytes it produces
+        if (k < match)
+        {
+            size_t n = match - k;
+            uint8_t *to = dst + produced + k;
+            const uint8_t *from = dst + produced + k - distance;
+            if (distance >= n)
+            {
+                std::memcpy(to, from, n);
+            }
+            else
+            {
+                for (size_t i = 0; i < n; ++i)
+                {
+                    to[i] = from[i];
+                }
+            }
+        }
+        produced += match;
+    }
+
+    if (produced != expected)
+    {
+        return fail();
+    }
+    return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Byte oriented LZ77 block codec in the spirit of LZ4, built in so no compression library is needed
+// A block is a run of sequences: a token with the literal count in its high nibble and the match length - 4
+// in its low nibble (15 continues in bytes of 255 and a last smaller one), the literals, then the 2 byte
+// little endian distance back to the match. The last sequence has literals only
+// A dictionary counts as data placed right before the block, matches may reach into it
+
+#define LZ_MAX_DICTIONARY (32 << 10) // Dictionary bytes kept, distances reach at most 64 KiB back
+
+class LzDictionary
+{
+private:
+    uint32_t identifier;         // Names the dictionary in compressed frames, never 0
+    std::vector<uint8_t> bytes;  // The last LZ_MAX_DICTIONARY bytes given
+    std::vector<uint32_t> table; // Last position + 1 of each hashed 4 byte sequence, 0 for none
+
+public:
+    LzDictionary(uint32_t id, const uint8_t *data, size_t size);
+
+    uint32_t id() const { return identifier; }
+    const std::vector<uint8_t> &data() const { return bytes; }
+
+    // Last position + 1 of a sequence with this hash, 0 for none
+    uint32_t find(uint32_t hash) const { return table[hash]; }
+};
+
+// Appends the compressed block of data to out
+void lzCompress(const uint8_t *data, size_t size, std::vector<uint8_t> &out, const LzDictionary *dictionary = nullptr);
+
+// Appends the expected bytes a block decompresses to, false and nothing appended for a malformed block
+bool lzDecompress(const uint8_t *data, size_t size, std::vector<uint8_t> &out, size_t expected, const LzDictionary *dictionary = nullptr);
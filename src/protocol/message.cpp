@@ -1,5 +1,9 @@
 #include "message.hpp"
 
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+
 // Utility to convert integer to byte array (big-endian)
 template <typename T>
 void Message::to_bytes(T value, std::vector<uint8_t> &bytes)
@@ -22,25 +26,81 @@ T Message::from_bytes(const std::vector<uint8_t> &bytes, size_t &idx)
     return value;
 }
 
-// Placeholder encryption (XOR with 0xFF for now)
-void Message::encrypt(std::vector<uint8_t> &data) const
+void Message::encrypt(const Cipher *cipher, uint8_t *data, size_t size, uint64_t offset)
+{
+    (cipher ? *cipher : Cipher::active()).apply(data, size, offset);
+}
+
+void Message::decrypt(const Cipher *cipher, uint8_t *data, size_t size, uint64_t offset)
 {
-    for (auto &byte : data)
+    (cipher ? *cipher : Cipher::active()).apply(data, size, offset);
+}
+
+Message::Message() : type(0), command(0), typed(false), compact(false), continued(false), correlated(false), correlation(0), compressed(false) {}
+
+Message::Message(const Message &other) : type(other.type), command(other.command), typed(other.typed), compact(other.compact), continued(other.continued), correlated(other.correlated), correlation(other.correlation), compressed(other.compressed)
+{
+    grow(other.payload.size());
+    payload.assign(other.payload.begin(), other.payload.end());
+}
+
+Message::Message(Message &&other) noexcept = default;
+
+Message &Message::operator=(const Message &other)
+{
+    if (this != &other)
     {
-        byte ^= 0xFF; // Simple XOR encryption with 0xFF
+        type = other.type;
+        command = other.command;
+        typed = other.typed;
+        compact = other.compact;
+        continued = other.continued;
+        correlated = other.correlated;
+        correlation = other.correlation;
+        compressed = other.compressed;
+        payload.clear();
+        grow(other.payload.size());
+        payload.assign(other.payload.begin(), other.payload.end());
     }
+    return *this;
 }
 
-// Placeholder decryption (XOR with 0xFF for now)
-void Message::decrypt(std::vector<uint8_t> &data) const
+Message &Message::operator=(Message &&other) noexcept
 {
-    for (auto &byte : data)
+    if (this != &other)
     {
-        byte ^= 0xFF; // Simple XOR decryption with 0xFF
+        type = other.type;
+        command = other.command;
+        typed = other.typed;
+        compact = other.compact;
+        continued = other.continued;
+        correlated = other.correlated;
+        correlation = other.correlation;
+        compressed = other.compressed;
+        BufferPool::give(std::move(payload));
+        payload = std::move(other.payload);
     }
+    return *this;
 }
 
-Message::Message() : type(0), command(0) {}
+Message::~Message()
+{
+    BufferPool::give(std::move(payload));
+}
+
+void Message::grow(size_t extra)
+{
+    size_t needed = payload.size() + extra;
+    if (payload.capacity() != 0 and needed <= payload.capacity())
+    {
+        return;
+    }
+
+    std::vector<uint8_t> larger = BufferPool::take(std::max({needed, payload.capacity() * 2, BufferPool::hint()}));
+    larger.insert(larger.end(), payload.begin(), payload.end());
+    BufferPool::give(std::move(payload));
+    payload = std::move(larger);
+}
 
 void Message::setType(uint8_t t) { type = t; }
 uint8_t Message::getType() const { return type; }
@@ -48,29 +108,160 @@ uint8_t Message::getType() const { return type; }
 void Message::setCommand(uint8_t c) { command = c; }
 int Message::getCommand() const { return static_cast<int>(command); }
 
-void Message::addArg(const std::string &arg)
+void Message::setTyped(bool t)
 {
-    payload.insert(payload.end(), arg.begin(), arg.end());
+    if (!payload.empty() and t != typed)
+    {
+        throw std::logic_error("Typed fields must be chosen before adding arguments");
+    }
+    typed = t;
+}
+
+bool Message::isTyped() const { return typed; }
+
+bool Message::isCompact() const { return compact; }
+
+void Message::setCorrelation(uint32_t id)
+{
+    correlated = true;
+    correlation = id;
+}
+
+bool Message::isCorrelated() const { return correlated; }
+uint32_t Message::getCorrelation() const { return correlation; }
+
+uint8_t Message::encoding() const
+{
+    return (typed ? TYPED_FIELDS : 0) | (compact ? COMPACT_BODY : 0);
+}
+
+void Message::setEncoding(uint8_t flags)
+{
+    typed = flags & TYPED_FIELDS;
+    compact = flags & COMPACT_BODY;
+}
+
+void Message::addField(uint8_t kind, const uint8_t *data, size_t size)
+{
+    if (!typed)
+    {
+        throw std::logic_error("Field added to an untyped message");
+    }
+    if (size > MAX_FIELD)
+    {
+        throw std::length_error("Field too large " + std::to_string(size));
+    }
+
+    grow(3 + size);
+    payload.push_back(kind);
+    to_bytes(static_cast<uint16_t>(size), payload);
+    payload.insert(payload.end(), data, data + size);
+}
+
+void Message::addArg(std::string_view arg)
+{
+    if (typed)
+    {
+        addField(FIELD_TEXT, reinterpret_cast<const uint8_t *>(arg.data()), arg.size());
+        return;
+    }
+
+    // Same element type on both sides, so the copy is a memmove
+    grow(arg.size() + 1);
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(arg.data());
+    payload.insert(payload.end(), data, data + arg.size());
     payload.push_back(0); // Null-terminate the argument
 }
 
+void Message::addBytes(const uint8_t *data, size_t size)
+{
+    addField(FIELD_BYTES, data, size);
+}
+
+void Message::addUint(uint64_t value)
+{
+    // Big-endian, on the stack
+    uint8_t bytes[sizeof(value)];
+    for (size_t i = 0; i < sizeof(value); ++i)
+    {
+        bytes[i] = value >> (8 * (sizeof(value) - 1 - i));
+    }
+    addField(FIELD_UINT, bytes, sizeof(bytes));
+}
+
 void Message::clearArgs()
 {
     payload.clear(); // Clear all elements in the payload
+    compact = false;
 }
 
 // Setter for payload
 void Message::setPayload(const std::vector<uint8_t> &newPayload)
 {
-    payload = newPayload;
+    setPayload(newPayload.data(), newPayload.size());
 }
 
 // Set a payload from a raw array or a pointer
 void Message::setPayload(const uint8_t *data, size_t size)
 {
+    payload.clear();
+    grow(size);
     payload.assign(data, data + size);
 }
 
+bool Message::isCompressed() const { return compressed; }
+
+uint32_t Message::dictionaryId() const
+{
+    if (!compressed or payload.size() < 8)
+    {
+        return 0;
+    }
+    size_t idx = 4;
+    return from_bytes<uint32_t>(payload, idx);
+}
+
+bool Message::decompress(const LzDictionary *dictionary)
+{
+    if (!compressed)
+    {
+        return true;
+    }
+
+    // [raw length][dictionary id][block]
+    if (payload.size() < 8)
+    {
+        return false;
+    }
+    size_t idx = 0;
+    uint32_t length = from_bytes<uint32_t>(payload, idx);
+    uint32_t id = from_bytes<uint32_t>(payload, idx);
+    if (length > MAX_FRAME or id != (dictionary ? dictionary->id() : 0))
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> plain = BufferPool::take(length);
+    if (!lzDecompress(payload.data() + idx, payload.size() - idx, plain, length, dictionary))
+    {
+        BufferPool::give(std::move(plain));
+        return false;
+    }
+    BufferPool::give(std::move(payload));
+    payload = std::move(plain);
+    compressed = false;
+    return true;
+}
+
+bool Message::isContinued() const { return continued; }
+
+void Message::append(const Message &next)
+{
+    grow(next.payload.size());
+    payload.insert(payload.end(), next.payload.begin(), next.payload.end());
+    continued = next.continued;
+}
+
 // Getter for payload (if needed)
 const std::vector<uint8_t> & Message::getPayload() const
 {
@@ -80,8 +271,32 @@ const std::vector<uint8_t> & Message::getPayload() const
 std::vector<std::string> Message::getArgs() const
 {
     std::vector<std::string> args;
-    size_t start = 0;
 
+    if (typed)
+    {
+        // [kind][length][data] repeated, a truncated field ends the list
+        size_t idx = 0;
+        while (idx + 3 <= payload.size())
+        {
+            uint8_t kind = payload[idx++];
+            uint16_t length = from_bytes<uint16_t>(payload, idx);
+            if (length > payload.size() - idx)
+            {
+                break;
+            }
+
+            if (kind == FIELD_UINT and length == 8)
+            {
+                args.push_back(std::to_string(from_bytes<uint64_t>(payload, idx)));
+                continue;
+            }
+            args.push_back(std::string(reinterpret_cast<const char *>(payload.data() + idx), length));
+            idx += length;
+        }
+        return args;
+    }
+
+    size_t start = 0;
     for (size_t i = 0; i < payload.size(); ++i)
     {
         if (payload[i] == 0)
@@ -96,69 +311,237 @@ std::vector<std::string> Message::getArgs() const
 
 std::vector<uint8_t> Message::serialize() const
 {
-    std::vector<uint8_t> buffer;
+    return frames({}, correlated, correlation);
+}
+
+std::vector<uint8_t> Message::serialize(size_t maxFrame) const
+{
+    return frames({.maxFrame = maxFrame}, correlated, correlation);
+}
+
+std::vector<uint8_t> Message::serialize(size_t maxFrame, uint32_t id) const
+{
+    return frames({.maxFrame = maxFrame}, true, id);
+}
 
-    uint16_t length = payload.size();
+std::vector<uint8_t> Message::serialize(const FrameOptions &options) const
+{
+    return frames(options, correlated, correlation);
+}
 
-    if (length > 1020)
+std::vector<uint8_t> Message::serialize(const FrameOptions &options, uint32_t id) const
+{
+    return frames(options, true, id);
+}
+
+std::vector<uint8_t> Message::frames(const FrameOptions &options, bool withId, uint32_t id) const
+{
+    size_t maxFrame = options.maxFrame;
+    if (maxFrame == 0 and payload.size() > MAX_PAYLOAD)
+    {
+        throw std::invalid_argument("Serialization failed: Payload too large " + std::to_string(payload.size()));
+    }
+    if (payload.size() > MAX_MESSAGE)
+    {
+        throw std::invalid_argument("Serialization failed: Message too large " + std::to_string(payload.size()));
+    }
+
+    // Room for the headers of every frame, compressed blocks can grow a little past their input
+    size_t count = maxFrame ? std::max<size_t>((payload.size() + maxFrame - 1) / maxFrame, 1) : 1;
+    std::vector<uint8_t> buffer = BufferPool::take(payload.size() + count * MAX_HEADER);
+    std::vector<uint8_t> packed;
+    if (options.compressAbove)
     {
-        throw std::invalid_argument("Serialization failed: Payload too large " + std::to_string(length));
+        size_t block = maxFrame ? std::min(payload.size(), maxFrame) : payload.size();
+        packed = BufferPool::take(block + block / 255 + 16);
     }
+    size_t idx = 0;
+    do
+    {
+        size_t length = maxFrame ? std::min(payload.size() - idx, maxFrame) : payload.size();
+        bool more = idx + length < payload.size();
+        size_t start = buffer.size();
+        const uint8_t *body = payload.data() + idx;
+        size_t raw = length;
+
+        // Compressed when the block and its 8 byte header come out smaller
+        bool compress = false;
+        if (options.compressAbove and length >= options.compressAbove)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            packed.clear();
+            to_bytes(static_cast<uint32_t>(length), packed);
+            to_bytes(options.dictionary ? options.dictionary->id() : uint32_t(0), packed);
+            lzCompress(body, length, packed, options.dictionary);
+
+            compress = packed.size() < length;
+            if (compress)
+            {
+                body = packed.data();
+                length = packed.size();
+            }
+            if (options.stats)
+            {
+                options.stats->raw += raw;
+                options.stats->compressed += length;
+                options.stats->ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+            }
+        }
 
-    // Serialize Header: Type, Command, Payload Length
-    buffer.push_back(type);
-    buffer.push_back(command);
-    to_bytes(length, buffer);
+        // Serialize Header: Type, Command, Payload Length, small frames keep the version 1 length
+        uint8_t flags = encoding() | (more ? CONTINUED : 0) | (withId ? CORRELATED : 0) | (compress ? COMPRESSED : 0);
+        if (length > MAX_PAYLOAD)
+        {
+            buffer.push_back(type | flags | WIDE_LENGTH);
+            buffer.push_back(command);
+            to_bytes(static_cast<uint32_t>(length), buffer);
+        }
+        else
+        {
+            buffer.push_back(type | flags);
+            buffer.push_back(command);
+            to_bytes(static_cast<uint16_t>(length), buffer);
+        }
 
-    // Serialize Payload
-    buffer.insert(buffer.end(), payload.begin(), payload.end()); // Append actual payload data
+        // Every frame carries the id, so frames of a message can be matched on their own
+        if (withId)
+        {
+            to_bytes(id, buffer);
+        }
 
-    // Encrypt the serialized data (placeholder encryption)
-    encrypt(buffer);
+        // Serialize Payload and encrypt the frame
+        buffer.insert(buffer.end(), body, body + length);
+        encrypt(options.cipher, buffer.data() + start, buffer.size() - start);
+        idx += raw;
+    } while (idx < payload.size());
 
+    BufferPool::give(std::move(packed));
     return buffer;
 }
 
-Message Message::deserialize(const std::vector<uint8_t> &buffer)
+Message Message::deserialize(const std::vector<uint8_t> &buffer, const Cipher *cipher)
 {
-    size_t idx = 0;
+    return deserialize(buffer.data(), buffer.size(), cipher);
+}
 
+Message Message::deserialize(const uint8_t *data, size_t size, const Cipher *cipher)
+{
     // Create a new message object
     Message message;
 
-    // Copy the buffer for decryption
-    std::vector<uint8_t> decrypted_buffer = buffer;
-
-    // Decrypt the data (placeholder decryption)
-    message.decrypt(decrypted_buffer);
+    // Decrypt a copy of the header only, an empty buffer may come without data
+    uint8_t plain[MAX_HEADER];
+    size_t n = std::min(size, sizeof(plain));
+    if (n)
+    {
+        std::memcpy(plain, data, n);
+    }
+    decrypt(cipher, plain, n);
 
     // Deserialize Header
-    if (decrypted_buffer.size() < 3)
+    size_t length;
+    size_t idx = header(plain, n, length, &message.correlation);
+    if (idx == 0)
     {
         throw std::invalid_argument("Deserialization failed: Insufficient data for header");
     }
 
-    message.type = decrypted_buffer[idx++];
-    message.command = decrypted_buffer[idx++];
-    uint16_t length = from_bytes<uint16_t>(decrypted_buffer, idx);
+    message.type = plain[0] & TYPE_MASK;
+    message.typed = plain[0] & TYPED_FIELDS;
+    message.compact = plain[0] & COMPACT_BODY;
+    message.continued = plain[0] & CONTINUED;
+    message.correlated = plain[0] & CORRELATED;
+    message.compressed = plain[0] & COMPRESSED;
+    message.command = plain[1];
 
-    // Validate total size and resize decrypted_buffer if necessary
-    if (length > decrypted_buffer.size() - idx)
+    // Validate total size
+    if (length > size - idx)
     {
         throw std::invalid_argument("Deserialization failed: Declared payload size exceeds buffer size");
     }
 
-    // Resize buffer to only include header + payload for this message
-    decrypted_buffer.resize(idx + length);
+    // The payload is copied once and decrypted where it lands
+    message.grow(length);
+    message.payload.assign(data + idx, data + idx + length);
+    decrypt(cipher, message.payload.data(), length, idx);
+
+    return message;
+}
 
-    // Deserialize Payload
-    message.payload.resize(length);
-    for (size_t i = 0; i < length; ++i)
+size_t Message::header(const uint8_t *data, size_t size, size_t &length, uint32_t *correlation)
+{
+    if (size == 0)
     {
-        message.payload[i] = decrypted_buffer[idx++];
+        return 0;
     }
 
-    return message;
+    size_t head = 4 + (data[0] & WIDE_LENGTH ? 2 : 0) + (data[0] & CORRELATED ? 4 : 0);
+    if (size < head)
+    {
+        return 0;
+    }
+
+    if (!(data[0] & WIDE_LENGTH))
+    {
+        length = (data[2] << 8) | data[3];
+    }
+    else
+    {
+        length = (size_t(data[2]) << 24) | (data[3] << 16) | (data[4] << 8) | data[5];
+    }
+
+    if (correlation)
+    {
+        *correlation = 0;
+        if (data[0] & CORRELATED)
+        {
+            const uint8_t *id = data + head - 4;
+            *correlation = (uint32_t(id[0]) << 24) | (id[1] << 16) | (id[2] << 8) | id[3];
+        }
+    }
+    return head;
+}
+
+size_t Message::frameSize(const uint8_t *data, size_t size, size_t maxPayload, const Cipher *cipher)
+{
+    // Decrypt the header only
+    uint8_t plain[MAX_HEADER];
+    size_t n = std::min(size, sizeof(plain));
+    if (n)
+    {
+        std::memcpy(plain, data, n);
+    }
+    decrypt(cipher, plain, n);
+
+    size_t length;
+    size_t head = header(plain, n, length);
+    if (head == 0)
+    {
+        return 0;
+    }
+
+    if (length > maxPayload)
+    {
+        throw std::invalid_argument("Framing failed: Payload too large " + std::to_string(length));
+    }
+
+    return size < head + length ? 0 : head + length;
+}
+
+MessageView Message::view() const
+{
+    MessageView view;
+    view.type = type;
+    view.command = command;
+    view.typed = typed;
+    view.compact = compact;
+    view.continued = continued;
+    view.correlated = correlated;
+    view.correlation = correlation;
+    view.compressed = compressed;
+    view.payload = payload.data();
+    view.length = payload.size();
+    return view;
 }
 
 void Message::print() const
@@ -173,3 +556,117 @@ void Message::print() const
     }
     std::cout << std::endl;
 }
+
+uint64_t MessageView::Args::number(size_t i, uint64_t fallback) const
+{
+    if (i >= count)
+    {
+        return fallback;
+    }
+
+    std::string_view view = views[i];
+    if (kinds[i] == FIELD_UINT)
+    {
+        if (view.size() != 8)
+        {
+            return fallback;
+        }
+
+        uint64_t value = 0;
+        for (unsigned char byte : view)
+        {
+            value = (value << 8) | byte;
+        }
+        return value;
+    }
+
+    uint64_t value;
+    auto [end, error] = std::from_chars(view.data(), view.data() + view.size(), value);
+    if (error != std::errc() or end != view.data() + view.size())
+    {
+        return fallback;
+    }
+    return value;
+}
+
+MessageView MessageView::decode(uint8_t *data, size_t size, const Cipher *cipher)
+{
+    Message::decrypt(cipher, data, size);
+
+    MessageView view;
+    size_t head = Message::header(data, size, view.length, &view.correlation);
+    if (head == 0)
+    {
+        throw std::invalid_argument("Deserialization failed: Insufficient data for header");
+    }
+
+    view.type = data[0] & TYPE_MASK;
+    view.typed = data[0] & TYPED_FIELDS;
+    view.compact = data[0] & COMPACT_BODY;
+    view.continued = data[0] & CONTINUED;
+    view.correlated = data[0] & CORRELATED;
+    view.compressed = data[0] & COMPRESSED;
+    view.command = data[1];
+    view.payload = data + head;
+
+    if (view.length > size - head)
+    {
+        throw std::invalid_argument("Deserialization failed: Declared payload size exceeds buffer size");
+    }
+    return view;
+}
+
+MessageView::Args MessageView::args() const
+{
+    Args args;
+    const char *text = reinterpret_cast<const char *>(payload);
+
+    if (typed)
+    {
+        // [kind][length][data] repeated, a truncated field ends the list
+        size_t idx = 0;
+        while (idx + 3 <= length and args.count < MAX_ARGS)
+        {
+            uint8_t kind = payload[idx];
+            size_t size = (payload[idx + 1] << 8) | payload[idx + 2];
+            idx += 3;
+            if (size > length - idx)
+            {
+                break;
+            }
+
+            args.kinds[args.count] = kind;
+            args.views[args.count++] = std::string_view(text + idx, size);
+            idx += size;
+        }
+        return args;
+    }
+
+    size_t start = 0;
+    for (size_t i = 0; i < length and args.count < MAX_ARGS; ++i)
+    {
+        if (payload[i] == 0)
+        {
+            args.kinds[args.count] = FIELD_TEXT;
+            args.views[args.count++] = std::string_view(text + start, i - start);
+            start = i + 1;
+        }
+    }
+    return args;
+}
+
+Message MessageView::toMessage() const
+{
+    Message message;
+    message.type = type;
+    message.command = command;
+    message.typed = typed;
+    message.compact = compact;
+    message.continued = continued;
+    message.correlated = correlated;
+    message.correlation = correlation;
+    message.compressed = compressed;
+    message.grow(length);
+    message.payload.assign(payload, payload + length);
+    return message;
+}
@@ -7,12 +7,72 @@
 #include <cstring>
 #include <sstream>
 #include <inttypes.h>
+#include <array>
+#include <string_view>
+
+#include "cipher.hpp"
+#include "compact.hpp"
+#include "lz.hpp"
+#include "buffer_pool.hpp"
+
+#define MAX_PAYLOAD 1020 // Largest payload of a single frame
+
+// Type byte: the low bits carry the message type, the high bits are flags
+#define TYPE_MASK 0x03
+#define TYPED_FIELDS 0x80 // Payload is a list of typed, length prefixed fields
+#define COMPACT_BODY 0x10 // Payload is a body encoded with its schema, see schema.hpp
+#define WIDE_LENGTH 0x40  // 4 byte payload length instead of 2
+#define CONTINUED 0x20    // More frames of the same message follow
+#define CORRELATED 0x08   // A 4 byte correlation id follows the length, responses echo it
+#define COMPRESSED 0x04   // Payload is an LZ block, after its 4 byte length and 4 byte dictionary id
+
+// Version 2 is negotiated with a hello, it allows wide and continued frames
+// Version 3 adds correlation ids, and compressed frames when the hello asks for them
+#define PROTOCOL_VERSION 3
+#define MAX_FRAME (1 << 20)    // Largest payload of a single version 2 frame
+#define MAX_MESSAGE (16 << 20) // Largest payload of a message spread over continued frames
+
+// Kind byte of a typed field, followed by a 2 byte length and the data
+#define FIELD_TEXT 0x01
+#define FIELD_BYTES 0x02
+#define FIELD_UINT 0x03 // 8 bytes, big-endian
+#define MAX_FIELD 0xFFFF // Largest typed field, its length has 2 bytes
+
+#define MAX_ARGS 16 // Arguments exposed by a MessageView, later ones are ignored
+
+#define COMPRESS_THRESHOLD 512 // Smaller frames are not worth compressing
+
+class MessageView;
+
+// Payload bytes of the frames compressed by one serialize
+struct FrameStats
+{
+    size_t raw = 0;
+    size_t compressed = 0;
+    uint64_t ns = 0; // Time spent compressing
+};
+
+// Framing choices of a connection
+struct FrameOptions
+{
+    size_t maxFrame = 0;                      // 0 gives a single version 1 frame
+    size_t compressAbove = 0;                 // Frames of this many payload bytes or more go compressed when it pays, 0 never
+    const LzDictionary *dictionary = nullptr; // Shared with the peer beforehand
+    FrameStats *stats = nullptr;
+    const Cipher *cipher = nullptr;           // Cipher of the connection, nullptr for Cipher::active()
+};
 
 class Message
 {
 private:
     uint8_t type;                 // Type of message (request/response)
     uint8_t command;              // Command byte
+    bool typed;                   // Arguments are typed fields instead of NUL terminated strings
+    bool compact;                 // Payload is a compact body instead of arguments
+    bool continued;               // Received frame is followed by more of the same message
+    bool correlated;              // Frame carries a correlation id
+    uint32_t correlation;
+    bool compressed;              // Payload is still compressed, see decompress()
     std::vector<uint8_t> payload; // Payload data
 
     // Utility functions for serialization and deserialization
@@ -22,15 +82,32 @@ private:
     template <typename T>
     static T from_bytes(const std::vector<uint8_t> &bytes, size_t &idx);
 
-    // Placeholder encryption (XOR with 0xFF for now)
-    void encrypt(std::vector<uint8_t> &data) const;
+    void addField(uint8_t kind, const uint8_t *data, size_t size);
 
-    // Placeholder decryption (XOR with 0xFF for now)
-    void decrypt(std::vector<uint8_t> &data) const;
+    // Moves the payload to a pooled buffer with room for extra more bytes, a first one gets at least the hint
+    void grow(size_t extra);
+
+    // In place with the cipher of the connection, offset is the position of data in its frame
+    static void encrypt(const Cipher *cipher, uint8_t *data, size_t size, uint64_t offset = 0);
+    static void decrypt(const Cipher *cipher, uint8_t *data, size_t size, uint64_t offset = 0);
+
+    // Header length and payload length of a frame, 0 header length until enough bytes arrived
+    static size_t header(const uint8_t *data, size_t size, size_t &length, uint32_t *correlation = nullptr);
+    static constexpr size_t MAX_HEADER = 10;
+
+    // Frames of the message, a maxFrame of 0 gives a single frame of at most MAX_PAYLOAD
+    std::vector<uint8_t> frames(const FrameOptions &options, bool correlated, uint32_t correlation) const;
+
+    friend class MessageView;
 
 public:
-    // Constructor
+    // Constructor, payloads are drawn from the BufferPool of the thread and given back on destruction
     Message();
+    Message(const Message &other);
+    Message(Message &&other) noexcept;
+    Message &operator=(const Message &other);
+    Message &operator=(Message &&other) noexcept;
+    ~Message();
 
     // Setters and Getters for type, flags, and command
     void setType(uint8_t t);
@@ -39,12 +116,66 @@ public:
     void setCommand(uint8_t c);
     int getCommand() const;
 
+    // Typed fields carry binary data at raw size, set before adding arguments
+    void setTyped(bool t);
+    bool isTyped() const;
+
     // Add an argument to the payload
-    void addArg(const std::string &arg);
+    void addArg(std::string_view arg);
+
+    // Add a binary or integer field, the message must be typed
+    // Throws for fields over MAX_FIELD bytes, larger data is sent in chunks
+    void addBytes(const uint8_t *data, size_t size);
+    void addUint(uint64_t value);
 
     // Clear arguments from the payload
     void clearArgs();
 
+    // Replace the payload with a compact body, arguments can not be added to it
+    template <typename T>
+    void setBody(const T &body)
+    {
+        typed = false;
+        compact = true;
+
+        // Encoded into a per-thread scratch first, the payload is then sized once from the pool
+        thread_local std::vector<uint8_t> scratch;
+        scratch.clear();
+        CompactWriter(scratch).write(body);
+
+        payload.clear();
+        grow(scratch.size());
+        payload.insert(payload.end(), scratch.begin(), scratch.end());
+    }
+
+    // False when the payload is not a compact body of this schema
+    template <typename T>
+    bool getBody(T &body) const
+    {
+        return compact and CompactReader(payload.data(), payload.size()).read(body);
+    }
+
+    bool isCompact() const;
+
+    // Flag bits of the payload encoding, TYPED_FIELDS and COMPACT_BODY
+    uint8_t encoding() const;
+    void setEncoding(uint8_t flags);
+
+    // Correlation id of a request, echoed by its responses
+    void setCorrelation(uint32_t id);
+    bool isCorrelated() const;
+    uint32_t getCorrelation() const;
+
+    // A received compressed frame keeps its payload compressed until decompress()
+    // with the dictionary named by dictionaryId(), 0 for none
+    bool isCompressed() const;
+    uint32_t dictionaryId() const;
+    bool decompress(const LzDictionary *dictionary = nullptr);
+
+    // More frames of this message follow, their payloads are appended with append()
+    bool isContinued() const;
+    void append(const Message &next);
+
     // Set payload, file transfer
     void setPayload(const std::vector<uint8_t> &newPayload);
     void setPayload(const uint8_t *data, size_t size);
@@ -52,17 +183,106 @@ public:
     // Get payload, file transfer
     const std::vector<uint8_t> &getPayload() const;
 
-    // Get arguments from the payload
+    // Get arguments from the payload, integer fields in decimal
+    // Allocates the strings, the request path reads arguments through MessageView instead
     std::vector<std::string> getArgs() const;
 
     // Serialize the message
     std::vector<uint8_t> serialize() const;
 
-    // Deserialize the message and validate length
-    static Message deserialize(const std::vector<uint8_t> &buffer);
+    // Version 2: frames of up to maxFrame payload bytes, wide lengths above MAX_PAYLOAD
+    // Larger messages are split into continued frames, a maxFrame of 0 falls back to serialize()
+    std::vector<uint8_t> serialize(size_t maxFrame) const;
+
+    // As above with the correlation id of the request it answers
+    std::vector<uint8_t> serialize(size_t maxFrame, uint32_t correlation) const;
+
+    // Frames as the options of the connection ask for, compressed ones included
+    std::vector<uint8_t> serialize(const FrameOptions &options) const;
+    std::vector<uint8_t> serialize(const FrameOptions &options, uint32_t correlation) const;
+
+    // Deserialize the message and validate length, frames of a connection with its own cipher pass it
+    static Message deserialize(const std::vector<uint8_t> &buffer, const Cipher *cipher = nullptr);
+    static Message deserialize(const uint8_t *data, size_t size, const Cipher *cipher = nullptr);
+
+    // Size of the first frame in a stream buffer, 0 until it has fully arrived
+    // Throws when the frame declares more than maxPayload bytes
+    static size_t frameSize(const uint8_t *data, size_t size, size_t maxPayload = MAX_PAYLOAD, const Cipher *cipher = nullptr);
+
+    // View over the payload of this message
+    MessageView view() const;
 
     // Print the message for debugging
     void print() const;
 };
 
+// Frame decoded in place over a receive buffer, valid as long as the buffer is
+class MessageView
+{
+public:
+    // Arguments of one frame, views into the buffer
+    class Args
+    {
+    private:
+        std::array<std::string_view, MAX_ARGS> views;
+        std::array<uint8_t, MAX_ARGS> kinds; // FIELD_TEXT for NUL terminated arguments
+        size_t count = 0;
+
+        friend class MessageView;
+
+    public:
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+
+        // Raw bytes of the argument, integer fields are read with number()
+        std::string_view operator[](size_t i) const { return views[i]; }
+
+        // Integer field or decimal text, fallback when missing or malformed
+        uint64_t number(size_t i, uint64_t fallback = 0) const;
+    };
+
+private:
+    uint8_t type;
+    uint8_t command;
+    bool typed;
+    bool compact;
+    bool continued;
+    bool correlated;
+    uint32_t correlation;
+    bool compressed;
+    const uint8_t *payload;
+    size_t length;
+
+    friend class Message;
+
+public:
+    // Decrypt a whole frame, as sized by Message::frameSize, in place
+    static MessageView decode(uint8_t *data, size_t size, const Cipher *cipher = nullptr);
+
+    uint8_t getType() const { return type; }
+    int getCommand() const { return command; }
+    bool isTyped() const { return typed; }
+    bool isCompact() const { return compact; }
+    bool isContinued() const { return continued; }
+    bool isCorrelated() const { return correlated; }
+    uint32_t getCorrelation() const { return correlation; }
+    bool isCompressed() const { return compressed; }
+
+    // False when the payload is not a compact body of this schema
+    template <typename T>
+    bool getBody(T &body) const
+    {
+        return compact and CompactReader(payload, length).read(body);
+    }
+
+    const uint8_t *data() const { return payload; }
+    size_t size() const { return length; }
+
+    // Split the payload into arguments, no copies are made
+    Args args() const;
+
+    // Owning copy, for work that outlives the buffer
+    Message toMessage() const;
+};
+
 #endif // MESSAGE_HPP
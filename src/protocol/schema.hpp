@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include "compact.hpp"
+#include "message.hpp"
+
+// Bodies of the requests and responses that can be sent compact, shared by server and client
+// Fields are encoded in the order fields() lists them, new fields go at the end
+
+// Optional features of the protocol, a connection uses those both sides list in the hello
+#define FEATURE_TYPED 0x01       // Typed fields
+#define FEATURE_COMPACT 0x02     // Compact bodies
+#define FEATURE_CORRELATION 0x04 // Correlation ids
+#define FEATURE_BATCH 0x08       // 0x02 batches
+#define FEATURES (FEATURE_TYPED | FEATURE_COMPACT | FEATURE_CORRELATION | FEATURE_BATCH)
+
+// 0x01 request and its 0x03 response, the response holds what both sides agreed on
+struct Hello
+{
+    uint32_t version = 1;
+    uint32_t maxFrame = 0;
+    std::vector<std::string> codecs; // Accepted in preference order, the response holds the chosen one
+    uint64_t features = 0;
+
+    static constexpr auto fields() { return std::make_tuple(&Hello::version, &Hello::maxFrame, &Hello::codecs, &Hello::features); }
+};
+
+// 0x20 and 0x21 request, a compact one asks for a compact NameList
+struct ListRequest
+{
+    static constexpr auto fields() { return std::tuple<>(); }
+};
+
+// 0x22 and 0x23 request
+struct HistoryRequest
+{
+    std::string target; // Channel, or user of a conversation, empty for every conversation
+    uint32_t page = 0;
+
+    static constexpr auto fields() { return std::make_tuple(&HistoryRequest::target, &HistoryRequest::page); }
+};
+
+struct ChatMessage
+{
+    std::string sender;
+    std::string text;
+    uint64_t sentAt = 0; // Epoch seconds
+
+    static constexpr auto fields() { return std::make_tuple(&ChatMessage::sender, &ChatMessage::text, &ChatMessage::sentAt); }
+};
+
+// 0x32 and 0x33 response, a history page or a live message
+struct HistoryPage
+{
+    std::string target; // Channel name, empty for a conversation
+    std::vector<ChatMessage> messages;
+
+    static constexpr auto fields() { return std::make_tuple(&HistoryPage::target, &HistoryPage::messages); }
+};
+
+// 0x25 request
+struct SearchRequest
+{
+    std::string query;
+    std::string cursor; // Empty for the first page
+
+    static constexpr auto fields() { return std::make_tuple(&SearchRequest::query, &SearchRequest::cursor); }
+};
+
+struct SearchHit
+{
+    std::string target; // Channel name, or the other party of a private message
+    ChatMessage message;
+
+    static constexpr auto fields() { return std::make_tuple(&SearchHit::target, &SearchHit::message); }
+};
+
+// 0x35 response
+struct SearchPage
+{
+    std::string cursor; // Empty after the last page
+    std::vector<SearchHit> hits;
+
+    static constexpr auto fields() { return std::make_tuple(&SearchPage::cursor, &SearchPage::hits); }
+};
+
+// 0x40 and 0x41 response
+struct NameList
+{
+    std::vector<std::string> names;
+
+    static constexpr auto fields() { return std::make_tuple(&NameList::names); }
+};
+
+// A request or response inside a batch, flags are its TYPED_FIELDS and COMPACT_BODY bits
+struct BatchEntry
+{
+    uint32_t command = 0;
+    uint32_t flags = 0;
+    std::string payload;
+
+    static constexpr auto fields() { return std::make_tuple(&BatchEntry::command, &BatchEntry::flags, &BatchEntry::payload); }
+};
+
+#define MAX_BATCH 256 // Sub-requests in one batch
+
+// 0x02 request, the sub-requests run in order
+struct BatchRequest
+{
+    std::vector<BatchEntry> requests;
+
+    static constexpr auto fields() { return std::make_tuple(&BatchRequest::requests); }
+};
+
+// Responses to one sub-request, most send one but some send several or none
+struct BatchResult
+{
+    std::vector<BatchEntry> responses;
+
+    static constexpr auto fields() { return std::make_tuple(&BatchResult::responses); }
+};
+
+// 0x04 response, one result per sub-request in request order
+struct BatchResponse
+{
+    std::vector<BatchResult> results;
+
+    static constexpr auto fields() { return std::make_tuple(&BatchResponse::results); }
+};
+
+inline BatchEntry batchEntry(const Message &msg)
+{
+    const std::vector<uint8_t> &payload = msg.getPayload();
+    return {static_cast<uint32_t>(msg.getCommand()), msg.encoding(), std::string(payload.begin(), payload.end())};
+}
+
+inline Message batchMessage(const BatchEntry &entry, uint8_t type)
+{
+    Message msg;
+    msg.setType(type);
+    msg.setCommand(static_cast<uint8_t>(entry.command));
+    msg.setEncoding(static_cast<uint8_t>(entry.flags));
+    msg.setPayload(reinterpret_cast<const uint8_t *>(entry.payload.data()), entry.payload.size());
+    return msg;
+}
+
+// Text payloads carry "YYYY-MM-DD HH:MM:SS" in UTC, compact ones epoch seconds
+// 0 for text that is not a timestamp
+inline uint64_t epochSeconds(std::string_view text)
+{
+    if (text.size() != 19)
+    {
+        return 0;
+    }
+
+    bool ok = true;
+    auto number = [&](size_t pos, size_t len)
+    {
+        unsigned value = 0;
+        for (size_t i = pos; i < pos + len; ++i)
+        {
+            ok = ok and text[i] >= '0' and text[i] <= '9';
+            value = value * 10 + (text[i] - '0');
+        }
+        return value;
+    };
+
+    std::chrono::year_month_day date{std::chrono::year(number(0, 4)), std::chrono::month(number(5, 2)), std::chrono::day(number(8, 2))};
+    uint64_t time = number(11, 2) * 3600 + number(14, 2) * 60 + number(17, 2);
+    if (!ok or !date.ok())
+    {
+        return 0;
+    }
+    return std::chrono::sys_days(date).time_since_epoch() / std::chrono::seconds(1) + time;
+}
+
+inline std::string epochText(uint64_t seconds)
+{
+    time_t t = seconds;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+
+    char text[20];
+    std::strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm);
+    return text;
+}
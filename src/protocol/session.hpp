@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "message.hpp"
+#include "schema.hpp"
+
+// What the hello of a connection agreed on, consulted whenever a message is framed
+// Replaced as a whole, a connection without a hello keeps the version 1 defaults
+struct Session
+{
+    uint32_t version = 1;
+    size_t maxFrame = 0;      // 0 keeps version 1 frames
+    size_t compressAbove = 0; // 0 never compresses
+    uint64_t features = 0;    // FEATURE_ bits
+    std::shared_ptr<const LzDictionary> dictionary; // Registered by the client with 0x05
+    std::shared_ptr<const Cipher> cipher;           // Frames of this connection, Cipher::active() when unset
+
+    bool has(uint64_t feature) const { return (features & feature) == feature; }
+
+    FrameOptions frameOptions(FrameStats *stats = nullptr) const
+    {
+        return {maxFrame, compressAbove, dictionary.get(), stats, cipher.get()};
+    }
+};
@@ -39,5 +39,68 @@ int main() {
         std::cerr << "Error: " << e.what() << std::endl;
     }
 
-    return 0;
+    // Typed fields: the largest one survives a round trip, a larger one is refused
+    int failures = 0;
+    {
+        Message typed;
+        typed.setType(0x02);
+        typed.setCommand(0x71);
+        typed.setTyped(true);
+        std::vector<uint8_t> data(MAX_FIELD, 0x5A);
+        typed.addBytes(data.data(), data.size());
+
+        Message back = Message::deserialize(typed.serialize(MAX_FRAME));
+        std::vector<std::string> args = back.getArgs();
+        if (args.size() != 1 or args[0].size() != MAX_FIELD) {
+            std::cerr << "Field of " << MAX_FIELD << " bytes did not round trip" << std::endl;
+            ++failures;
+        }
+
+        std::vector<uint8_t> large(MAX_FIELD + 1, 0x5A);
+        try {
+            typed.addBytes(large.data(), large.size());
+            std::cerr << "Field of " << large.size() << " bytes was accepted" << std::endl;
+            ++failures;
+        } catch (const std::length_error&) {
+        }
+        if (typed.getPayload().size() != 3 + MAX_FIELD) {
+            std::cerr << "Refused field changed the payload" << std::endl;
+            ++failures;
+        }
+    }
+
+    // The cipher is fixed once frames have been handled, it is not swapped under running threads
+    try {
+        Cipher::install(std::make_unique<XorCipher>(0x5A));
+        std::cerr << "Cipher replaced after the first frame" << std::endl;
+        ++failures;
+    } catch (const std::logic_error&) {
+    }
+
+    // Frames of a connection with its own cipher are read back with that cipher only
+    {
+        XorCipher own(0x5A);
+        Message msg;
+        msg.setType(0x02);
+        msg.setCommand(0x40);
+        msg.addArg("#general");
+
+        std::vector<uint8_t> frame = msg.serialize({.cipher = &own});
+        if (frame == msg.serialize()) {
+            std::cerr << "Cipher of the connection was not used" << std::endl;
+            ++failures;
+        }
+        std::vector<std::string> args = Message::deserialize(frame, &own).getArgs();
+        if (args.size() != 1 or args[0] != "#general") {
+            std::cerr << "Frame did not round trip with the cipher of the connection" << std::endl;
+            ++failures;
+        }
+        MessageView view = MessageView::decode(frame.data(), Message::frameSize(frame.data(), frame.size(), MAX_PAYLOAD, &own), &own);
+        if (view.getCommand() != 0x40 or view.args().size() != 1) {
+            std::cerr << "Frame did not decode with the cipher of the connection" << std::endl;
+            ++failures;
+        }
+    }
+
+    return failures;
 }
@@ -0,0 +1,56 @@
+#include "batch.hpp"
+#include "server.hpp"
+
+Batch::Batch(Server &server, const RequestContext &context, size_t size) : server(server), context(context)
+{
+    response.results.resize(size);
+}
+
+void Batch::add(size_t slot, const Message &msg)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    response.results[slot].responses.push_back(batchEntry(msg));
+}
+
+void Batch::hold()
+{
+    pending.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Batch::release()
+{
+    if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        finish();
+    }
+}
+
+void Batch::fail()
+{
+    failed.store(true, std::memory_order_release);
+}
+
+// Run by the last holder, every response of the sub-requests is in
+void Batch::finish()
+{
+    Message msg;
+    msg.setType(0x02);
+    msg.setCommand(0x04);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (isFailed())
+        {
+            Message error;
+            error.setType(0x02);
+            error.setCommand(0x01); // Server Side Error
+            for (BatchResult &result : response.results)
+            {
+                result.responses.assign(1, batchEntry(error));
+            }
+        }
+        msg.setBody(response);
+    }
+
+    RequestScope scope(context);
+    server.sendClient(context.client_sd, msg);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+
+#include "request_context.hpp"
+#include "../protocol/schema.hpp"
+
+class Server;
+
+// Responses to the sub-requests of one 0x02 request. The 0x02 handler and every completion
+// submitted by a sub-request hold the batch, the last one to release it sends the 0x04
+class Batch
+{
+private:
+    Server &server;
+    RequestContext context; // Context of the 0x02 request
+    std::mutex mutex;
+    BatchResponse response;
+    std::atomic<size_t> pending{1};   // Holders still running, the 0x02 handler to start with
+    std::atomic<bool> failed{false}; // The writes of the batch were rolled back
+
+    void finish();
+
+public:
+    Batch(Server &server, const RequestContext &context, size_t size);
+
+    // Response to the sub-request at slot
+    void add(size_t slot, const Message &msg);
+
+    // A completion was submitted, it releases the batch once it ran
+    void hold();
+    void release();
+
+    // Answer every sub-request with a server side error instead of its responses,
+    // messages the sub-requests would relay to others are not sent
+    void fail();
+    bool isFailed() const { return failed.load(std::memory_order_acquire); }
+
+    size_t size() const { return response.results.size(); }
+};
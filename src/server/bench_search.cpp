@@ -0,0 +1,159 @@
+// Search benchmark: index build time and query latency
+// Usage: ./bench_search [messages] [queries]
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <cstdio>
+
+#include "database.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Log-uniform pick, a few words are very common and most are rare
+static std::string word(std::mt19937 &gen, int vocabulary)
+{
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    int idx = static_cast<int>(std::pow(vocabulary, dist(gen))) - 1;
+    return "w" + std::to_string(idx);
+}
+
+static std::string sentence(std::mt19937 &gen, int vocabulary)
+{
+    std::uniform_int_distribution<int> len(5, 15);
+    std::string text;
+    for (int i = len(gen); i > 0; --i)
+    {
+        text += (text.empty() ? "" : " ") + word(gen, vocabulary);
+    }
+    return text;
+}
+
+static bool exec(sqlite3 *db, const std::string &sql)
+{
+    char *err = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK)
+    {
+        std::cerr << "SQL error: " << (err ? err : "") << std::endl;
+        sqlite3_free(err);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    long messages = argc > 1 ? std::stol(argv[1]) : 10000000;
+    int queries = argc > 2 ? std::stoi(argv[2]) : 1000;
+    const int vocabulary = 50000;
+    const std::string path = "bench_search.db";
+
+    std::remove(path.c_str());
+    for (int i = 0; i < MSG_SHARDS; ++i)
+    {
+        std::remove(("bench_search.msg" + std::to_string(i) + ".db").c_str());
+    }
+    std::mt19937 gen(42);
+
+    // Load the base schema and the raw messages, without any search index
+    sqlite3 *raw;
+    if (sqlite3_open(path.c_str(), &raw) != SQLITE_OK)
+    {
+        std::cerr << "Failed to open " << path << std::endl;
+        return 1;
+    }
+
+    std::ifstream schema("init.sql");
+    std::stringstream sql;
+    sql << schema.rdbuf();
+    if (!exec(raw, "PRAGMA journal_mode = OFF; PRAGMA synchronous = OFF;") or !exec(raw, sql.str()))
+    {
+        return 1;
+    }
+
+    auto start = Clock::now();
+    exec(raw, "BEGIN;");
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(raw, "INSERT INTO channel_messages (sender_id, channel_id, message_text) VALUES (1, ?, ?);", -1, &stmt, nullptr);
+    for (long i = 0; i < messages; ++i)
+    {
+        std::string text = sentence(gen, vocabulary);
+        sqlite3_bind_int(stmt, 1, 1 + i % 2);
+        sqlite3_bind_text(stmt, 2, text.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    exec(raw, "COMMIT;");
+    sqlite3_close(raw);
+    std::cout << "load:        " << messages << " messages in " << elapsed(start) << " s" << std::endl;
+
+    // Shard connections are closed before the files are removed
+    {
+        // Opening the database moves the messages into the shards and indexes them
+        start = Clock::now();
+        Database db(path, 1);
+        std::cout << "index build: " << elapsed(start) << " s" << std::endl;
+
+        // Write path with incremental index maintenance
+        const int inserts = 10000;
+        start = Clock::now();
+        for (int i = 0; i < inserts; ++i)
+        {
+            db.insertChannelMessage(1, 1, sentence(gen, vocabulary));
+        }
+        std::cout << "insert:      " << elapsed(start) * 1e6 / inserts << " us/message (indexed, autocommit)" << std::endl;
+
+        // Query latency, first page and the page after it
+        std::vector<double> first, next;
+        std::vector<SearchResult> results;
+        std::string cursor;
+        for (int i = 0; i < queries; ++i)
+        {
+            std::string query = word(gen, vocabulary);
+            if (i % 2)
+            {
+                query += " " + word(gen, vocabulary);
+            }
+
+            start = Clock::now();
+            db.searchMessages(1, {1, 2}, query, "", PAGE_SZ, results, cursor);
+            first.push_back(elapsed(start) * 1e3);
+
+            if (!cursor.empty())
+            {
+                start = Clock::now();
+                db.searchMessages(1, {1, 2}, query, cursor, PAGE_SZ, results, cursor);
+                next.push_back(elapsed(start) * 1e3);
+            }
+        }
+
+        auto report = [](const char *name, std::vector<double> &ms)
+        {
+            if (ms.empty())
+            {
+                return;
+            }
+            std::sort(ms.begin(), ms.end());
+            std::cout << name << ms.size() << " queries, p50 " << ms[ms.size() / 2]
+                      << " ms, p99 " << ms[ms.size() * 99 / 100] << " ms" << std::endl;
+        };
+        report("first page:  ", first);
+        report("next page:   ", next);
+    }
+
+    std::remove(path.c_str());
+    for (int i = 0; i < MSG_SHARDS; ++i)
+    {
+        std::remove(("bench_search.msg" + std::to_string(i) + ".db").c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+#include "blob_store.hpp"
+
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/stat.h>
+
+Hasher::Hasher() : ctx(EVP_MD_CTX_new())
+{
+    if (!ctx or EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) != 1)
+    {
+        throw std::runtime_error("Failed to initialise SHA-256");
+    }
+}
+
+Hasher::~Hasher()
+{
+    EVP_MD_CTX_free(ctx);
+}
+
+void Hasher::update(const uint8_t *data, size_t size)
+{
+    EVP_DigestUpdate(ctx, data, size);
+}
+
+std::string Hasher::final()
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_DigestFinal_ex(ctx, md, &len);
+
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(2 * len, '0');
+    for (unsigned int i = 0; i < len; ++i)
+    {
+        hex[2 * i] = digits[md[i] >> 4];
+        hex[2 * i + 1] = digits[md[i] & 15];
+    }
+    return hex;
+}
+
+std::string Hasher::digest(const std::string &data)
+{
+    Hasher hasher;
+    hasher.update(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+    return hasher.final();
+}
+
+BlobStore::BlobStore(const std::string &root)
+    : root(root),
+      stored(Metrics::instance().counter("files.bytes_stored")),
+      dedupHits(Metrics::instance().counter("files.dedup_hits")),
+      bytesSaved(Metrics::instance().counter("files.dedup_bytes_saved"))
+{
+}
+
+std::string BlobStore::path(const std::string &hash) const
+{
+    return root + "/" + hash.substr(0, 2) + "/" + hash.substr(2, 2) + "/" + hash;
+}
+
+bool BlobStore::contains(const std::string &hash) const
+{
+    std::error_code ec;
+    return std::filesystem::exists(path(hash), ec);
+}
+
+bool BlobStore::adopt(const std::string &file, const std::string &hash, uint64_t size)
+{
+    std::string target = path(hash);
+    std::error_code ec;
+
+    if (std::filesystem::exists(target, ec))
+    {
+        // Same content is already stored, keep one copy
+        std::remove(file.c_str());
+        dedupHits.add();
+        bytesSaved.add(size);
+        return true;
+    }
+
+    std::filesystem::create_directories(std::filesystem::path(target).parent_path(), ec);
+
+    // Atomic, a racing upload of the same content writes identical bytes
+    if (std::rename(file.c_str(), target.c_str()) != 0)
+    {
+        std::cerr << "Error moving file into the blob store: " << file << std::endl;
+        return false;
+    }
+    stored.add(size);
+    return true;
+}
+
+bool BlobStore::store(const std::string &contents, const std::string &hash)
+{
+    std::string target = path(hash);
+    std::error_code ec;
+
+    if (std::filesystem::exists(target, ec))
+    {
+        dedupHits.add();
+        bytesSaved.add(contents.size());
+        return true;
+    }
+
+    std::filesystem::create_directories(std::filesystem::path(target).parent_path(), ec);
+
+    // Written aside under a unique name, concurrent stores of the same content each have their own
+    std::string tmp = target + ".XXXXXX";
+    int fd = mkstemp(tmp.data());
+    if (fd == -1)
+    {
+        std::cerr << "Error creating a file in the blob store: " << tmp << std::endl;
+        return false;
+    }
+
+    fchmod(fd, 0644); // Readable as blobs written by other means
+
+    size_t written = 0;
+    while (written < contents.size())
+    {
+        ssize_t n = write(fd, contents.data() + written, contents.size() - written);
+        if (n == -1 and errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        written += n;
+    }
+    if (close(fd) != 0 or written != contents.size())
+    {
+        std::cerr << "Error writing to file: " << tmp << std::endl;
+        std::remove(tmp.c_str());
+        return false;
+    }
+
+    // Linked into place so readers never see a partial blob, the first of racing stores wins
+    if (link(tmp.c_str(), target.c_str()) != 0)
+    {
+        int error = errno;
+        std::remove(tmp.c_str());
+        if (error == EEXIST)
+        {
+            dedupHits.add();
+            bytesSaved.add(contents.size());
+            return true;
+        }
+        std::cerr << "Error moving file into the blob store: " << tmp << std::endl;
+        return false;
+    }
+    std::remove(tmp.c_str());
+    stored.add(contents.size());
+    return true;
+}
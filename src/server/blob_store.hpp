@@ -0,0 +1,49 @@
+#pragma once
+
+#include <openssl/evp.h>
+#include <cstdint>
+#include <string>
+
+#include "metrics.hpp"
+
+// Incremental SHA-256 (SHA-NI accelerated in OpenSSL), hex digest
+class Hasher
+{
+private:
+    EVP_MD_CTX *ctx;
+
+public:
+    Hasher();
+    ~Hasher();
+    Hasher(const Hasher &) = delete;
+    Hasher &operator=(const Hasher &) = delete;
+
+    void update(const uint8_t *data, size_t size);
+    std::string final();
+
+    static std::string digest(const std::string &data);
+};
+
+// Content addressed files: <root>/<h0h1>/<h2h3>/<hash>, one copy per distinct content
+class BlobStore
+{
+private:
+    std::string root;
+
+    // Exported metrics
+    Counter &stored;
+    Counter &dedupHits;
+    Counter &bytesSaved;
+
+public:
+    explicit BlobStore(const std::string &root);
+
+    std::string path(const std::string &hash) const;
+    bool contains(const std::string &hash) const;
+
+    // Move a finished file into the store, a duplicate is removed instead
+    bool adopt(const std::string &file, const std::string &hash, uint64_t size);
+
+    // Write contents into the store unless the blob already exists
+    bool store(const std::string &contents, const std::string &hash);
+};
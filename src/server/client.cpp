@@ -1,5 +1,7 @@
 #include "client.hpp"
 
+#include <unistd.h>
+
 Client::Client(int id, const std::string &user, const std::string &nick, const std::vector<int> &channels, const std::vector<int> &clients, int sd, int channel, bool admin, const struct sockaddr_in &addr)
 {
     this->client_id = id;
@@ -9,39 +11,60 @@ Client::Client(int id, const std::string &user, const std::string &nick, const s
     this->curr_channel = 0;
     this->isAdmin = admin;
     this->remote_addr = addr;
+    this->connection = 0;
 }
 
-Client::Client(int sd, const struct sockaddr_in &addr)
+Client::Client(int sd, const struct sockaddr_in &addr, uint64_t connection)
     : client_id(0),
       username(""),
       nickname(""),
       client_sd(sd),
       curr_channel(0),
       isAdmin(false),
-      remote_addr(addr)
+      remote_addr(addr),
+      connection(connection)
 {
 }
 
-Client::~Client() {}
+Client::~Client()
+{
+    for (Outbound &out : outbox)
+    {
+        if (out.fd != -1)
+        {
+            close(out.fd);
+        }
+    }
+}
 
 // Getters
-int Client::getID() const { return client_id; }
-std::string Client::getUserName() const { return username; }
-std::string Client::getNickName() const { return nickname; }
+int Client::getID() const { std::lock_guard<std::mutex> lock(stateMutex); return client_id; }
+std::string Client::getUserName() const { std::lock_guard<std::mutex> lock(stateMutex); return username; }
+std::string Client::getNickName() const { std::lock_guard<std::mutex> lock(stateMutex); return nickname; }
 int Client::getClientfd() const { return client_sd; }
-bool Client::getAuth() const { return isAdmin; }
-bool Client::isAuthenticated() const { return !username.empty(); }
-int Client::getChannel() const { return curr_channel; }
+bool Client::getAuth() const { std::lock_guard<std::mutex> lock(stateMutex); return isAdmin; }
+bool Client::isAuthenticated() const { std::lock_guard<std::mutex> lock(stateMutex); return !username.empty(); }
+int Client::getChannel() const { std::lock_guard<std::mutex> lock(stateMutex); return curr_channel; }
+uint64_t Client::getConnection() const { return connection; }
 
 // Setters
-void Client::setID(int ID) { this->client_id = ID; }
-void Client::setUserName(const std::string &UserName) { this->username = UserName; }
-void Client::setNickName(const std::string &NickName) { this->nickname = NickName; }
+void Client::setID(int ID) { std::lock_guard<std::mutex> lock(stateMutex); this->client_id = ID; }
+void Client::setUserName(const std::string &UserName) { std::lock_guard<std::mutex> lock(stateMutex); this->username = UserName; }
+void Client::setNickName(const std::string &NickName) { std::lock_guard<std::mutex> lock(stateMutex); this->nickname = NickName; }
 void Client::setClientfd(int clientfd) { this->client_sd = clientfd; }
-void Client::setAuth(bool Auth) { this->isAdmin = Auth; }
+void Client::setAuth(bool Auth) { std::lock_guard<std::mutex> lock(stateMutex); this->isAdmin = Auth; }
+
+void Client::login(int ID, const std::string &UserName, const std::string &NickName)
+{
+    std::lock_guard<std::mutex> lock(stateMutex);
+    this->client_id = ID;
+    this->username = UserName;
+    this->nickname = NickName;
+}
 
 // TODO
 std::string Client::getUserInfo() const
 {
+    std::lock_guard<std::mutex> lock(stateMutex);
     return "Username: " + username + ", Nickname: " + nickname;
 }
\ No newline at end of file
@@ -5,10 +5,35 @@
 #include <netinet/in.h>
 #include <algorithm>
 #include <mutex>
+#include <deque>
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <sys/types.h>
+
+#include "file_cache.hpp"
+#include "../protocol/message.hpp"
+#include "../protocol/session.hpp"
+
+// Pending write to the socket: serialized frames, or a file segment sent with sendfile or from the file cache
+struct Outbound
+{
+    std::vector<uint8_t> bytes;
+    size_t sent = 0;
+
+    int fd = -1;       // File to stream, -1 for frames
+    off_t offset = 0;  // Cursor in the file
+    size_t remaining = 0;
+
+    std::shared_ptr<const MappedFile> region; // Cached file to stream instead of fd
+};
 
 class Client
 {
 private:
+    // Guards the values below, login completions set them while the event loop reads them
+    mutable std::mutex stateMutex;
+
     // Values from database
     int client_id;
     std::string username;
@@ -19,12 +44,37 @@ private:
     int curr_channel;
     bool isAdmin;
     struct sockaddr_in remote_addr;
+    uint64_t connection; // Tells apart connections that reused a descriptor
 
 public:
-    std::mutex mutex;
+    std::mutex mutex;            // Serialises writes to the socket
+    std::deque<Outbound> outbox; // Writes waiting for the socket, guarded by mutex
+    bool writeArmed = false;     // EPOLLOUT registered while the outbox is blocked
+
+    std::mutex readMutex;            // One reader at a time keeps frames in order
+    std::vector<uint8_t> readBuffer; // Bytes of a frame that has not fully arrived
+    Message continued;               // Request reassembled from continued frames
+    bool continuing = false;         // Continued frames are pending
+
+    // Agreed by the hello, version 1 until then, replaced whole by hello and 0x05
+    std::atomic<std::shared_ptr<const Session>> session{std::make_shared<const Session>()};
+
+    // Replace the session with a changed copy, retried when another request replaced it meanwhile
+    template <typename Fn>
+    void updateSession(Fn change)
+    {
+        std::shared_ptr<const Session> current = session.load();
+        std::shared_ptr<const Session> next;
+        do
+        {
+            auto copy = std::make_shared<Session>(*current);
+            change(*copy);
+            next = std::move(copy);
+        } while (!session.compare_exchange_weak(current, next));
+    }
 
 public:
-    Client(int sd, const struct sockaddr_in &addr);
+    Client(int sd, const struct sockaddr_in &addr, uint64_t connection);
     Client(int id, const std::string &user, const std::string &nick, const std::vector<int> &channels, const std::vector<int> &clients, int sd, int channel, bool admin, const struct sockaddr_in &addr);
     ~Client();
 
@@ -37,6 +87,7 @@ public:
     std::string getUserInfo() const;
     bool isAuthenticated() const;
     int getChannel() const;
+    uint64_t getConnection() const;
 
     // Setters
     void setID(int ID);
@@ -44,4 +95,7 @@ public:
     void setNickName(const std::string &NickName);
     void setClientfd(int clientfd);
     void setAuth(bool Auth);
+
+    // Account of a successful login, set together
+    void login(int ID, const std::string &UserName, const std::string &NickName);
 };
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include "clock.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <ctime>
+
+ClockService::ClockService()
+{
+    tick();
+    thread = std::thread([this]()
+                         {
+                             while (!stop.load(std::memory_order_relaxed))
+                             {
+                                 std::this_thread::sleep_for(std::chrono::milliseconds(CLOCK_TICK_MS));
+                                 tick();
+                             } });
+}
+
+ClockService::~ClockService()
+{
+    stop = true;
+    thread.join();
+}
+
+ClockService &ClockService::instance()
+{
+    static ClockService clock;
+    return clock;
+}
+
+void ClockService::tick()
+{
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+    ms.store(now, std::memory_order_relaxed);
+
+    // The string only changes once a second, the locale work stays here
+    if (now / 1000 == second)
+    {
+        return;
+    }
+    second = now / 1000;
+
+    time_t t = second;
+    struct tm tm;
+    char buf[sizeof(text)] = {};
+    localtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+
+    uint64_t words[3];
+    memcpy(words, buf, sizeof(words));
+
+    // Odd sequence while writing
+    seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < 3; ++i)
+    {
+        text[i].store(words[i], std::memory_order_relaxed);
+    }
+    seq.fetch_add(1, std::memory_order_release);
+}
+
+std::string ClockService::formatted() const
+{
+    char out[CLOCK_TEXT_SIZE];
+    return std::string(out, formatted(out));
+}
+
+size_t ClockService::formatted(char (&out)[CLOCK_TEXT_SIZE]) const
+{
+    static_assert(sizeof(text) == CLOCK_TEXT_SIZE);
+    uint64_t words[3];
+    uint64_t before, after;
+    do
+    {
+        before = seq.load(std::memory_order_acquire);
+        for (int i = 0; i < 3; ++i)
+        {
+            words[i] = text[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = seq.load(std::memory_order_relaxed);
+    } while (before != after or (before & 1));
+
+    memcpy(out, words, sizeof(words));
+    return strnlen(out, sizeof(words));
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#define CLOCK_TICK_MS 10   // Refresh period of the cached time
+#define CLOCK_TEXT_SIZE 24 // Buffer taking "YYYY-MM-DD HH:MM:SS"
+
+// Wall clock cached by a tick thread, readers never make a syscall
+class ClockService
+{
+private:
+    std::atomic<int64_t> ms{0}; // Epoch milliseconds of the last tick
+
+    // "YYYY-MM-DD HH:MM:SS" of the last second, guarded by a seqlock
+    std::atomic<uint64_t> seq{0};
+    std::atomic<uint64_t> text[3];
+    int64_t second = -1;
+
+    std::atomic<bool> stop{false};
+    std::thread thread;
+
+private:
+    ClockService();
+    ~ClockService();
+
+    void tick();
+
+public:
+    static ClockService &instance();
+
+    int64_t nowMs() const { return ms.load(std::memory_order_relaxed); }
+    std::string formatted() const;
+    size_t formatted(char (&out)[CLOCK_TEXT_SIZE]) const; // Length written, without allocating
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "../protocol/message.hpp"
+
+class Server;
+
+// Priority class of a request, bulk requests carry transfer data and are too frequent to log one by one
+enum class Priority : uint8_t
+{
+    Control,
+    Interactive,
+    Bulk,
+};
+
+// Descriptor of one request code, validated before the handler runs
+struct Command
+{
+    using Handler = void (Server::*)(int client_sd, const MessageView &msg);
+
+    uint8_t code;
+    Handler handler; // nullptr for commands that are not implemented yet
+    bool auth;       // Answered 0x02 unless the client is logged in
+    uint8_t minArgs; // Answered 0x00 with fewer arguments
+    Priority priority;
+    const char *name; // Log and metric name, requests.<name> and requests.<name>_us
+    bool silent;      // Failed checks are dropped instead of answered
+    bool batch;       // Allowed inside a 0x02 batch, its responses are frames only
+    uint32_t reserve; // Payload bytes its responses start with, 0 for the smallest pooled buffer
+};
+
+inline constexpr uint8_t NO_COMMAND = 0xFF;
+
+// Position of each request code in a descriptor table, NO_COMMAND for unknown codes
+template <size_t N>
+constexpr std::array<uint8_t, 256> commandIndex(const Command (&commands)[N])
+{
+    static_assert(N < NO_COMMAND, "Too many commands for the index");
+
+    std::array<uint8_t, 256> index{};
+    index.fill(NO_COMMAND);
+    for (size_t i = 0; i < N; ++i)
+    {
+        if (index[commands[i].code] != NO_COMMAND)
+        {
+            throw "Duplicate request code"; // Not a constant expression, fails the build
+        }
+        index[commands[i].code] = static_cast<uint8_t>(i);
+    }
+    return index;
+}
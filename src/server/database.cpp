@@ -1,9 +1,235 @@
 #include "database.hpp"
+#include "clock.hpp"
 
-Database::Database(const std::string &dbName, int poolSize) : pool(dbName, poolSize) {}
+#include <algorithm>
+#include <cinttypes>
+#include <ctime>
+#include <filesystem>
+#include <limits>
+#include <sstream>
+
+// Stable 64 bit mix (splitmix64 finalizer), shard placement must not change between runs
+static uint64_t mix(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// chatapp.db -> chatapp.msg<idx>.db
+static std::string shardPath(const std::string &dbName, int idx)
+{
+    std::string base = dbName.ends_with(".db") ? dbName.substr(0, dbName.size() - 3) : dbName;
+    return base + ".msg" + std::to_string(idx) + ".db";
+}
+
+MessageShard::MessageShard(const std::string &path, int poolSize)
+    : path(path), readers(path, poolSize), writer(nullptr)
+{
+    if (sqlite3_open(path.c_str(), &writer) != SQLITE_OK)
+    {
+        throw std::runtime_error("Failed to open shard writer connection: " + std::string(sqlite3_errmsg(writer)));
+    }
+    sqlite3_busy_timeout(writer, 5000);
+}
+
+MessageShard::~MessageShard()
+{
+    sqlite3_close(writer);
+}
+
+Database::Database(const std::string &dbName, int poolSize, int shardCount) : pool(dbName, poolSize)
+{
+    for (int i = 0; i < shardCount; ++i)
+    {
+        shards.push_back(std::make_unique<MessageShard>(shardPath(dbName, i), poolSize));
+        initShard(*shards.back());
+    }
+    migrateMessages();
+    initFiles();
+}
 
 Database::~Database() {}
 
+MessageShard &Database::channelShard(int channel_id)
+{
+    return *shards[mix(static_cast<uint32_t>(channel_id)) % shards.size()];
+}
+
+MessageShard &Database::privateShard(int id_a, int id_b)
+{
+    // Both directions of a conversation live in the same shard
+    uint64_t lo = static_cast<uint32_t>(std::min(id_a, id_b));
+    uint64_t hi = static_cast<uint32_t>(std::max(id_a, id_b));
+    return *shards[mix(lo << 32 | hi) % shards.size()];
+}
+
+static bool exec(sqlite3 *db, const char *sql)
+{
+    char *err = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &err) != SQLITE_OK)
+    {
+        std::cerr << "Execution failed: " << (err ? err : sqlite3_errmsg(db)) << std::endl;
+        sqlite3_free(err);
+        return false;
+    }
+    return true;
+}
+
+// Message tables, and the FTS5 indexes kept up to date by triggers on the write path
+static const char *messageSchema = R"(
+    CREATE TABLE IF NOT EXISTS channel_messages (
+        message_id INTEGER PRIMARY KEY AUTOINCREMENT,
+        sender_id INTEGER NOT NULL,
+        channel_id INTEGER NOT NULL,
+        message_text TEXT NOT NULL,
+        sent_at INTEGER NOT NULL -- Epoch milliseconds
+    );
+    CREATE TABLE IF NOT EXISTS private_messages (
+        message_id INTEGER PRIMARY KEY AUTOINCREMENT,
+        sender_id INTEGER NOT NULL,
+        recipient_id INTEGER NOT NULL,
+        message_text TEXT NOT NULL,
+        sent_at INTEGER NOT NULL -- Epoch milliseconds
+    );
+    CREATE INDEX IF NOT EXISTS idx_channel_messages ON channel_messages(channel_id, sent_at);
+    CREATE INDEX IF NOT EXISTS idx_sender_id_private_messages ON private_messages(sender_id);
+    CREATE INDEX IF NOT EXISTS idx_recipient_id_private_messages ON private_messages(recipient_id);
+
+    CREATE VIRTUAL TABLE IF NOT EXISTS channel_messages_fts
+        USING fts5(message_text, content='channel_messages', content_rowid='message_id');
+    CREATE VIRTUAL TABLE IF NOT EXISTS private_messages_fts
+        USING fts5(message_text, content='private_messages', content_rowid='message_id');
+
+    CREATE TRIGGER IF NOT EXISTS channel_messages_ai AFTER INSERT ON channel_messages BEGIN
+        INSERT INTO channel_messages_fts (rowid, message_text) VALUES (new.message_id, new.message_text);
+    END;
+    CREATE TRIGGER IF NOT EXISTS channel_messages_ad AFTER DELETE ON channel_messages BEGIN
+        INSERT INTO channel_messages_fts (channel_messages_fts, rowid, message_text) VALUES ('delete', old.message_id, old.message_text);
+    END;
+    CREATE TRIGGER IF NOT EXISTS private_messages_ai AFTER INSERT ON private_messages BEGIN
+        INSERT INTO private_messages_fts (rowid, message_text) VALUES (new.message_id, new.message_text);
+    END;
+    CREATE TRIGGER IF NOT EXISTS private_messages_ad AFTER DELETE ON private_messages BEGIN
+        INSERT INTO private_messages_fts (private_messages_fts, rowid, message_text) VALUES ('delete', old.message_id, old.message_text);
+    END;
+)";
+
+// Rows written before timestamps became epoch milliseconds hold CURRENT_TIMESTAMP text
+static const char *convertTimestamps = R"(
+    UPDATE channel_messages SET sent_at = unixepoch(sent_at) * 1000 WHERE typeof(sent_at) = 'text';
+    UPDATE private_messages SET sent_at = unixepoch(sent_at) * 1000 WHERE typeof(sent_at) = 'text';
+)";
+
+void Database::initShard(MessageShard &shard)
+{
+    std::lock_guard<std::mutex> lock(shard.writerMutex);
+    if (!exec(shard.writer, "PRAGMA journal_mode = WAL;") or !exec(shard.writer, messageSchema) or !exec(shard.writer, convertTimestamps))
+    {
+        throw std::runtime_error("Failed to initialise message shard " + shard.path);
+    }
+    loadArchives(shard);
+}
+
+void Database::migrateMessages()
+{
+    sqlite3 *db = pool.acquireConnection();
+
+    // Rows written before sharding, still in the central file
+    const char *channelSql = "SELECT sender_id, channel_id, message_text, unixepoch(sent_at) * 1000, message_id FROM channel_messages;";
+    const char *privateSql = "SELECT sender_id, recipient_id, message_text, unixepoch(sent_at) * 1000, message_id FROM private_messages;";
+
+    // Drop the central search index, the shards carry their own
+    const char *cleanup = R"(
+        DROP TRIGGER IF EXISTS channel_messages_ai;
+        DROP TRIGGER IF EXISTS channel_messages_ad;
+        DROP TRIGGER IF EXISTS private_messages_ai;
+        DROP TRIGGER IF EXISTS private_messages_ad;
+        DROP TABLE IF EXISTS channel_messages_fts;
+        DROP TABLE IF EXISTS private_messages_fts;
+        DELETE FROM channel_messages;
+        DELETE FROM private_messages;
+    )";
+
+    // One transaction per shard for the whole move, the central rows are deleted after all of them commit
+    // Rows keep their message_id, a move interrupted before the delete is redone without duplicating them
+    for (auto &shard : shards)
+    {
+        exec(shard->writer, "BEGIN;");
+    }
+
+    int moved = 0;
+    for (const char *sql : {channelSql, privateSql})
+    {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            // Central file without message tables, nothing to move
+            continue;
+        }
+
+        bool isChannel = sql == channelSql;
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            int sender_id = sqlite3_column_int(stmt, 0);
+            int target_id = sqlite3_column_int(stmt, 1);
+            const char *text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+            int64_t sent_at = sqlite3_column_int64(stmt, 3);
+            int64_t message_id = sqlite3_column_int64(stmt, 4);
+
+            MessageShard &shard = isChannel ? channelShard(target_id) : privateShard(sender_id, target_id);
+            const char *insert = isChannel
+                                     ? "INSERT OR IGNORE INTO channel_messages (sender_id, channel_id, message_text, sent_at, message_id) VALUES (?, ?, ?, ?, ?);"
+                                     : "INSERT OR IGNORE INTO private_messages (sender_id, recipient_id, message_text, sent_at, message_id) VALUES (?, ?, ?, ?, ?);";
+
+            std::lock_guard<std::mutex> lock(shard.writerMutex);
+            sqlite3_stmt *ins;
+            if (sqlite3_prepare_v2(shard.writer, insert, -1, &ins, nullptr) != SQLITE_OK)
+            {
+                sqlite3_finalize(stmt);
+                pool.releaseConnection(db);
+                throw std::runtime_error("Failed to migrate messages: " + std::string(sqlite3_errmsg(shard.writer)));
+            }
+
+            sqlite3_bind_int(ins, 1, sender_id);
+            sqlite3_bind_int(ins, 2, target_id);
+            sqlite3_bind_text(ins, 3, text ? text : "", -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(ins, 4, sent_at);
+            sqlite3_bind_int64(ins, 5, message_id);
+
+            int result = sqlite3_step(ins);
+            int inserted = sqlite3_changes(shard.writer);
+            sqlite3_finalize(ins);
+            if (result != SQLITE_DONE)
+            {
+                sqlite3_finalize(stmt);
+                pool.releaseConnection(db);
+                throw std::runtime_error("Failed to migrate messages: " + std::string(sqlite3_errmsg(shard.writer)));
+            }
+            moved += inserted;
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    for (auto &shard : shards)
+    {
+        if (!exec(shard->writer, "COMMIT;"))
+        {
+            pool.releaseConnection(db);
+            throw std::runtime_error("Failed to migrate messages into " + shard->path);
+        }
+    }
+
+    if (moved > 0)
+    {
+        std::cout << "Moved " << moved << " messages into " << shards.size() << " shards" << std::endl;
+    }
+
+    exec(db, cleanup);
+    pool.releaseConnection(db);
+}
+
 bool Database::insertClient(const std::string &username, const std::string &password, int &client_id)
 {
     sqlite3 *db = pool.acquireConnection();
@@ -133,6 +359,121 @@ bool Database::getClientByUsername(const std::string &username, int &clientId)
     return true;
 }
 
+bool Database::getClientById(int clientId, std::string &username, std::string &password, std::string &nickname)
+{
+    sqlite3 *db = pool.acquireConnection();
+    const char *sql = "SELECT username, password, nickname FROM clients WHERE client_id = ?;";
+    sqlite3_stmt *stmt;
+
+    int result = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    if (result != SQLITE_OK)
+    {
+        std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
+        pool.releaseConnection(db);
+        return false;
+    }
+
+    // Bind the client_id to the statement
+    sqlite3_bind_int(stmt, 1, clientId);
+
+    // Execute the statement
+    result = sqlite3_step(stmt);
+    if (result != SQLITE_ROW)
+    {
+        std::cerr << "Execution failed or no client found with id: " << clientId << std::endl;
+        sqlite3_finalize(stmt);
+        pool.releaseConnection(db);
+        return false;
+    }
+
+    username = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+    password = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+
+    const char *nicknamePtr = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+    nickname = nicknamePtr ? nicknamePtr : "";
+
+    // Finalize the statement to release resources
+    sqlite3_finalize(stmt);
+    pool.releaseConnection(db);
+    return true;
+}
+
+bool Database::getAllClients(std::vector<std::tuple<int, std::string, std::string>> &clients)
+{
+    clients.clear();
+
+    sqlite3 *db = pool.acquireConnection();
+    const char *sql = "SELECT client_id, username, nickname FROM clients;";
+    sqlite3_stmt *stmt;
+
+    int result = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    if (result != SQLITE_OK)
+    {
+        std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
+        pool.releaseConnection(db);
+        return false;
+    }
+
+    // Execute the query and collect the clients
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        int clientId = sqlite3_column_int(stmt, 0);
+        const char *username = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+        const char *nickname = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+
+        clients.push_back(std::make_tuple(clientId, username ? username : "", nickname ? nickname : ""));
+    }
+
+    if (result != SQLITE_DONE)
+    {
+        std::cerr << "Execution failed: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_finalize(stmt);
+        pool.releaseConnection(db);
+        return false;
+    }
+
+    // Finalize the statement to release resources
+    sqlite3_finalize(stmt);
+    pool.releaseConnection(db);
+    return true;
+}
+
+bool Database::updateNickname(int clientId, const std::string &nickname)
+{
+    sqlite3 *db = pool.acquireConnection();
+    const char *sql = "UPDATE clients SET nickname = ? WHERE client_id = ?;";
+    sqlite3_stmt *stmt;
+
+    int result = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    if (result != SQLITE_OK)
+    {
+        std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
+        pool.releaseConnection(db);
+        return false;
+    }
+
+    // Bind the nickname and client_id to the statement
+    sqlite3_bind_text(stmt, 1, nickname.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, clientId);
+
+    // Execute the statement
+    result = sqlite3_step(stmt);
+    if (result != SQLITE_DONE)
+    {
+        std::cerr << "Execution failed: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_finalize(stmt);
+        pool.releaseConnection(db);
+        return false;
+    }
+
+    bool updated = sqlite3_changes(db) > 0;
+
+    // Finalize the statement to release resources
+    sqlite3_finalize(stmt);
+    pool.releaseConnection(db);
+    return updated;
+}
+
 bool Database::insertChannel(const std::string &channelName, const std::string &description, int ownerId, const std::string &key)
 {
     sqlite3 *db = pool.acquireConnection();
@@ -315,10 +656,76 @@ bool Database::addMemberToChannel(int channel_id, int client_id, const std::stri
     return true;
 }
 
+// Shard writers joined by the batch of this thread, each inside an open transaction
+struct BatchWrites
+{
+    bool active = false;
+    std::unique_lock<std::mutex> batchLock;
+    std::vector<std::pair<MessageShard *, std::unique_lock<std::mutex>>> shards;
+};
+static thread_local BatchWrites batchWrites;
+
+void Database::beginBatch()
+{
+    batchWrites.batchLock = std::unique_lock<std::mutex>(batchMutex);
+    batchWrites.active = true;
+}
+
+bool Database::endBatch()
+{
+    bool ok = true;
+    for (auto &[shard, lock] : batchWrites.shards)
+    {
+        if (!exec(shard->writer, "COMMIT;"))
+        {
+            // A failed COMMIT may have rolled back already
+            if (!sqlite3_get_autocommit(shard->writer))
+            {
+                exec(shard->writer, "ROLLBACK;");
+            }
+            ok = false;
+        }
+    }
+
+    batchWrites.shards.clear();
+    batchWrites.active = false;
+    batchWrites.batchLock = std::unique_lock<std::mutex>();
+    return ok;
+}
+
+std::unique_lock<std::mutex> Database::lockWriter(MessageShard &shard)
+{
+    std::unique_lock<std::mutex> lock(shard.writerMutex, std::defer_lock);
+    if (!batchWrites.active)
+    {
+        lock.lock();
+        return lock;
+    }
+
+    for (const auto &joined : batchWrites.shards)
+    {
+        if (joined.first == &shard)
+        {
+            return lock;
+        }
+    }
+
+    // First write of the batch to this shard opens its transaction, a failed BEGIN leaves it autocommit
+    lock.lock();
+    if (!exec(shard.writer, "BEGIN;"))
+    {
+        return lock;
+    }
+    batchWrites.shards.emplace_back(&shard, std::move(lock));
+    return std::unique_lock<std::mutex>();
+}
+
 bool Database::insertChannelMessage(int sender_id, int channel_id, const std::string &message_text)
 {
-    sqlite3 *db = pool.acquireConnection();
-    const char *sql = "INSERT INTO channel_messages (sender_id, channel_id, message_text) VALUES (?, ?, ?);";
+    MessageShard &shard = channelShard(channel_id);
+    std::unique_lock<std::mutex> lock = lockWriter(shard);
+    sqlite3 *db = shard.writer;
+    const char *sql = "INSERT INTO channel_messages (sender_id, channel_id, message_text, sent_at) VALUES (?, ?, ?, ?);";
     sqlite3_stmt *stmt;
 
     // Prepare the SQL statement
@@ -326,7 +733,6 @@ bool Database::insertChannelMessage(int sender_id, int channel_id, const std::st
     if (result != SQLITE_OK)
     {
         std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
-        pool.releaseConnection(db);
         return false;
     }
 
@@ -334,6 +740,7 @@ bool Database::insertChannelMessage(int sender_id, int channel_id, const std::st
     sqlite3_bind_int(stmt, 1, sender_id);                                // Bind sender_id
     sqlite3_bind_int(stmt, 2, channel_id);                               // Bind channel_id
     sqlite3_bind_text(stmt, 3, message_text.c_str(), -1, SQLITE_STATIC); // Bind message_text
+    sqlite3_bind_int64(stmt, 4, ClockService::instance().nowMs());       // Bind sent_at
 
     // Execute the statement
     result = sqlite3_step(stmt);
@@ -341,20 +748,20 @@ bool Database::insertChannelMessage(int sender_id, int channel_id, const std::st
     {
         std::cerr << "Execution failed: " << sqlite3_errmsg(db) << std::endl;
         sqlite3_finalize(stmt);
-        pool.releaseConnection(db);
         return false;
     }
 
     // Finalize the statement to release resources
     sqlite3_finalize(stmt);
-    pool.releaseConnection(db);
     return true;
 }
 
 bool Database::insertPrivateMessage(int sender_id, int recipient_id, const std::string &message_text)
 {
-    sqlite3 *db = pool.acquireConnection();
-    const char *sql = "INSERT INTO private_messages (sender_id, recipient_id, message_text) VALUES (?, ?, ?);";
+    MessageShard &shard = privateShard(sender_id, recipient_id);
+    std::unique_lock<std::mutex> lock = lockWriter(shard);
+    sqlite3 *db = shard.writer;
+    const char *sql = "INSERT INTO private_messages (sender_id, recipient_id, message_text, sent_at) VALUES (?, ?, ?, ?);";
     sqlite3_stmt *stmt;
 
     // Prepare the SQL statement
@@ -362,7 +769,6 @@ bool Database::insertPrivateMessage(int sender_id, int recipient_id, const std::
     if (result != SQLITE_OK)
     {
         std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
-        pool.releaseConnection(db);
         return false;
     }
 
@@ -370,6 +776,7 @@ bool Database::insertPrivateMessage(int sender_id, int recipient_id, const std::
     sqlite3_bind_int(stmt, 1, sender_id);                                // Bind sender_id
     sqlite3_bind_int(stmt, 2, recipient_id);                             // Bind recipient_id
     sqlite3_bind_text(stmt, 3, message_text.c_str(), -1, SQLITE_STATIC); // Bind message_text
+    sqlite3_bind_int64(stmt, 4, ClockService::instance().nowMs());       // Bind sent_at
 
     // Execute the statement
     result = sqlite3_step(stmt);
@@ -377,29 +784,18 @@ bool Database::insertPrivateMessage(int sender_id, int recipient_id, const std::
     {
         std::cerr << "Execution failed: " << sqlite3_errmsg(db) << std::endl;
         sqlite3_finalize(stmt);
-        pool.releaseConnection(db);
         return false;
     }
 
     // Finalize the statement to release resources
     sqlite3_finalize(stmt);
-    pool.releaseConnection(db);
     return true;
 }
 
-bool Database::getChannelMessagesPaginated(int channel_id, int page, std::vector<std::tuple<std::string, std::string, std::string>> &messages)
+// Reads the part of a history page held by one partition. offset is reduced by the
+// rows of the partition that come before the page
+static bool readPage(sqlite3 *db, const char *sql, const char *countSql, int id_a, int id_b, int &offset, MessageRows &messages)
 {
-    messages.clear();
-    int offset = page * PAGE_SZ;
-
-    sqlite3 *db = pool.acquireConnection();
-    const char *sql = "SELECT c.username, cm.message_text, cm.sent_at "
-                      "FROM channel_messages cm "
-                      "JOIN clients c ON cm.sender_id = c.client_id "
-                      "WHERE cm.channel_id = ? "
-                      "ORDER BY cm.sent_at DESC "
-                      "LIMIT ? OFFSET ?;";
-
     sqlite3_stmt *stmt;
 
     // Prepare the SQL statement
@@ -407,39 +803,98 @@ bool Database::getChannelMessagesPaginated(int channel_id, int page, std::vector
     if (result != SQLITE_OK)
     {
         std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
-        pool.releaseConnection(db);
         return false;
     }
 
     // Bind the parameters
-    sqlite3_bind_int(stmt, 1, channel_id); // Bind channel_id
-    sqlite3_bind_int(stmt, 2, PAGE_SZ);    // Bind PAGE_SZ
-    sqlite3_bind_int(stmt, 3, offset);     // Bind offset (page * PAGE_SZ)
+    sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":a"), id_a);
+    sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":b"), id_b);
+    sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":limit"), PAGE_SZ - messages.size());
+    sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":offset"), offset);
 
     // Execute the statement
+    size_t before = messages.size();
     while (sqlite3_step(stmt) == SQLITE_ROW)
     {
-        const char *username = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+        int sender_id = sqlite3_column_int(stmt, 0);
         const char *message_text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-        const char *sent_at = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+        int64_t sent_at = sqlite3_column_int64(stmt, 2);
 
-        if (username && message_text && sent_at)
+        if (message_text)
         {
-            messages.push_back(std::make_tuple(username, message_text, sent_at));
+            messages.push_back(std::make_tuple(sender_id, message_text, sent_at));
         }
     }
+    sqlite3_finalize(stmt);
 
-    // Finalize the statement to release resources
+    // The page starts in this partition, the older ones continue it from their first row
+    if (messages.size() > before or offset == 0)
+    {
+        offset = 0;
+        return true;
+    }
+
+    // The page starts in an older partition, skip every row of this one
+    if (sqlite3_prepare_v2(db, countSql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+    sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":a"), id_a);
+    sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":b"), id_b);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        offset -= sqlite3_column_int(stmt, 0);
+    }
     sqlite3_finalize(stmt);
-    pool.releaseConnection(db);
-    return !messages.empty();
+    return true;
+}
+
+bool Database::getChannelMessagesPaginated(int channel_id, int page, MessageRows &messages)
+{
+    messages.clear();
+    int offset = page * PAGE_SZ;
+
+    const char *sql = "SELECT sender_id, message_text, sent_at "
+                      "FROM channel_messages "
+                      "WHERE channel_id = :a "
+                      "ORDER BY sent_at DESC, message_id DESC "
+                      "LIMIT :limit OFFSET :offset;";
+    const char *countSql = "SELECT COUNT(*) FROM channel_messages WHERE channel_id = :a;";
+
+    // Newest partition first, stop once the page is full
+    bool ok = true;
+    forEachPartition(channelShard(channel_id), [&](sqlite3 *db)
+                     {
+                         ok = readPage(db, sql, countSql, channel_id, channel_id, offset, messages);
+                         return ok and messages.size() < PAGE_SZ; });
+
+    return ok and !messages.empty();
 }
 
 bool Database::getPrvMsgIds(int client_id, std::vector<int> &ids)
 {
     ids.clear();
+    std::set<int> found;
 
-    sqlite3 *db = pool.acquireConnection();
+    // Conversations of the client are spread over every shard and partition
+    for (auto &shard : shards)
+    {
+        bool ok = true;
+        forEachPartition(*shard, [&](sqlite3 *db)
+                         { return ok = getPrvMsgIds(db, client_id, found); });
+        if (!ok)
+        {
+            return false;
+        }
+    }
+
+    ids.assign(found.begin(), found.end());
+    return !ids.empty();
+}
+
+bool Database::getPrvMsgIds(sqlite3 *db, int client_id, std::set<int> &ids)
+{
     const char *sql = "SELECT DISTINCT sender_id "
                       "FROM private_messages "
                       "WHERE recipient_id = ? "
@@ -455,7 +910,6 @@ bool Database::getPrvMsgIds(int client_id, std::vector<int> &ids)
     if (result != SQLITE_OK)
     {
         std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
-        pool.releaseConnection(db);
         return false;
     }
 
@@ -467,28 +921,364 @@ bool Database::getPrvMsgIds(int client_id, std::vector<int> &ids)
     while (sqlite3_step(stmt) == SQLITE_ROW)
     {
         int id = sqlite3_column_int(stmt, 0);
-        ids.push_back(id);
+        ids.insert(id);
     }
 
     // Finalize the statement to release resources
     sqlite3_finalize(stmt);
-    pool.releaseConnection(db);
-    return !ids.empty();
+    return true;
 }
 
-bool Database::getPrivateMessagesPaginated(int id_a, int id_b, int page, std::vector<std::tuple<std::string, std::string, std::string>> &messages)
+bool Database::getPrivateMessagesPaginated(int id_a, int id_b, int page, MessageRows &messages)
 {
     messages.clear();
     int offset = page * PAGE_SZ;
 
-    sqlite3 *db = pool.acquireConnection();
-    const char *sql = "SELECT c.username, pm.message_text, pm.sent_at "
-                      "FROM private_messages pm "
-                      "JOIN clients c ON pm.sender_id = c.client_id "
-                      "WHERE (pm.sender_id = ? AND pm.recipient_id = ?) "
-                      "   OR (pm.sender_id = ? AND pm.recipient_id = ?) "
-                      "ORDER BY pm.sent_at DESC "
-                      "LIMIT ? OFFSET ?;";
+    const char *sql = "SELECT sender_id, message_text, sent_at "
+                      "FROM private_messages "
+                      "WHERE (sender_id = :a AND recipient_id = :b) "
+                      "   OR (sender_id = :b AND recipient_id = :a) "
+                      "ORDER BY sent_at DESC, message_id DESC "
+                      "LIMIT :limit OFFSET :offset;";
+    const char *countSql = "SELECT COUNT(*) FROM private_messages "
+                           "WHERE (sender_id = :a AND recipient_id = :b) "
+                           "   OR (sender_id = :b AND recipient_id = :a);";
+
+    // Newest partition first, stop once the page is full
+    bool ok = true;
+    forEachPartition(privateShard(id_a, id_b), [&](sqlite3 *db)
+                     {
+                         ok = readPage(db, sql, countSql, id_a, id_b, offset, messages);
+                         return ok and messages.size() < PAGE_SZ; });
+
+    return ok and !messages.empty();
+}
+
+// chatapp.msg0.db -> chatapp.msg0.<YYYY-MM>.db
+static std::string archivePath(const std::string &shardPath, const std::string &month)
+{
+    return shardPath.substr(0, shardPath.size() - 3) + "." + month + ".db";
+}
+
+// YYYY-MM as a month count, for retention arithmetic
+static int monthIndex(const std::string &month)
+{
+    int year = 0, mon = 0;
+    sscanf(month.c_str(), "%d-%d", &year, &mon);
+    return year * 12 + mon - 1;
+}
+
+static int currentMonthIndex()
+{
+    std::time_t now = std::time(nullptr);
+    std::tm tm;
+    gmtime_r(&now, &tm);
+    return (tm.tm_year + 1900) * 12 + tm.tm_mon;
+}
+
+// Run one statement with a single text parameter
+static bool execWith(sqlite3 *db, const char *sql, const std::string &arg)
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+
+    sqlite3_bind_text(stmt, 1, arg.c_str(), -1, SQLITE_TRANSIENT);
+    int result = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (result != SQLITE_DONE)
+    {
+        std::cerr << "Execution failed: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::string> MessageShard::archiveList()
+{
+    std::shared_lock<std::shared_mutex> lock(archivesMutex);
+    return archives;
+}
+
+void Database::loadArchives(MessageShard &shard)
+{
+    namespace fs = std::filesystem;
+    fs::path dir = fs::path(shard.path).parent_path();
+    std::string prefix = fs::path(shard.path).stem().string() + ".";
+
+    std::vector<std::string> found;
+    for (const auto &entry : fs::directory_iterator(dir.empty() ? fs::path(".") : dir))
+    {
+        // <shard>.<YYYY-MM>.db
+        std::string name = entry.path().filename().string();
+        if (name.size() == prefix.size() + 10 and name.starts_with(prefix) and name.ends_with(".db"))
+        {
+            found.push_back(archivePath(shard.path, name.substr(prefix.size(), 7)));
+        }
+    }
+
+    for (const std::string &path : found)
+    {
+        sqlite3 *db;
+        if (sqlite3_open(path.c_str(), &db) != SQLITE_OK or !exec(db, convertTimestamps))
+        {
+            std::cerr << "Failed to open archive " << path << ": " << sqlite3_errmsg(db) << std::endl;
+        }
+        sqlite3_close(db);
+    }
+
+    // Newest first, history reads walk back in time
+    std::sort(found.rbegin(), found.rend());
+
+    std::unique_lock<std::shared_mutex> lock(shard.archivesMutex);
+    shard.archives = found;
+}
+
+void Database::forEachPartition(MessageShard &shard, const std::function<bool(sqlite3 *)> &fn)
+{
+    // Current partition, most reads end here
+    sqlite3 *db = shard.readers.acquireConnection();
+    bool more = fn(db);
+    shard.readers.releaseConnection(db);
+
+    // Archives are cold, they are opened on demand
+    for (const std::string &path : shard.archiveList())
+    {
+        if (!more)
+        {
+            break;
+        }
+
+        if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK)
+        {
+            // Removed by retention since the list was taken
+            sqlite3_close(db);
+            continue;
+        }
+        sqlite3_busy_timeout(db, 5000);
+        more = fn(db);
+        sqlite3_close(db);
+    }
+}
+
+bool Database::rollMonth(MessageShard &shard, const std::string &month)
+{
+    std::string path = archivePath(shard.path, month);
+
+    // Archives use a rollback journal so they can be read with read-only connections
+    sqlite3 *archive;
+    if (sqlite3_open(path.c_str(), &archive) != SQLITE_OK or !exec(archive, "PRAGMA journal_mode = DELETE;") or !exec(archive, messageSchema))
+    {
+        std::cerr << "Failed to open archive " << path << ": " << sqlite3_errmsg(archive) << std::endl;
+        sqlite3_close(archive);
+        return false;
+    }
+    sqlite3_close(archive);
+
+    // Rows keep their ids, so search cursors stay valid across the move
+    const char *moveChannel = "INSERT INTO archive.channel_messages SELECT * FROM main.channel_messages "
+                              "WHERE sent_at >= unixepoch(?1 || '-01') * 1000 AND sent_at < unixepoch(?1 || '-01', '+1 month') * 1000;";
+    const char *movePrivate = "INSERT INTO archive.private_messages SELECT * FROM main.private_messages "
+                              "WHERE sent_at >= unixepoch(?1 || '-01') * 1000 AND sent_at < unixepoch(?1 || '-01', '+1 month') * 1000;";
+    const char *deleteChannel = "DELETE FROM main.channel_messages "
+                                "WHERE sent_at >= unixepoch(?1 || '-01') * 1000 AND sent_at < unixepoch(?1 || '-01', '+1 month') * 1000;";
+    const char *deletePrivate = "DELETE FROM main.private_messages "
+                                "WHERE sent_at >= unixepoch(?1 || '-01') * 1000 AND sent_at < unixepoch(?1 || '-01', '+1 month') * 1000;";
+
+    sqlite3 *db = shard.writer;
+    if (!execWith(db, "ATTACH DATABASE ? AS archive;", path))
+    {
+        return false;
+    }
+
+    bool ok = exec(db, "BEGIN;") and
+              execWith(db, moveChannel, month) and execWith(db, movePrivate, month) and
+              execWith(db, deleteChannel, month) and execWith(db, deletePrivate, month);
+
+    if (ok)
+    {
+        // Listed before the commit, readers never miss the moved rows
+        std::unique_lock<std::shared_mutex> lock(shard.archivesMutex);
+        if (std::find(shard.archives.begin(), shard.archives.end(), path) == shard.archives.end())
+        {
+            shard.archives.push_back(path);
+            std::sort(shard.archives.rbegin(), shard.archives.rend());
+        }
+        ok = exec(db, "COMMIT;");
+    }
+
+    if (!ok)
+    {
+        exec(db, "ROLLBACK;");
+    }
+    exec(db, "DETACH DATABASE archive;");
+    return ok;
+}
+
+bool Database::compactArchive(const std::string &path)
+{
+    sqlite3 *db;
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK)
+    {
+        std::cerr << "Failed to open archive " << path << ": " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_close(db);
+        return false;
+    }
+    sqlite3_busy_timeout(db, 5000);
+
+    // Compacted archives are marked with user_version 1
+    sqlite3_stmt *stmt;
+    int version = 0;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, nullptr) == SQLITE_OK)
+    {
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            version = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    bool ok = true;
+    if (version == 0)
+    {
+        // Merge the index segments and drop the free pages left by the move
+        ok = exec(db, "INSERT INTO channel_messages_fts (channel_messages_fts) VALUES ('optimize');") and
+             exec(db, "INSERT INTO private_messages_fts (private_messages_fts) VALUES ('optimize');") and
+             exec(db, "VACUUM;") and
+             exec(db, "PRAGMA user_version = 1;");
+    }
+
+    sqlite3_close(db);
+    return ok;
+}
+
+bool Database::maintainArchive(int retentionMonths)
+{
+    bool ok = true;
+    int current = currentMonthIndex();
+
+    for (auto &shard : shards)
+    {
+        // Roll every past month out of the current partition
+        std::vector<std::string> months;
+        {
+            std::lock_guard<std::mutex> lock(shard->writerMutex);
+            sqlite3_stmt *stmt;
+            const char *sql = "SELECT strftime('%Y-%m', sent_at / 1000, 'unixepoch') FROM channel_messages "
+                              "WHERE sent_at < unixepoch('now', 'start of month') * 1000 "
+                              "UNION "
+                              "SELECT strftime('%Y-%m', sent_at / 1000, 'unixepoch') FROM private_messages "
+                              "WHERE sent_at < unixepoch('now', 'start of month') * 1000;";
+
+            if (sqlite3_prepare_v2(shard->writer, sql, -1, &stmt, nullptr) != SQLITE_OK)
+            {
+                std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(shard->writer) << std::endl;
+                return false;
+            }
+            while (sqlite3_step(stmt) == SQLITE_ROW)
+            {
+                const char *month = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+                if (month)
+                {
+                    months.push_back(month);
+                }
+            }
+            sqlite3_finalize(stmt);
+
+            for (const std::string &month : months)
+            {
+                if (rollMonth(*shard, month))
+                {
+                    std::cout << "Archived " << month << " of " << shard->path << std::endl;
+                }
+                else
+                {
+                    ok = false;
+                }
+            }
+        }
+
+        // Drop archives past the retention window
+        std::vector<std::string> expired;
+        if (retentionMonths > 0)
+        {
+            std::unique_lock<std::shared_mutex> lock(shard->archivesMutex);
+            auto keep = std::remove_if(shard->archives.begin(), shard->archives.end(), [&](const std::string &path)
+                                       { return monthIndex(path.substr(path.size() - 10, 7)) < current - retentionMonths; });
+            expired.assign(keep, shard->archives.end());
+            shard->archives.erase(keep, shard->archives.end());
+        }
+
+        for (const std::string &path : expired)
+        {
+            std::filesystem::remove(path);
+            std::filesystem::remove(path + "-journal");
+            std::cout << "Removed expired archive " << path << std::endl;
+        }
+
+        // Compact the archives that have not been compacted yet
+        for (const std::string &path : shard->archiveList())
+        {
+            ok = compactArchive(path) and ok;
+        }
+    }
+    return ok;
+}
+
+// Quote every word so user input is never parsed as FTS5 query syntax
+static std::string ftsQuery(const std::string &query)
+{
+    std::istringstream stream(query);
+    std::string word, out;
+
+    while (stream >> word)
+    {
+        std::string quoted = "\"";
+        for (char c : word)
+        {
+            quoted += c;
+            if (c == '"')
+            {
+                quoted += '"';
+            }
+        }
+        quoted += "\"";
+
+        out += out.empty() ? quoted : " " + quoted;
+    }
+    return out;
+}
+
+// Sort key of a search hit: (sent_at, shard, kind, message_id), newest first
+// Stable across shards and partitions, a bm25 rank is only comparable within one FTS index
+using SearchKey = std::tuple<int64_t, int, int, int>;
+
+bool Database::searchPartition(sqlite3 *db, int shard_idx, int client_id, const std::string &channels, const std::string &match, const SearchKey &after, int limit, std::vector<std::pair<SearchKey, SearchResult>> &hits)
+{
+    const char *sql = R"(
+        SELECT sent_at, kind, id, target, sender_id, message_text FROM (
+            SELECT 0 AS kind, m.message_id AS id, m.channel_id AS target,
+                   m.sender_id, m.message_text, m.sent_at
+            FROM channel_messages_fts f
+            JOIN channel_messages m ON m.message_id = f.rowid
+            WHERE channel_messages_fts MATCH ?1
+              AND m.channel_id IN (SELECT value FROM json_each(?2))
+            UNION ALL
+            SELECT 1, m.message_id,
+                   CASE WHEN m.sender_id = ?3 THEN m.recipient_id ELSE m.sender_id END,
+                   m.sender_id, m.message_text, m.sent_at
+            FROM private_messages_fts f
+            JOIN private_messages m ON m.message_id = f.rowid
+            WHERE private_messages_fts MATCH ?1
+              AND (m.sender_id = ?3 OR m.recipient_id = ?3)
+        )
+        WHERE (sent_at, ?4, kind, id) < (?5, ?6, ?7, ?8)
+        ORDER BY sent_at DESC, kind DESC, id DESC
+        LIMIT ?9;
+    )";
 
     sqlite3_stmt *stmt;
 
@@ -497,47 +1287,178 @@ bool Database::getPrivateMessagesPaginated(int id_a, int id_b, int page, std::ve
     if (result != SQLITE_OK)
     {
         std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
-        pool.releaseConnection(db);
-        return false; // Return false on failure
+        return false;
     }
 
     // Bind the parameters
-    sqlite3_bind_int(stmt, 1, id_a);    // Bind sender_id for the first condition
-    sqlite3_bind_int(stmt, 2, id_b);    // Bind recipient_id for the first condition
-    sqlite3_bind_int(stmt, 3, id_b);    // Bind sender_id for the second condition
-    sqlite3_bind_int(stmt, 4, id_a);    // Bind recipient_id for the second condition
-    sqlite3_bind_int(stmt, 5, PAGE_SZ); // Bind PAGE_SZ
-    sqlite3_bind_int(stmt, 6, offset);  // Bind offset (page * PAGE_SZ)
+    sqlite3_bind_text(stmt, 1, match.c_str(), -1, SQLITE_STATIC);    // Bind FTS query
+    sqlite3_bind_text(stmt, 2, channels.c_str(), -1, SQLITE_STATIC); // Bind channels of the client
+    sqlite3_bind_int(stmt, 3, client_id);                            // Bind client_id
+    sqlite3_bind_int(stmt, 4, shard_idx);                            // Bind shard of the rows
+    sqlite3_bind_int64(stmt, 5, std::get<0>(after));                 // Bind cursor
+    sqlite3_bind_int(stmt, 6, std::get<1>(after));
+    sqlite3_bind_int(stmt, 7, std::get<2>(after));
+    sqlite3_bind_int(stmt, 8, std::get<3>(after));
+    sqlite3_bind_int(stmt, 9, limit);
 
     // Execute the statement
-    while (sqlite3_step(stmt) == SQLITE_ROW)
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
     {
-        const char *username = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-        const char *message_text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-        const char *sent_at = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+        SearchKey key(sqlite3_column_int64(stmt, 0), shard_idx, sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2));
 
-        if (username && message_text && sent_at)
-        {
-            messages.push_back(std::make_tuple(username, message_text, sent_at));
-        }
+        const char *text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 5));
+        hits.push_back(std::make_pair(key, SearchResult{std::get<2>(key) == 0, sqlite3_column_int(stmt, 3), sqlite3_column_int(stmt, 4),
+                                                        text ? text : "", std::get<0>(key)}));
+    }
+
+    if (result != SQLITE_DONE)
+    {
+        std::cerr << "Execution failed: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_finalize(stmt);
+        return false;
     }
 
     // Finalize the statement to release resources
     sqlite3_finalize(stmt);
+    return true;
+}
+
+bool Database::searchMessages(int client_id, const std::vector<int> &channel_ids, const std::string &query, const std::string &cursor, int limit, std::vector<SearchResult> &results, std::string &nextCursor)
+{
+    results.clear();
+    nextCursor.clear();
+
+    std::string match = ftsQuery(query);
+    if (match.empty())
+    {
+        return false;
+    }
+
+    // Cursor is the key of the last hit of the previous page
+    SearchKey after(std::numeric_limits<int64_t>::max(), std::numeric_limits<int>::max(), 0, 0);
+    if (!cursor.empty() and sscanf(cursor.c_str(), "%" SCNd64 ":%d:%d:%d", &std::get<0>(after), &std::get<1>(after), &std::get<2>(after), &std::get<3>(after)) != 4)
+    {
+        return false;
+    }
+
+    std::string channels = "[";
+    for (size_t i = 0; i < channel_ids.size(); ++i)
+    {
+        channels += (i ? "," : "") + std::to_string(channel_ids[i]);
+    }
+    channels += "]";
+
+    // Newest hits of every shard and partition, merged by their keys
+    std::vector<std::pair<SearchKey, SearchResult>> hits;
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        bool ok = true;
+        forEachPartition(*shards[i], [&](sqlite3 *db)
+                         {
+                             // One extra row tells if there is a next page
+                             ok = searchPartition(db, i, client_id, channels, match, after, limit + 1, hits);
+                             return ok; });
+        if (!ok)
+        {
+            return false;
+        }
+    }
+
+    std::sort(hits.begin(), hits.end(), [](const auto &a, const auto &b)
+              { return b.first < a.first; });
+
+    for (size_t i = 0; i < hits.size() and i < static_cast<size_t>(limit); ++i)
+    {
+        results.push_back(hits[i].second);
+    }
+
+    if (hits.size() > static_cast<size_t>(limit))
+    {
+        const SearchKey &last = hits[limit - 1].first;
+        char buf[80];
+        snprintf(buf, sizeof(buf), "%" PRId64 ":%d:%d:%d", std::get<0>(last), std::get<1>(last), std::get<2>(last), std::get<3>(last));
+        nextCursor = buf;
+    }
+    return true;
+}
+
+void Database::initFiles()
+{
+    sqlite3 *db = pool.acquireConnection();
+
+    // Content addressed blobs, files rows point at them by hash
+    const char *sql = R"(
+        CREATE TABLE IF NOT EXISTS blobs (
+            hash TEXT PRIMARY KEY,
+            size INTEGER NOT NULL,
+            refcount INTEGER NOT NULL
+        ) WITHOUT ROWID;
+    )";
+
+    bool ok = exec(db, sql);
+
+    // Files stored before the blob store have no hash
+    sqlite3_stmt *stmt;
+    bool hasColumn = false;
+    if (ok and sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('files') WHERE name = 'hash';", -1, &stmt, nullptr) == SQLITE_OK)
+    {
+        hasColumn = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+    }
+    if (ok and !hasColumn)
+    {
+        ok = exec(db, "ALTER TABLE files ADD COLUMN hash TEXT;");
+    }
+
     pool.releaseConnection(db);
-    return !messages.empty();
+    if (!ok)
+    {
+        throw std::runtime_error("Failed to initialise the file tables");
+    }
 }
 
-bool Database::insertFile(const std::string &filename, int senderId, int recipientId, int channelId, const std::string &uuid)
+bool Database::insertFile(const std::string &filename, int senderId, int recipientId, int channelId, const std::string &uuid, const std::string &hash, uint64_t size)
 {
     sqlite3 *db = pool.acquireConnection();
-    const char *sql = "INSERT INTO files (filename, sender_id, recipient_id, channel_id, uuid) VALUES (?, ?, ?, ?, ?);";
+
+    // The file row and the blob reference are written together
+    if (!exec(db, "BEGIN;"))
+    {
+        pool.releaseConnection(db);
+        return false;
+    }
+
+    const char *blobSql = "INSERT INTO blobs (hash, size, refcount) VALUES (?, ?, 1) "
+                          "ON CONFLICT (hash) DO UPDATE SET refcount = refcount + 1;";
+    if (!hash.empty())
+    {
+        sqlite3_stmt *stmt;
+        int result = sqlite3_prepare_v2(db, blobSql, -1, &stmt, nullptr);
+        if (result == SQLITE_OK)
+        {
+            sqlite3_bind_text(stmt, 1, hash.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 2, size);
+            result = sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+        }
+
+        if (result != SQLITE_DONE)
+        {
+            std::cerr << "Execution failed: " << sqlite3_errmsg(db) << std::endl;
+            exec(db, "ROLLBACK;");
+            pool.releaseConnection(db);
+            return false;
+        }
+    }
+
+    const char *sql = "INSERT INTO files (filename, sender_id, recipient_id, channel_id, uuid, hash) VALUES (?, ?, ?, ?, ?, ?);";
     sqlite3_stmt *stmt;
 
     int result = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
     if (result != SQLITE_OK)
     {
         std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
+        exec(db, "ROLLBACK;");
         pool.releaseConnection(db);
         return false;
     }
@@ -563,12 +1484,21 @@ bool Database::insertFile(const std::string &filename, int senderId, int recipie
     {
         std::cerr << "Both recipient_id and channel_id cannot be zero" << std::endl;
         sqlite3_finalize(stmt);
+        exec(db, "ROLLBACK;");
         pool.releaseConnection(db);
         return false;
     }
 
-    // Bind the uuid to the statement
+    // Bind the uuid and the content hash to the statement
     sqlite3_bind_text(stmt, 5, uuid.c_str(), -1, SQLITE_STATIC);
+    if (hash.empty())
+    {
+        sqlite3_bind_null(stmt, 6);
+    }
+    else
+    {
+        sqlite3_bind_text(stmt, 6, hash.c_str(), -1, SQLITE_STATIC);
+    }
 
     // Execute the statement
     result = sqlite3_step(stmt);
@@ -576,20 +1506,28 @@ bool Database::insertFile(const std::string &filename, int senderId, int recipie
     {
         std::cerr << "Execution failed: " << sqlite3_errmsg(db) << std::endl;
         sqlite3_finalize(stmt);
+        exec(db, "ROLLBACK;");
         pool.releaseConnection(db);
         return false;
     }
 
     // Finalize the statement to release resources
     sqlite3_finalize(stmt);
+    bool ok = exec(db, "COMMIT;");
     pool.releaseConnection(db);
-    return true;
+    return ok;
 }
 
 bool Database::getFileByUUID(const std::string &uuid, std::string &filename, int &recipientId, int &channelId)
+{
+    std::string hash;
+    return getFileByUUID(uuid, filename, recipientId, channelId, hash);
+}
+
+bool Database::getFileByUUID(const std::string &uuid, std::string &filename, int &recipientId, int &channelId, std::string &hash)
 {
     sqlite3 *db = pool.acquireConnection();
-    const char *sql = "SELECT filename, recipient_id, channel_id FROM files WHERE uuid = ?;";
+    const char *sql = "SELECT filename, recipient_id, channel_id, hash FROM files WHERE uuid = ?;";
     sqlite3_stmt *stmt;
 
     int result = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
@@ -617,8 +1555,97 @@ bool Database::getFileByUUID(const std::string &uuid, std::string &filename, int
     recipientId = sqlite3_column_int(stmt, 1);
     channelId = sqlite3_column_int(stmt, 2);
 
+    // Empty for files stored before the blob store
+    const char *digest = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
+    hash = digest ? digest : "";
+
     // Finalize the statement to release resources
     sqlite3_finalize(stmt);
     pool.releaseConnection(db);
     return true;
 }
+
+bool Database::deleteFile(const std::string &uuid, std::string &hash, bool &unreferenced)
+{
+    sqlite3 *db = pool.acquireConnection();
+    unreferenced = false;
+
+    // The row and its blob reference go together
+    if (!exec(db, "BEGIN;"))
+    {
+        pool.releaseConnection(db);
+        return false;
+    }
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT hash FROM files WHERE uuid = ?;", -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
+        exec(db, "ROLLBACK;");
+        pool.releaseConnection(db);
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, uuid.c_str(), -1, SQLITE_STATIC);
+    bool found = sqlite3_step(stmt) == SQLITE_ROW;
+    const char *digest = found ? reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)) : nullptr;
+    hash = digest ? digest : "";
+    sqlite3_finalize(stmt);
+
+    bool ok = found and execWith(db, "DELETE FROM files WHERE uuid = ?;", uuid);
+
+    // Files stored before the blob store have a file of their own
+    if (ok and hash.empty())
+    {
+        unreferenced = true;
+    }
+    else if (ok)
+    {
+        ok = execWith(db, "UPDATE blobs SET refcount = refcount - 1 WHERE hash = ?;", hash) and
+             execWith(db, "DELETE FROM blobs WHERE hash = ? AND refcount <= 0;", hash);
+        unreferenced = ok and sqlite3_changes(db) > 0;
+    }
+
+    if (!ok or !exec(db, "COMMIT;"))
+    {
+        exec(db, "ROLLBACK;");
+        unreferenced = false;
+        ok = false;
+    }
+    pool.releaseConnection(db);
+    return ok;
+}
+
+bool Database::getExpiredFiles(int retentionMonths, std::vector<std::pair<std::string, std::string>> &files)
+{
+    files.clear();
+    sqlite3 *db = pool.acquireConnection();
+
+    // The same window as the message archives, sent_at is CURRENT_TIMESTAMP text in UTC
+    const char *sql = "SELECT uuid, hash FROM files WHERE sent_at < datetime('now', 'start of month', ?);";
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
+        pool.releaseConnection(db);
+        return false;
+    }
+
+    std::string window = "-" + std::to_string(retentionMonths) + " months";
+    sqlite3_bind_text(stmt, 1, window.c_str(), -1, SQLITE_STATIC);
+
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        const char *uuid = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+        const char *hash = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+        files.push_back(std::make_pair(uuid ? uuid : "", hash ? hash : ""));
+    }
+    if (result != SQLITE_DONE)
+    {
+        std::cerr << "Execution failed: " << sqlite3_errmsg(db) << std::endl;
+    }
+
+    sqlite3_finalize(stmt);
+    pool.releaseConnection(db);
+    return result == SQLITE_DONE;
+}
@@ -4,23 +4,91 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <tuple>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <functional>
 #include "db_pool.hpp"
 
 #define PAGE_SZ 10
+#define MSG_SHARDS 4
+#define RETENTION_MONTHS 0 // Archived months kept, 0 keeps every month
+
+// (sender_id, message, sent_at) rows, sent_at in epoch milliseconds
+using MessageRows = std::vector<std::tuple<int, std::string, int64_t>>;
+
+// One full-text search hit
+struct SearchResult
+{
+    bool inChannel;     // Channel message or private message
+    int targetId;       // channel_id, or the other party of a private message
+    int senderId;
+    std::string text;
+    int64_t sentAt; // Epoch milliseconds
+};
+
+// Message tables of one shard file
+struct MessageShard
+{
+    std::string path;
+    ConnectionPool readers; // Read connections
+    sqlite3 *writer;        // Single writer connection per shard
+    std::mutex writerMutex;
+
+    std::vector<std::string> archives; // Monthly archive files, newest first
+    std::shared_mutex archivesMutex;
+
+    MessageShard(const std::string &path, int poolSize);
+    ~MessageShard();
+
+    std::vector<std::string> archiveList();
+};
 
 class Database
 {
 private:
-    ConnectionPool pool;
+    ConnectionPool pool; // Central file: clients, channels and files
+    std::vector<std::unique_ptr<MessageShard>> shards;
+    std::mutex batchMutex; // One batch at a time, a batch holds several shard writers
+
+    // Writer lock of a shard, empty while a batch of this thread already holds the writer
+    std::unique_lock<std::mutex> lockWriter(MessageShard &shard);
+
+    // Shard placement by a stable hash of the channel or conversation
+    MessageShard &channelShard(int channel_id);
+    MessageShard &privateShard(int id_a, int id_b);
+
+    // Create the message tables, search index and triggers of a shard
+    void initShard(MessageShard &shard);
+
+    // Move messages left in the central file into their shards
+    void migrateMessages();
+
+    // Blob table and the hash column of files
+    void initFiles();
+
+    // Monthly partitions: the current one in the shard file, past months in archive files
+    void loadArchives(MessageShard &shard);
+    void forEachPartition(MessageShard &shard, const std::function<bool(sqlite3 *)> &fn);
+    bool rollMonth(MessageShard &shard, const std::string &month);
+    bool compactArchive(const std::string &path);
+
+    bool getPrvMsgIds(sqlite3 *db, int client_id, std::set<int> &ids);
+    bool searchPartition(sqlite3 *db, int shard_idx, int client_id, const std::string &channels, const std::string &match, const std::tuple<int64_t, int, int, int> &after, int limit, std::vector<std::pair<std::tuple<int64_t, int, int, int>, SearchResult>> &hits);
 
 public:
-    Database(const std::string &dbName, int poolSize);
+    Database(const std::string &dbName, int poolSize, int shardCount = MSG_SHARDS);
     ~Database();
 
     // Client functions
     bool insertClient(const std::string &username, const std::string &password, int &client_id);
     bool getClientByUsername(const std::string &username, int &clientId, std::string &password, std::string &nickname);
     bool getClientByUsername(const std::string &username, int &clientId);
+    bool getClientById(int clientId, std::string &username, std::string &password, std::string &nickname);
+    bool getAllClients(std::vector<std::tuple<int, std::string, std::string>> &clients); // Without passwords
+    bool updateNickname(int clientId, const std::string &nickname);
 
     // Channel functions
     bool insertChannel(const std::string &channelName, const std::string &description, int ownerId, const std::string &key);
@@ -31,12 +99,29 @@ public:
     // Message functions
     bool insertChannelMessage(int sender_id, int channel_id, const std::string &message_text);
     bool insertPrivateMessage(int sender_id, int recipient_id, const std::string &message_text);
-    bool getChannelMessagesPaginated(int channel_id, int page, std::vector<std::tuple<std::string, std::string, std::string>>& messages);
-    bool getPrivateMessagesPaginated(int id_a, int id_b, int page, std::vector<std::tuple<std::string, std::string, std::string>>& messages);
+    bool getChannelMessagesPaginated(int channel_id, int page, MessageRows &messages);
+    bool getPrivateMessagesPaginated(int id_a, int id_b, int page, MessageRows &messages);
     bool getPrvMsgIds(int client_id, std::vector<int> &ids);
 
+    // Message writes of the calling thread share one transaction per shard until endBatch
+    void beginBatch();
+    bool endBatch();
+
+    // Archive functions, rolls past months out of the current partitions, drops expired ones and compacts the rest
+    bool maintainArchive(int retentionMonths);
+
+    // Search functions
+    bool searchMessages(int client_id, const std::vector<int> &channel_ids, const std::string &query, const std::string &cursor, int limit, std::vector<SearchResult> &results, std::string &nextCursor);
+
     // File functions
-    bool insertFile(const std::string &filename, int senderId, int recipientId, int channelId, const std::string &uuid);
+    bool insertFile(const std::string &filename, int senderId, int recipientId, int channelId, const std::string &uuid, const std::string &hash = "", uint64_t size = 0);
     bool getFileByUUID(const std::string &uuid, std::string &filename, int &recipientId, int &channelId);
+    bool getFileByUUID(const std::string &uuid, std::string &filename, int &recipientId, int &channelId, std::string &hash);
+
+    // Remove the row and give back its blob reference, unreferenced once no row uses the stored file
+    bool deleteFile(const std::string &uuid, std::string &hash, bool &unreferenced);
+
+    // (uuid, hash) of the files sent before the retention window
+    bool getExpiredFiles(int retentionMonths, std::vector<std::pair<std::string, std::string>> &files);
 
 };
@@ -0,0 +1,122 @@
+#include "db_executor.hpp"
+
+thread_local DbExecutor::Group *DbExecutor::opened = nullptr;
+thread_local std::vector<std::function<void()>> *DbExecutor::held = nullptr;
+
+DbExecutor::DbExecutor(int size, ThreadPool &completions)
+    : stop(false), completions(completions),
+      depth(Metrics::instance().gauge("db.queue_depth")),
+      depthHist(Metrics::instance().histogram("db.queue_depth_hist")),
+      waitHist(Metrics::instance().histogram("db.wait_us")),
+      runHist(Metrics::instance().histogram("db.run_us")),
+      rolledBack(Metrics::instance().counter("db.groups_rolled_back"))
+{
+    for (int i = 0; i < size; ++i)
+        threads.emplace_back(&DbExecutor::worker, this);
+}
+
+DbExecutor::~DbExecutor()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stop = true;
+    }
+    condition.notify_all();
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+void DbExecutor::enqueue(std::function<void()> run)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobs.push(Job{std::move(run), std::chrono::steady_clock::now()});
+        depth.set(jobs.size());
+        depthHist.record(jobs.size());
+    }
+    condition.notify_one();
+}
+
+void DbExecutor::schedule(std::function<void()> run)
+{
+    if (opened)
+    {
+        opened->jobs.push_back(std::move(run));
+        return;
+    }
+    enqueue(std::move(run));
+}
+
+void DbExecutor::complete(std::function<void()> done)
+{
+    if (held)
+    {
+        held->push_back(std::move(done));
+        return;
+    }
+    completions.enqueueTask(std::move(done));
+}
+
+void DbExecutor::open(Group &group)
+{
+    opened = &group;
+}
+
+void DbExecutor::close(Group &group)
+{
+    opened = nullptr;
+    if (group.jobs.empty())
+    {
+        return;
+    }
+
+    enqueue([this, begin = std::move(group.begin), end = std::move(group.end), jobs = std::move(group.jobs)]()
+            {
+                std::vector<std::function<void()>> completed;
+                held = &completed;
+                begin();
+                for (const std::function<void()> &job : jobs)
+                {
+                    job();
+                }
+                bool kept = end();
+                held = nullptr;
+                if (!kept)
+                {
+                    rolledBack.add();
+                }
+
+                for (std::function<void()> &done : completed)
+                {
+                    completions.enqueueTask(std::move(done));
+                }
+            });
+}
+
+void DbExecutor::worker()
+{
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]()
+                           { return stop || !jobs.empty(); });
+
+            if (stop && jobs.empty())
+                return;
+
+            job = std::move(jobs.front());
+            jobs.pop();
+            depth.set(jobs.size());
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        waitHist.record(std::chrono::duration_cast<std::chrono::microseconds>(start - job.enqueued).count());
+
+        job.run();
+
+        auto end = std::chrono::steady_clock::now();
+        runHist.record(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+    }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <functional>
+#include <future>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <type_traits>
+
+#include "threadpool.hpp"
+#include "metrics.hpp"
+#include "request_context.hpp"
+#include "batch.hpp"
+
+// Runs database jobs on dedicated threads so network workers never block on SQLite
+class DbExecutor
+{
+private:
+    struct Job
+    {
+        std::function<void()> run;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    std::vector<std::thread> threads; // Database worker threads
+    std::queue<Job> jobs;             // Pending jobs
+    std::mutex mutex;                 // Mutex for the job queue
+    std::condition_variable condition;
+    bool stop;
+
+    ThreadPool &completions; // Completion callbacks are handed back to this pool
+
+    // Exported metrics
+    Gauge &depth;
+    Histogram &depthHist;
+    Histogram &waitHist;
+    Histogram &runHist;
+    Counter &rolledBack;
+
+public:
+    // Queries submitted by a thread while its group is open are held back, then run in order
+    // as a single job between begin and end. Their completions are handed back after end,
+    // which reports whether the work of the group was kept. When it was not, end marks the
+    // requests of the group failed, their completions still run to answer them
+    struct Group
+    {
+        std::function<void()> begin;
+        std::function<bool()> end;
+        std::vector<std::function<void()>> jobs;
+    };
+
+private:
+    static thread_local Group *opened;                            // Group open on the submitting thread
+    static thread_local std::vector<std::function<void()>> *held; // Completions of the group run by this thread
+
+    void worker();
+    void enqueue(std::function<void()> run);
+    void schedule(std::function<void()> run);
+    void complete(std::function<void()> done);
+
+public:
+    DbExecutor(int size, ThreadPool &completions);
+    ~DbExecutor();
+
+    void open(Group &group);
+    void close(Group &group);
+
+    // Run a query, the result is delivered through a future
+    template <typename Query, typename R = std::invoke_result_t<Query>>
+    std::future<R> submit(Query query)
+    {
+        auto task = std::make_shared<std::packaged_task<R()>>(std::move(query));
+        std::future<R> result = task->get_future();
+        schedule([task]()
+                 { (*task)(); });
+        return result;
+    }
+
+    // Run a query, then run done(result) on the completion pool in the context of the submitting request
+    // A batch the request belongs to waits for done
+    template <typename Query, typename Done>
+    void submit(Query query, Done done)
+    {
+        RequestContext context = RequestContext::current();
+        if (context.batch)
+        {
+            context.batch->hold();
+        }
+        schedule([this, query, done, context]()
+                 {
+                     auto result = query();
+                     complete([done, result, context]()
+                              {
+                                  {
+                                      RequestScope scope(context);
+                                      done(result);
+                                  }
+                                  if (context.batch)
+                                  {
+                                      context.batch->release();
+                                  } }); });
+    }
+};
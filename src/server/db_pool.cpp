@@ -23,6 +23,8 @@ void ConnectionPool::initializePool()
         sqlite3 *conn;
         if (sqlite3_open(dbName.c_str(), &conn) == SQLITE_OK)
         {
+            // Wait for other connections instead of failing with SQLITE_BUSY
+            sqlite3_busy_timeout(conn, 5000);
             connections.push(conn);
         }
         else
@@ -0,0 +1,114 @@
+#include "file_cache.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(void *addr, size_t length) : addr(addr), length(length)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    munmap(addr, length);
+}
+
+FileCache::FileCache(size_t budget)
+    : budget(budget), resident(0),
+      hits(Metrics::instance().counter("files.cache_hits")),
+      misses(Metrics::instance().counter("files.cache_misses")),
+      hitRatio(Metrics::instance().gauge("files.cache_hit_ratio_pct")),
+      residentBytes(Metrics::instance().gauge("files.cache_resident_bytes"))
+{
+}
+
+std::shared_ptr<const MappedFile> FileCache::map(const std::string &path, size_t limit)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 or st.st_size == 0 or static_cast<size_t>(st.st_size) > limit)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    // The mapping outlives the descriptor
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    return std::make_shared<const MappedFile>(addr, st.st_size);
+}
+
+void FileCache::evict()
+{
+    while (resident > budget and !lru.empty())
+    {
+        resident -= lru.back().second->size();
+        index.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+std::shared_ptr<const MappedFile> FileCache::get(const std::string &path)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(path);
+        if (it != index.end())
+        {
+            lru.splice(lru.begin(), lru, it->second);
+            hits.add();
+            hitRatio.set(100 * hits.get() / (hits.get() + misses.get()));
+            return it->second->second;
+        }
+    }
+
+    misses.add();
+    hitRatio.set(100 * hits.get() / (hits.get() + misses.get()));
+
+    // Mapped outside the lock, hits on other files do not wait for the disk
+    std::shared_ptr<const MappedFile> file = map(path, budget / FILE_CACHE_ENTRY_DIV);
+    if (!file)
+    {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(path);
+    if (it != index.end())
+    {
+        // Mapped by a concurrent miss, share theirs
+        return it->second->second;
+    }
+
+    lru.emplace_front(path, file);
+    index[path] = lru.begin();
+    resident += file->size();
+    evict();
+    residentBytes.set(resident);
+    return file;
+}
+
+void FileCache::invalidate(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(path);
+    if (it == index.end())
+    {
+        return;
+    }
+
+    resident -= it->second->second->size();
+    lru.erase(it->second);
+    index.erase(it);
+    residentBytes.set(resident);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "metrics.hpp"
+
+#define FILE_CACHE_BYTES (64 * 1024 * 1024) // Resident budget of the download cache
+#define FILE_CACHE_ENTRY_DIV 8              // Files above budget / this are streamed from disk instead
+
+// Read only mapping of a whole file
+class MappedFile
+{
+private:
+    void *addr;
+    size_t length;
+
+public:
+    MappedFile(void *addr, size_t length);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const uint8_t *data() const { return static_cast<const uint8_t *>(addr); }
+    size_t size() const { return length; }
+};
+
+// LRU of mapped files with a byte budget, entries are shared by concurrent downloads
+class FileCache
+{
+private:
+    using Entry = std::pair<std::string, std::shared_ptr<const MappedFile>>;
+
+    size_t budget;
+    size_t resident;
+    std::list<Entry> lru; // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::mutex mutex;
+
+    // Exported metrics
+    Counter &hits;
+    Counter &misses;
+    Gauge &hitRatio;
+    Gauge &residentBytes;
+
+    static std::shared_ptr<const MappedFile> map(const std::string &path, size_t limit);
+    void evict();
+
+public:
+    explicit FileCache(size_t budget);
+
+    // Mapping of the file, nullptr when it is missing, empty or too large to cache
+    std::shared_ptr<const MappedFile> get(const std::string &path);
+
+    // Drop the file, downloads still holding it keep their mapping
+    void invalidate(const std::string &path);
+};
@@ -0,0 +1,92 @@
+#include "file_io.hpp"
+
+#include <chrono>
+#include <map>
+#include <unistd.h>
+
+FileIo::FileIo(int size, ThreadPool &completions)
+    : stop(false), completions(completions),
+      depth(Metrics::instance().gauge("io.queue_depth")),
+      runHist(Metrics::instance().histogram("io.run_us")),
+      syncBatch(Metrics::instance().histogram("io.sync_batch"))
+{
+    for (int i = 0; i < size; ++i)
+        workers.push_back(std::make_unique<Worker>());
+    for (auto &worker : workers)
+        worker->thread = std::thread(&FileIo::work, this, std::ref(*worker));
+}
+
+FileIo::~FileIo()
+{
+    for (auto &worker : workers)
+    {
+        {
+            std::unique_lock<std::mutex> lock(worker->mutex);
+            stop = true;
+        }
+        worker->condition.notify_all();
+    }
+    for (auto &worker : workers)
+        worker->thread.join();
+}
+
+void FileIo::enqueue(const std::string &key, Task task)
+{
+    Worker &worker = *workers[std::hash<std::string>{}(key) % workers.size()];
+    {
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.tasks.push_back(std::move(task));
+        depth.add(1);
+    }
+    worker.condition.notify_one();
+}
+
+void FileIo::work(Worker &worker)
+{
+    while (true)
+    {
+        // Everything queued so far is one batch
+        std::vector<Task> batch;
+        {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.condition.wait(lock, [this, &worker]()
+                                  { return stop || !worker.tasks.empty(); });
+
+            if (stop && worker.tasks.empty())
+                return;
+
+            batch.swap(worker.tasks);
+        }
+        depth.add(-static_cast<int64_t>(batch.size()));
+
+        std::vector<Task *> synced;
+        for (Task &task : batch)
+        {
+            if (task.syncFd != -1)
+            {
+                synced.push_back(&task);
+                continue;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            task.run();
+            auto end = std::chrono::steady_clock::now();
+            runHist.record(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+        }
+
+        if (synced.empty())
+            continue;
+
+        // One fdatasync per file for the whole batch
+        std::map<int, bool> results;
+        for (Task *task : synced)
+        {
+            if (!results.count(task->syncFd))
+                results[task->syncFd] = fdatasync(task->syncFd) == 0;
+        }
+        syncBatch.record(results.size());
+
+        for (Task *task : synced)
+            task->synced(results[task->syncFd]);
+    }
+}
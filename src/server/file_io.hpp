@@ -0,0 +1,110 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "threadpool.hpp"
+#include "metrics.hpp"
+#include "file_cache.hpp"
+#include "request_context.hpp"
+
+#define FILE_IO_THREADS 2 // Dedicated file I/O threads
+
+// File opened for a download: the cached mapping, or a descriptor for sendfile
+struct FileSource
+{
+    std::shared_ptr<const MappedFile> region;
+    int fd = -1;
+    uint64_t size = 0;
+};
+
+// Runs file I/O on dedicated threads so chat workers never block on the disk
+// Jobs with the same key run in submission order on the same thread
+class FileIo
+{
+private:
+    struct Task
+    {
+        std::function<void()> run;
+        int syncFd = -1;                   // fdatasync before synced runs
+        std::function<void(bool)> synced; // Receives whether the sync succeeded
+    };
+
+    struct Worker
+    {
+        std::thread thread;
+        std::vector<Task> tasks;
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    bool stop;
+
+    ThreadPool &completions; // Completion callbacks are handed back to this pool
+
+    // Exported metrics
+    Gauge &depth;
+    Histogram &runHist;
+    Histogram &syncBatch;
+
+private:
+    void work(Worker &worker);
+    void enqueue(const std::string &key, Task task);
+
+public:
+    FileIo(int size, ThreadPool &completions);
+    ~FileIo();
+
+    // Run a job, nothing is handed back
+    template <typename Job>
+    void submit(const std::string &key, Job job)
+    {
+        Task task;
+        task.run = [job]()
+        { job(); };
+        enqueue(key, std::move(task));
+    }
+
+    // Run a job, then run done(result) on the completion pool in the context of the submitting request
+    template <typename Job, typename Done>
+    void submit(const std::string &key, Job job, Done done)
+    {
+        Task task;
+        RequestContext context = RequestContext::current();
+        task.run = [this, job, done, context]()
+        {
+            auto result = job();
+            completions.enqueueTask([done, result, context]()
+                                    {
+                                        RequestScope scope(context);
+                                        done(result); });
+        };
+        enqueue(key, std::move(task));
+    }
+
+    // fdatasync the file, then run job(synced) and done(result) as above
+    // Syncs queued on a thread together are issued once per file, after its other jobs
+    template <typename Job, typename Done>
+    void submitSynced(const std::string &key, int fd, Job job, Done done)
+    {
+        Task task;
+        task.syncFd = fd;
+        RequestContext context = RequestContext::current();
+        task.synced = [this, job, done, context](bool synced)
+        {
+            auto result = job(synced);
+            completions.enqueueTask([done, result, context]()
+                                    {
+                                        RequestScope scope(context);
+                                        done(result); });
+        };
+        enqueue(key, std::move(task));
+    }
+};
@@ -3,201 +3,465 @@
 #define ERROR "\033[31m[x]\033[0m "
 #define INFO "\033[34m[!]\033[0m "
 
-void Server::handleRequest(int client_sd, Message &msg)
-{
-    // Handle the request
-    switch (msg.getCommand())
-    {
-    case 0x10:
-        std::cout << INFO << "Login from " << client_sd << std::endl;
-        Server::login(client_sd, msg);
-        break;
-
-    case 0x11:
-        std::cout << ERROR << "Set new password NOT IMPLEMENTED" << std::endl;
-        break;
-
-    case 0x12:
-        std::cout << ERROR << "Change nickname NOT IMPLEMENTED" << std::endl;
-        break;
-
-    case 0x20:
-        std::cout << INFO << "List Channels " << client_sd << std::endl;
-        Server::listChannels(client_sd, msg);
-        break;
-
-    case 0x21:
-        std::cout << INFO << "List Users " << client_sd << std::endl;
-        Server::listOnlineUsers(client_sd, msg);
-        break;
-
-    case 0x22:
-        std::cout << INFO << "Get user messages " << client_sd << std::endl;
-        Server::getUserMsg(client_sd, msg);
-        break;
-
-    case 0x23:
-        std::cout << INFO << "Get channel messages " << client_sd << std::endl;
-        Server::getChannelMsg(client_sd, msg);
-        break;
-
-    case 0x30:
-        std::cout << INFO << "Channel message from " << client_sd << std::endl;
-        Server::channelMsg(client_sd, msg);
-        break;
-
-    case 0x31:
-        std::cout << INFO << "User message from " << client_sd << std::endl;
-        Server::userMsg(client_sd, msg);
-        break;
-
-    case 0x40:
-        std::cout << INFO << "Join Channel " << client_sd << std::endl;
-        Server::joinChannel(client_sd, msg);
-        break;
-
-    case 0x41:
-        std::cout << ERROR << "Change channel NOT IMPLEMENTED" << std::endl;
-        break;
-
-    case 0x42:
-        std::cout << ERROR << "Create channel NOT IMPLEMENTED" << std::endl;
-        break;
-
-    case 0x43:
-        std::cout << ERROR << "Change channel topic NOT IMPLEMENTED" << std::endl;
-        break;
-
-    case 0x44:
-        std::cout << ERROR << "Change channel key NOT IMPLEMENTED" << std::endl;
-        break;
-
-    case 0x50:
-        std::cout << ERROR << "Kick user NOT IMPLEMENTED" << std::endl;
-        break;
-
-    case 0x51:
-        std::cout << ERROR << "Ban user NOT IMPLEMENTED" << std::endl;
-        break;
-
-    case 0x60:
-        std::cout << INFO << "File upload " << client_sd << std::endl;
-        Server::upload(client_sd, msg);
-        break;
-
-    case 0x61:
-        std::cout << INFO << "File Download " << client_sd << std::endl;
-        Server::download(client_sd, msg);
-        break;
-
-    default:
-        std::cout << ERROR << "Unknown request code: " << msg.getCommand() << std::endl;
-        Server::invalidCommand(client_sd);
+// (username, message, sent_at) rows of a history page, sent_at in epoch milliseconds
+using History = std::vector<std::tuple<std::string, std::string, int64_t>>;
+
+// (target, username, message, sent_at) rows of a search page
+using SearchRows = std::vector<std::tuple<std::string, std::string, std::string, int64_t>>;
+
+// Compact body of a history page
+static HistoryPage historyPage(const std::string &target, const History &rows)
+{
+    HistoryPage page;
+    page.target = target;
+    page.messages.reserve(rows.size());
+    for (const auto &[sender, text, sentAt] : rows)
+    {
+        page.messages.push_back({sender, text, static_cast<uint64_t>(sentAt / 1000)});
     }
+    return page;
 }
 
-// !login <username> <password>
-void Server::login(int client_sd, Message &msg)
+// Compact body of a name list, or text arguments
+static void nameList(Message &response, std::vector<std::string> names, bool compact)
 {
-    Client *client = Server::getClient(client_sd);
-    std::vector<std::string> args = msg.getArgs();
-    std::string username, password, nickname;
+    if (compact)
+    {
+        response.setBody(NameList{std::move(names)});
+        return;
+    }
 
-    Message response;
-    response.setType(0x02);
+    for (const std::string &name : names)
+    {
+        response.addArg(name);
+    }
+}
 
-    // Check if already logged in
-    if (client->isAuthenticated())
+void Server::handleRequest(int client_sd, const MessageView &msg)
+{
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    if (!client)
     {
-        response.setCommand(0x10); // Login successful
-        response.addArg(this->name);
-        Server::sendClient(client_sd, response);
         return;
     }
 
-    // Invalid Arguments
-    if (args.size() < 2)
+    // Responses sent while handling the request, or from its completions, echo its correlation id
+    // and only reach this connection, not a later one on the same descriptor
+    RequestContext request;
+    request.client_sd = client_sd;
+    request.connection = client->getConnection();
+    request.correlated = msg.isCorrelated();
+    request.correlation = msg.getCorrelation();
+    RequestScope context(request);
+    Server::dispatch(client_sd, msg, false);
+}
+
+void Server::dispatch(int client_sd, const MessageView &msg, bool batched)
+{
+    static constexpr Command commands[] = {
+        // code, handler, auth, min args, priority, name, silent, batch, reserve
+        {0x01, &Server::hello, false, 0, Priority::Control, "hello", false, false, 0},
+        {0x02, &Server::batch, true, 0, Priority::Control, "batch", false, false, 16384},
+        {0x05, &Server::setDictionary, false, 2, Priority::Control, "dictionary", false, false, 0},
+        {0x10, &Server::login, false, 2, Priority::Control, "login", false, false, 0},
+        {0x11, nullptr, true, 1, Priority::Control, "set_password", false, false, 0},
+        {0x12, &Server::setNickname, true, 1, Priority::Control, "set_nickname", false, false, 0},
+        {0x20, &Server::listChannels, true, 0, Priority::Interactive, "list_channels", false, true, 1024},
+        {0x21, &Server::listOnlineUsers, true, 0, Priority::Interactive, "list_users", false, true, 1024},
+        {0x22, &Server::getUserMsg, true, 1, Priority::Interactive, "user_history", false, true, 4096},
+        {0x23, &Server::getChannelMsg, true, 2, Priority::Interactive, "channel_history", false, true, 4096},
+        {0x24, &Server::getStats, true, 0, Priority::Interactive, "stats", false, true, 1024},
+        {0x25, &Server::searchMsg, true, 1, Priority::Interactive, "search", false, true, 4096},
+        {0x30, &Server::channelMsg, true, 2, Priority::Interactive, "channel_message", false, true, 0},
+        {0x31, &Server::userMsg, true, 2, Priority::Interactive, "user_message", false, true, 0},
+        {0x40, &Server::joinChannel, true, 1, Priority::Interactive, "join_channel", false, true, 0},
+        {0x41, nullptr, true, 1, Priority::Interactive, "change_channel", false, true, 0},
+        {0x42, nullptr, true, 1, Priority::Interactive, "create_channel", false, true, 0},
+        {0x43, nullptr, true, 2, Priority::Interactive, "set_topic", false, true, 0},
+        {0x44, nullptr, true, 2, Priority::Interactive, "set_key", false, true, 0},
+        {0x50, nullptr, true, 2, Priority::Interactive, "kick", false, true, 0},
+        {0x51, nullptr, true, 2, Priority::Interactive, "ban", false, true, 0},
+        {0x60, &Server::upload, true, 3, Priority::Interactive, "upload", false, false, 0},
+        {0x61, &Server::download, true, 2, Priority::Interactive, "download", false, false, 0},
+        {0x75, &Server::uploadChunk, true, 2, Priority::Bulk, "upload_chunk", true, false, 0},
+        {0x76, &Server::uploadEnd, true, 0, Priority::Interactive, "upload_end", false, false, 0},
+    };
+    static constexpr std::array<uint8_t, 256> index = commandIndex(commands);
+
+    // Metrics are looked up once, handlers only bump them
+    struct Stats
+    {
+        Counter *count;
+        Histogram *latency;
+        CompressionStats compression;
+    };
+    static const std::array<Stats, std::size(commands)> stats = []
+    {
+        std::array<Stats, std::size(commands)> all;
+        for (size_t i = 0; i < all.size(); ++i)
+        {
+            std::string name = std::string("requests.") + commands[i].name;
+            all[i] = {&Metrics::instance().counter(name), &Metrics::instance().histogram(name + "_us"), CompressionStats::lookup(commands[i].name)};
+        }
+        return all;
+    }();
+    static Counter &rejected = Metrics::instance().counter("requests.rejected");
+
+    uint8_t slot = index[msg.getCommand()];
+    if (slot == NO_COMMAND)
     {
-        response.setCommand(0x00);
-        Server::sendClient(client_sd, response);
+        std::cout << ERROR << "Unknown request code: " << msg.getCommand() << std::endl;
+        rejected.add();
+        Server::invalidCommand(client_sd);
         return;
     }
+    const Command &command = commands[slot];
+    RequestContext::current().command = command.name;
+    RequestContext::current().compression = &stats[slot].compression;
+    RequestContext::current().reserve = command.reserve;
+    BufferPool::hint() = command.reserve;
 
-    username = args[0];
+    if (command.priority != Priority::Bulk)
+    {
+        std::cout << INFO << command.name << " from " << client_sd << std::endl;
+    }
 
-    // TODO check if another user is already logged in
+    // Answered like an unknown code, a client waiting on its correlation id gets a reply
+    if (!command.handler)
+    {
+        std::cout << ERROR << command.name << " NOT IMPLEMENTED" << std::endl;
+        rejected.add();
+        Server::invalidCommand(client_sd);
+        return;
+    }
 
-    // Fetch details for the user with <username>
-    int clientId;
-    if (!db.getClientByUsername(username, clientId, password, nickname))
+    // Checks shared by every handler
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    uint8_t failure = 0xFF;
+    if (command.auth and !client->isAuthenticated())
     {
-        // If username not found then insert user
-        if (db.insertClient(username, args[1], clientId))
-        {
-            std::cout << "Client addedd with username: " << username << std::endl;
-            client->setUserName(username);
-            client->setID(clientId);
+        failure = 0x02; // Not Authenticated error
+    }
+    else if (batched and !command.batch)
+    {
+        failure = 0x00; // Client Side Error
+    }
+    else if (command.minArgs > 0 and !msg.isCompact() and msg.args().size() < command.minArgs)
+    {
+        failure = 0x00; // Client Side Error
+    }
 
-            response.setCommand(0x011); // User created
+    if (failure != 0xFF)
+    {
+        rejected.add();
+        if (!command.silent)
+        {
+            Message response;
+            response.setType(0x02);
+            response.setCommand(failure);
             Server::sendClient(client_sd, response);
-            return;
         }
-        else
+        return;
+    }
+
+    // Time in the handler, work handed to the database or I/O threads is measured there
+    auto start = std::chrono::steady_clock::now();
+    (this->*command.handler)(client_sd, msg);
+    stats[slot].count->add();
+    stats[slot].latency->record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+// Compact Hello, or <version> <max_frame> [codecs] from older clients, sent right after connecting
+void Server::hello(int client_sd, const MessageView &msg)
+{
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+
+    Hello offer;
+    if (msg.isCompact())
+    {
+        if (!msg.getBody(offer))
         {
-            response.setCommand(0x01); // Server Side Error
+            Message response;
+            response.setType(0x02);
+            response.setCommand(0x00); // Client Side Error
             Server::sendClient(client_sd, response);
             return;
         }
     }
+    else
+    {
+        // Text hellos predate the feature list, version 3 ones had every feature
+        MessageView::Args args = msg.args();
+        offer.version = std::min<uint64_t>(args.number(0, 1), UINT32_MAX);
+        offer.maxFrame = std::min<uint64_t>(args.number(1, MAX_PAYLOAD), UINT32_MAX);
+        if (offer.version >= 3 and args.size() >= 3)
+        {
+            std::string_view codecs = args[2];
+            for (size_t pos = 0; pos <= codecs.size();)
+            {
+                size_t end = std::min(codecs.find(',', pos), codecs.size());
+                offer.codecs.emplace_back(codecs.substr(pos, end - pos));
+                pos = end + 1;
+            }
+        }
+        offer.features = offer.version >= 3 ? FEATURES : 0;
+    }
+
+    // Older versions keep 1020 byte frames, compression and correlation ids need version 3
+    Hello agreed;
+    agreed.version = std::clamp<uint32_t>(offer.version, 1, PROTOCOL_VERSION);
+    agreed.maxFrame = agreed.version >= 2 ? std::clamp<uint32_t>(offer.maxFrame, MAX_PAYLOAD, MAX_FRAME) : MAX_PAYLOAD;
+    agreed.features = offer.features & FEATURES;
+    if (agreed.version < 3)
+    {
+        agreed.features &= ~uint64_t(FEATURE_CORRELATION);
+    }
+    bool compress = agreed.version >= 3 and std::find(offer.codecs.begin(), offer.codecs.end(), "lz") != offer.codecs.end();
+    agreed.codecs.push_back(compress ? "lz" : "none");
+
+    Message response;
+    response.setType(0x02);
+    response.setCommand(0x03);
+    if (msg.isCompact())
+    {
+        response.setBody(agreed);
+    }
+    else
+    {
+        response.addArg(std::to_string(agreed.version));
+        response.addArg(std::to_string(agreed.maxFrame));
+        if (agreed.version >= 3 and !offer.codecs.empty())
+        {
+            response.addArg(agreed.codecs[0]);
+        }
+    }
+
+    // The answer still goes out in a version 1 frame
+    Server::sendClient(client_sd, response);
+
+    client->updateSession([&](Session &session)
+                          {
+                              session.version = agreed.version;
+                              session.maxFrame = agreed.version >= 2 ? agreed.maxFrame : 0;
+                              session.compressAbove = compress ? COMPRESS_THRESHOLD : 0;
+                              session.features = agreed.features; });
+}
+
+// <id> <bytes>, later compressed responses may use the dictionary, they name it by its id
+void Server::setDictionary(int client_sd, const MessageView &msg)
+{
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
 
-    // std::cout << "Username: " << username << "\t" << "Password: " << password << "\t" << "Nickname: " << nickname << "\n";
+    Message response;
+    response.setType(0x02);
 
-    if (args[1] != password)
+    uint64_t id = args.number(0, 0);
+    std::string_view bytes = args[1];
+    if (id == 0 or id > UINT32_MAX or bytes.size() > LZ_MAX_DICTIONARY)
     {
-        response.setCommand(0x012); // Incorrect password
+        response.setCommand(0x00); // Client Side Error
         Server::sendClient(client_sd, response);
         return;
     }
-    // Continue if correct password
 
-    // Setup client object
-    client->setUserName(username);
-    client->setID(clientId);
-    client->setNickName(nickname);
+    // Frames already queued keep the dictionary they were compressed with
+    auto dictionary = std::make_shared<const LzDictionary>(id, reinterpret_cast<const uint8_t *>(bytes.data()), bytes.size());
+    client->updateSession([&](Session &session)
+                          { session.dictionary = dictionary; });
 
-    response.setCommand(0x10); // Login successful
+    response.setCommand(0x05); // Dictionary set
     Server::sendClient(client_sd, response);
 }
 
-// !register <username> <password> <nickname>
-// TODO
+// Compact BatchRequest, answered by one 0x04 BatchResponse once every sub-request is done
+void Server::batch(int client_sd, const MessageView &msg)
+{
+    BatchRequest request;
+    if (!msg.getBody(request) or request.requests.empty() or request.requests.size() > MAX_BATCH)
+    {
+        Message response;
+        response.setType(0x02);
+        response.setCommand(0x00); // Client Side Error
+        Server::sendClient(client_sd, response);
+        return;
+    }
 
-// !msg <channel> <message>
-void Server::channelMsg(int client_sd, Message &msg)
+    // The queries of the sub-requests run as one database job, their message writes in one transaction per shard
+    DbExecutor::Group group;
+    group.begin = [this]()
+    { db.beginBatch(); };
+
+    RequestContext context = RequestContext::current();
+    context.batch = std::make_shared<Batch>(*this, RequestContext::current(), request.requests.size());
+
+    // A failed commit lost the writes of the sub-requests, their results are replaced with errors
+    group.end = [this, batch = context.batch]()
+    {
+        if (!db.endBatch())
+        {
+            std::cerr << "Batch of " << batch->size() << " requests failed to commit" << std::endl;
+            batch->fail();
+            return false;
+        }
+        return true;
+    };
+
+    dbExec.open(group);
+    for (size_t i = 0; i < request.requests.size(); ++i)
+    {
+        context.slot = i;
+        RequestScope scope(context);
+
+        Message sub = batchMessage(request.requests[i], 0x01);
+        Server::dispatch(client_sd, sub.view(), true);
+    }
+    dbExec.close(group);
+
+    // Sub-requests answered right away are in, the completions still pending send the 0x04
+    context.batch->release();
+}
+
+// !login <username> <password>
+void Server::login(int client_sd, const MessageView &msg)
 {
-    Client *client = Server::getClient(client_sd);
-    std::vector<std::string> args = msg.getArgs();
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
+    std::string username;
 
     Message response;
     response.setType(0x02);
 
-    // Check if client authenticated
-    if (!client->isAuthenticated())
+    // Check if already logged in
+    if (client->isAuthenticated())
     {
-        response.setCommand(0x02); // Not Authenticated error
+        response.setCommand(0x10); // Login successful
+        response.addArg(this->name);
         Server::sendClient(client_sd, response);
         return;
     }
 
+    username = args[0];
+    std::string given(args[1]);
+
+    // TODO check if another user is already logged in
+
+    // Setup the client object once the account is known
+    auto finish = [this, client_sd, username](int status, int clientId, const std::string &nickname)
+    {
+        Message response;
+        response.setType(0x02);
+        response.setCommand(status);
+
+        std::shared_ptr<Client> client = Server::getClient(client_sd);
+        if (client and (status == 0x10 or status == 0x11))
+        {
+            client->login(clientId, username, nickname);
+        }
+        Server::sendClient(client_sd, response);
+    };
+
+    // Passwords are only kept in the database
+    dbExec.submit(
+        [this, username, given]()
+        {
+            int clientId;
+            std::string password, nickname;
+
+            if (db.getClientByUsername(username, clientId, password, nickname))
+            {
+                users.insert(clientId, username, nickname);
+                // Login successful or Incorrect password
+                return std::make_tuple(given == password ? 0x10 : 0x12, clientId, nickname);
+            }
+
+            // If username not found then insert user
+            if (!db.insertClient(username, given, clientId))
+            {
+                return std::make_tuple(0x01, 0, std::string()); // Server Side Error
+            }
+
+            std::cout << "Client addedd with username: " << username << std::endl;
+            users.insert(clientId, username, "");
+            return std::make_tuple(0x11, clientId, std::string()); // User created
+        },
+        [finish](const std::tuple<int, int, std::string> &result)
+        {
+            finish(std::get<0>(result), std::get<1>(result), std::get<2>(result));
+        });
+}
+
+// !nick <nickname>
+void Server::setNickname(int client_sd, const MessageView &msg)
+{
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
+
+    Message response;
+    response.setType(0x02);
+
     // Check if args exist
-    if (args.size() < 2)
+    if (args.size() < 1 or args[0].empty())
     {
         response.setCommand(0x00); // Client Side Error
         Server::sendClient(client_sd, response);
         return;
     }
 
-    std::string channel_name = args[0];
+    std::string nickname(args[0]);
+    int client_id = client->getID();
+
+    // Held until the database has it, a concurrent request for the same nickname is refused
+    if (!users.claimNickname(client_id, nickname))
+    {
+        response.setCommand(0x23); // Nickname already in use
+        Server::sendClient(client_sd, response);
+        return;
+    }
+
+    dbExec.submit(
+        [this, client_id, nickname]()
+        {
+            return this->db.updateNickname(client_id, nickname);
+        },
+        [this, client_sd, client_id, nickname](bool ok)
+        {
+            Message response;
+            response.setType(0x02);
+
+            if (!ok)
+            {
+                users.releaseNickname(client_id, nickname);
+                response.setCommand(0x01); // Server Side Error
+                Server::sendClient(client_sd, response);
+                return;
+            }
+
+            // Invalidate the cached nickname
+            users.setNickname(client_id, nickname);
+            if (std::shared_ptr<Client> client = Server::getClient(client_sd))
+            {
+                client->setNickName(nickname);
+            }
+
+            response.setCommand(0x22); // Nickname changed successfully
+            Server::sendClient(client_sd, response);
+        });
+}
+
+// !register <username> <password> <nickname>
+// TODO
+
+// !msg <channel> <message>
+void Server::channelMsg(int client_sd, const MessageView &msg)
+{
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
+
+    Message response;
+    response.setType(0x02);
+
+    std::string channel_name(args[0]);
 
     // Channel name check
     if ((channel_name.size() < 2) or !channel_name.starts_with("#"))
@@ -224,16 +488,10 @@ void Server::channelMsg(int client_sd, Message &msg)
         return;
     }
 
+    int client_id = client->getID();
     int channel_id = channel->getId();
 
-    std::string text = args[1];
-
-    if (!this->db.insertChannelMessage(client->getID(), channel_id, text))
-    {
-        response.setCommand(0x01); // Server Side Error
-        Server::sendClient(client_sd, response);
-        return;
-    }
+    std::string text(args[1]);
 
     // Broadcast
     Message toChannel;
@@ -242,62 +500,60 @@ void Server::channelMsg(int client_sd, Message &msg)
     toChannel.addArg("1");
     toChannel.addArg("#" + channel->getName()); // Channel name
     toChannel.addArg(client->getUserName());    // Username
-    toChannel.addArg(msg.getArgs()[1]);
-    toChannel.addArg(date_time());
-
-    std::vector<int> recipients;
-
-    // Collect all clients who are members of the channel (excluding the sender)
-    {
-        std::lock_guard<std::mutex> lock(this->clientsMutex);
+    toChannel.addArg(text);
+    char stamp[CLOCK_TEXT_SIZE];
+    toChannel.addArg(date_time(stamp));
 
-        for (auto &[client_id, client_ptr] : clients)
+    dbExec.submit(
+        [this, client_id, channel_id, text]()
         {
-            if (channel->isMember(client_ptr->getID()) and client_ptr->isAuthenticated() and client_sd != client_ptr->getClientfd())
+            return this->db.insertChannelMessage(client_id, channel_id, text);
+        },
+        [this, client_sd, channel, toChannel](bool ok)
+        {
+            Message response;
+            response.setType(0x02);
+
+            if (!ok)
             {
-                recipients.push_back(client_id);
+                response.setCommand(0x01); // Server Side Error
+                Server::sendClient(client_sd, response);
+                return;
             }
-        }
-    }
-
-    for (int recipient_id : recipients)
-    {
 
-        Client *recipient = Server::getClient(recipient_id);
-        Server::sendClient(recipient->getClientfd(), toChannel);
-    }
+            Server::broadcast(channel, client_sd, toChannel);
 
-    // Response
-    response.setCommand(0x30);
-    Server::sendClient(client_sd, response);
+            // Response
+            response.setCommand(0x30);
+            Server::sendClient(client_sd, response);
+        });
 }
 
 // !getMsgC <channel> <page>
-void Server::getChannelMsg(int client_sd, Message &msg)
+void Server::getChannelMsg(int client_sd, const MessageView &msg)
 {
-    Client *client = Server::getClient(client_sd);
-    std::vector<std::string> args = msg.getArgs();
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
 
     Message response;
     response.setType(0x02);
 
-    // Check if client authenticated
-    if (!client->isAuthenticated())
+    // [channel, page] arguments, or a compact HistoryRequest
+    HistoryRequest request;
+    if (!msg.isCompact())
     {
-        response.setCommand(0x02); // Not Authenticated error
-        Server::sendClient(client_sd, response);
-        return;
+        request.target = args[0];
+        request.page = args.number(1);
     }
-
-    // Check if args exist
-    if (args.size() < 2)
+    else if (!msg.getBody(request))
     {
         response.setCommand(0x00); // Client Side Error
         Server::sendClient(client_sd, response);
         return;
     }
 
-    std::string channel_name = args[0];
+    std::string channel_name = request.target;
+    bool compact = msg.isCompact();
 
     // Channel name check
     if ((channel_name.size() < 2) or !channel_name.starts_with("#"))
@@ -324,89 +580,67 @@ void Server::getChannelMsg(int client_sd, Message &msg)
         return;
     }
 
-    int page = stoi(args[1]);
+    int page = request.page;
+    int channel_id = channel->getId();
 
-    std::vector<std::tuple<std::string, std::string, std::string>> messages;
-    if (!this->db.getChannelMessagesPaginated(channel->getId(), page, messages))
-    {
-        response.setCommand(0x01); // Server Side Error
-        Server::sendClient(client_sd, response);
-        return;
-    }
+    dbExec.submit(
+        [this, channel_id, page]()
+        {
+            History history;
+            MessageRows messages;
+            bool ok = this->db.getChannelMessagesPaginated(channel_id, page, messages);
 
-    response.setCommand(0x33); // Message from channel
-    response.addArg(std::to_string(messages.size()));
-    for (const auto &msg : messages)
-    {
-        response.addArg("#" + channel->getName());
-        response.addArg(std::get<0>(msg));
-        response.addArg(std::get<1>(msg));
-        response.addArg(std::get<2>(msg));
-    }
-    Server::sendClient(client_sd, response);
+            // Resolve sender names off the network threads
+            for (const auto &msg : messages)
+            {
+                history.push_back(std::make_tuple(*users.username(std::get<0>(msg)), std::get<1>(msg), std::get<2>(msg)));
+            }
+            return std::make_pair(ok, history);
+        },
+        [this, client_sd, channel_name, compact](const std::pair<bool, History> &result)
+        {
+            Message response;
+            response.setType(0x02);
+
+            if (!result.first)
+            {
+                response.setCommand(0x01); // Server Side Error
+                Server::sendClient(client_sd, response);
+                return;
+            }
+
+            response.setCommand(0x33); // Message from channel
+            if (compact)
+            {
+                response.setBody(historyPage(channel_name, result.second));
+                Server::sendClient(client_sd, response);
+                return;
+            }
+
+            response.addArg(std::to_string(result.second.size()));
+            for (const auto &msg : result.second)
+            {
+                response.addArg(channel_name);
+                response.addArg(std::get<0>(msg));
+                response.addArg(std::get<1>(msg));
+                response.addArg(sent_at_text(std::get<2>(msg)));
+            }
+            Server::sendClient(client_sd, response);
+        });
 }
 
 // !msg <user> <message>
-void Server::userMsg(int client_sd, Message &msg)
+void Server::userMsg(int client_sd, const MessageView &msg)
 {
-    Client *client = Server::getClient(client_sd);
-    std::vector<std::string> args = msg.getArgs();
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
 
     Message response;
     response.setType(0x02);
 
-    // Check if client authenticated
-    if (!client->isAuthenticated())
-    {
-        response.setCommand(0x02); // Not Authenticated error
-        Server::sendClient(client_sd, response);
-        return;
-    }
-
-    // Check if args exist
-    if (args.size() < 2)
-    {
-        response.setCommand(0x00); // Client Side Error
-        Server::sendClient(client_sd, response);
-        return;
-    }
-
-    std::string username = args[0];
-
-    // Check if client exists
-    int recipient_id;
-    if (!db.getClientByUsername(username, recipient_id))
-    {
-        response.setCommand(0x31); // Failed to send message
-        Server::sendClient(client_sd, response);
-        return;
-    }
-
-    std::string text = args[1];
-
-    if (!this->db.insertPrivateMessage(client->getID(), recipient_id, text))
-    {
-        response.setCommand(0x01); // Server Side Error
-        Server::sendClient(client_sd, response);
-        return;
-    }
-
-    int recipient_sd = -1;
-    for (auto &[client_id, client_ptr] : clients)
-    {
-        if (client_ptr->getID() == recipient_id)
-        {
-            recipient_sd = client_ptr->getClientfd();
-            break;
-        }
-    }
-
-    if (recipient_sd == -1)
-    {
-        response.setCommand(0x30);
-        Server::sendClient(client_sd, response);
-        return;
-    }
+    std::string username(args[0]);
+    std::string text(args[1]);
+    int client_id = client->getID();
 
     // Broadcast
     Message toRecipient;
@@ -414,179 +648,349 @@ void Server::userMsg(int client_sd, Message &msg)
     toRecipient.setCommand(0x32);
     toRecipient.addArg("1");
     toRecipient.addArg(client->getUserName()); // Sender name
-    toRecipient.addArg(msg.getArgs()[1]);      // Message
-    toRecipient.addArg(date_time());
-    Server::sendClient(recipient_sd, toRecipient);
+    toRecipient.addArg(text);                  // Message
+    char stamp[CLOCK_TEXT_SIZE];
+    toRecipient.addArg(date_time(stamp));
 
-    // Response
-    response.setCommand(0x30);
-    Server::sendClient(client_sd, response);
-}
+    dbExec.submit(
+        [this, client_id, username, text]()
+        {
+            // Check if client exists
+            int recipient_id;
+            if (!users.resolve(username, recipient_id))
+            {
+                return std::make_pair(0x31, 0); // Failed to send message
+            }
 
-// !getMsgU <page>
-// !getMsgU <user> <page>
-void Server::getUserMsg(int client_sd, Message &msg)
+            if (!this->db.insertPrivateMessage(client_id, recipient_id, text))
+            {
+                return std::make_pair(0x01, 0); // Server Side Error
+            }
+            return std::make_pair(0x30, recipient_id);
+        },
+        [this, client_sd, toRecipient](const std::pair<int, int> &result)
+        {
+            Message response;
+            response.setType(0x02);
+            response.setCommand(result.first);
+
+            if (result.first == 0x30)
+            {
+                int recipient_sd = Server::getClientSdById(result.second);
+                if (recipient_sd != -1)
+                {
+                    Server::pushClient(recipient_sd, toRecipient);
+                }
+            }
+
+            // Response
+            Server::sendClient(client_sd, response);
+        });
+}
+
+// !getMsgU <page>
+// !getMsgU <user> <page>
+void Server::getUserMsg(int client_sd, const MessageView &msg)
 {
-    Client *client = Server::getClient(client_sd);
-    std::vector<std::string> args = msg.getArgs();
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
 
     Message response;
     response.setType(0x02);
 
-    // Check if client authenticated
-    if (!client->isAuthenticated())
-    {
-        response.setCommand(0x02); // Not Authenticated error
-        Server::sendClient(client_sd, response);
-        return;
-    }
-
-    // Check if args exist
-    if (args.size() < 1)
-    {
-        response.setCommand(0x00); // Client Side Error
-        Server::sendClient(client_sd, response);
-        return;
-    }
-
     int page;
     std::string username;
-    std::vector<int> ids;
+    bool compact = msg.isCompact();
 
-    if (args.size() > 1)
+    // [user, page] or [page] arguments, or a compact HistoryRequest with an optional user
+    if (compact)
     {
-        username = args[0];
-        page = stoi(args[1]);
-
-        int recipient_id;
-        if (!db.getClientByUsername(username, recipient_id))
+        HistoryRequest request;
+        if (!msg.getBody(request))
         {
-            response.setCommand(0x34); // Failed to receive message
+            response.setCommand(0x00); // Client Side Error
             Server::sendClient(client_sd, response);
             return;
         }
-
-        ids.push_back(recipient_id);
+        username = request.target;
+        page = request.page;
+    }
+    else if (args.size() > 1)
+    {
+        username = args[0];
+        page = args.number(1);
     }
     else
     {
-        page = stoi(args[0]);
-        if (!this->db.getPrvMsgIds(client->getID(), ids))
-        {
-            response.setCommand(0x34); // Failed to receive message
-            Server::sendClient(client_sd, response);
-            return;
-        }
+        page = args.number(0);
     }
 
-    std::vector<std::tuple<std::string, std::string, std::string>> messages;
-    for (int &id : ids)
-    {
-        if (!this->db.getPrivateMessagesPaginated(client->getID(), id, page, messages))
+    int client_id = client->getID();
+
+    // One history per conversation, empty result means the lookup failed
+    dbExec.submit(
+        [this, client_id, username, page]()
         {
-            response.setCommand(0x01); // Server Side Error
-            Server::sendClient(client_sd, response);
-            continue;
-        }
+            std::vector<std::pair<bool, History>> conversations;
+            std::vector<int> ids;
 
-        response.setCommand(0x32); // Message from user
-        response.clearArgs();
-        response.addArg(std::to_string(messages.size()));
+            if (!username.empty())
+            {
+                int recipient_id;
+                if (!users.resolve(username, recipient_id))
+                {
+                    return conversations;
+                }
+                ids.push_back(recipient_id);
+            }
+            else if (!this->db.getPrvMsgIds(client_id, ids))
+            {
+                return conversations;
+            }
 
-        for (const auto &msg : messages)
+            for (int &id : ids)
+            {
+                History history;
+                MessageRows messages;
+                bool ok = this->db.getPrivateMessagesPaginated(client_id, id, page, messages);
+
+                for (const auto &msg : messages)
+                {
+                    history.push_back(std::make_tuple(*users.username(std::get<0>(msg)), std::get<1>(msg), std::get<2>(msg)));
+                }
+                conversations.push_back(std::make_pair(ok, history));
+            }
+            return conversations;
+        },
+        [this, client_sd, compact](const std::vector<std::pair<bool, History>> &conversations)
         {
-            response.addArg(std::get<0>(msg));
-            response.addArg(std::get<1>(msg));
-            response.addArg(std::get<2>(msg));
-        }
-        Server::sendClient(client_sd, response);
-    }
+            Message response;
+            response.setType(0x02);
+
+            if (conversations.empty())
+            {
+                response.setCommand(0x34); // Failed to receive message
+                Server::sendClient(client_sd, response);
+                return;
+            }
+
+            for (const auto &[ok, messages] : conversations)
+            {
+                response.clearArgs();
+
+                if (!ok)
+                {
+                    response.setCommand(0x01); // Server Side Error
+                    Server::sendClient(client_sd, response);
+                    continue;
+                }
+
+                response.setCommand(0x32); // Message from user
+                if (compact)
+                {
+                    response.setBody(historyPage("", messages));
+                    Server::sendClient(client_sd, response);
+                    continue;
+                }
+
+                response.addArg(std::to_string(messages.size()));
+
+                for (const auto &msg : messages)
+                {
+                    response.addArg(std::get<0>(msg));
+                    response.addArg(std::get<1>(msg));
+                    response.addArg(sent_at_text(std::get<2>(msg)));
+                }
+                Server::sendClient(client_sd, response);
+            }
+        });
 }
 
-// !listc
-void Server::listChannels(int client_sd, Message &msg)
+// !search <query>
+// Args: <query> <cursor>, empty cursor for the first page
+void Server::searchMsg(int client_sd, const MessageView &msg)
 {
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
+
     Message response;
     response.setType(0x02);
 
-    Client *client = Server::getClient(client_sd);
+    // [query, cursor] arguments, or a compact SearchRequest
+    SearchRequest request;
+    bool compact = msg.isCompact();
+    if (compact ? !msg.getBody(request) : args.empty())
+    {
+        response.setCommand(0x00); // Client Side Error
+        Server::sendClient(client_sd, response);
+        return;
+    }
+    if (!compact)
+    {
+        request.query = args[0];
+        request.cursor = args.size() > 1 ? args[1] : "";
+    }
 
-    if (!client->isAuthenticated())
+    if (request.query.empty())
     {
-        response.setCommand(0x02);
+        response.setCommand(0x00); // Client Side Error
         Server::sendClient(client_sd, response);
         return;
     }
 
+    std::string query = request.query;
+    std::string cursor = request.cursor;
+    int client_id = client->getID();
+
+    // Only channels the client belongs to are searched
+    std::vector<int> channel_ids;
+    {
+        std::lock_guard<std::mutex> lock(this->channelsMutex);
+        for (const auto &[channel_id, channel] : channels)
+        {
+            if (channel->isMember(client_id))
+            {
+                channel_ids.push_back(channel_id);
+            }
+        }
+    }
+
+    dbExec.submit(
+        [this, client_id, channel_ids, query, cursor]()
+        {
+            std::vector<SearchResult> results;
+            std::string nextCursor;
+            SearchRows rows;
+
+            bool ok = this->db.searchMessages(client_id, channel_ids, query, cursor, PAGE_SZ, results, nextCursor);
+            for (const SearchResult &result : results)
+            {
+                Channel *channel = result.inChannel ? Server::getChannelById(result.targetId) : nullptr;
+                rows.push_back(std::make_tuple(channel ? "#" + channel->getName() : *users.username(result.targetId),
+                                               *users.username(result.senderId), result.text, result.sentAt));
+            }
+            return std::make_tuple(ok, nextCursor, rows);
+        },
+        [this, client_sd, compact](const std::tuple<bool, std::string, SearchRows> &result)
+        {
+            const auto &[ok, nextCursor, rows] = result;
+            Message response;
+            response.setType(0x02);
+
+            if (!ok)
+            {
+                response.setCommand(0x36); // Search failed
+                Server::sendClient(client_sd, response);
+                return;
+            }
+
+            response.setCommand(0x35); // Search results
+            if (compact)
+            {
+                SearchPage page;
+                page.cursor = nextCursor;
+                for (const auto &[target, sender, text, sentAt] : rows)
+                {
+                    page.hits.push_back({target, {sender, text, static_cast<uint64_t>(sentAt / 1000)}});
+                }
+                response.setBody(page);
+                Server::sendClient(client_sd, response);
+                return;
+            }
+
+            // [count, cursor] then four arguments per hit
+            response.addArg(std::to_string(rows.size()));
+            response.addArg(nextCursor);
+            for (const auto &[target, sender, text, sentAt] : rows)
+            {
+                response.addArg(target);
+                response.addArg(sender);
+                response.addArg(text);
+                response.addArg(sent_at_text(sentAt));
+            }
+            Server::sendClient(client_sd, response);
+        });
+}
+
+// !listc
+void Server::listChannels(int client_sd, const MessageView &msg)
+{
+    Message response;
+    response.setType(0x02);
+
     response.setCommand(0x40);
 
+    std::vector<std::string> names;
     {
         std::lock_guard<std::mutex> lock(this->channelsMutex);
         for (const auto &pair : channels)
         {
             const auto &channel = pair.second;
-            response.addArg(channel->getName());
+            names.push_back(channel->getName());
         }
     }
 
+    nameList(response, std::move(names), msg.isCompact());
     Server::sendClient(client_sd, response);
 }
 
 // !listu
-void Server::listOnlineUsers(int client_sd, Message &msg)
+void Server::listOnlineUsers(int client_sd, const MessageView &msg)
 {
     Message response;
     response.setType(0x02);
 
-    Client *client = Server::getClient(client_sd);
-
-    if (!client->isAuthenticated())
-    {
-        response.setCommand(0x02);
-        Server::sendClient(client_sd, response);
-        return;
-    }
-
     response.setCommand(0x41);
 
+    std::vector<std::string> names;
     {
         std::lock_guard<std::mutex> lock(this->clientsMutex);
         for (const auto &pair : clients)
         {
             const auto &client = pair.second;
-            response.addArg(client->getUserName());
+            names.push_back(client->getUserName());
         }
     }
 
+    nameList(response, std::move(names), msg.isCompact());
     Server::sendClient(client_sd, response);
 }
 
-// !join <channel>
-void Server::joinChannel(int client_sd, Message &msg)
+// !stats
+void Server::getStats(int client_sd, const MessageView &)
 {
-    Client *client = Server::getClient(client_sd);
-    std::vector<std::string> args = msg.getArgs();
-
     Message response;
     response.setType(0x02);
 
-    // Check if client authenticated
-    if (!client->isAuthenticated())
-    {
-        response.setCommand(0x02); // Not Authenticated error
-        Server::sendClient(client_sd, response);
-        return;
-    }
+    response.setCommand(0x42); // Server statistics
 
-    // Check if args exist
-    if (args.size() < 1)
+    // Split the report over as many frames as needed
+    size_t size = 0;
+    for (const std::string &line : Metrics::instance().report())
     {
-        response.setCommand(0x00); // Client Side Error
-        Server::sendClient(client_sd, response);
-        return;
+        if (size + line.size() + 1 > 1020 and size > 0)
+        {
+            Server::sendClient(client_sd, response);
+            response.clearArgs();
+            size = 0;
+        }
+        response.addArg(line.substr(0, 1019));
+        size += std::min<size_t>(line.size(), 1019) + 1;
     }
 
-    std::string channel_name = args[0];
+    Server::sendClient(client_sd, response);
+}
+
+// !join <channel>
+void Server::joinChannel(int client_sd, const MessageView &msg)
+{
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
+
+    Message response;
+    response.setType(0x02);
+
+    std::string channel_name(args[0]);
 
     // Channel name check
     if ((channel_name.size() < 2) or !channel_name.starts_with("#"))
@@ -616,17 +1020,30 @@ void Server::joinChannel(int client_sd, Message &msg)
 
     // TODO check for channel key
 
+    int client_id = client->getID();
+
     // Add the client to the channel
-    if (!channel->addMember(client->getID(), this->db))
-    {
-        response.setCommand(0x01); // server side error
-        Server::sendClient(client_sd, response);
-        return;
-    }
+    dbExec.submit(
+        [this, channel, client_id]()
+        {
+            return channel->addMember(client_id, this->db);
+        },
+        [this, client_sd, channel_name](bool ok)
+        {
+            Message response;
+            response.setType(0x02);
 
-    response.setCommand(0x50); // joined channel
-    response.addArg(channel_name);
-    Server::sendClient(client_sd, response);
+            if (!ok)
+            {
+                response.setCommand(0x01); // server side error
+                Server::sendClient(client_sd, response);
+                return;
+            }
+
+            response.setCommand(0x50); // joined channel
+            response.addArg(channel_name);
+            Server::sendClient(client_sd, response);
+        });
 
     // TODO broadcast a join message to the channel
 }
@@ -642,323 +1059,702 @@ void Server::invalidCommand(int client_sd)
 }
 
 // !send
-void Server::upload(int client_sd, Message &msg)
+void Server::upload(int client_sd, const MessageView &msg)
 {
-    Client *client = Server::getClient(client_sd);
-    std::vector<std::string> args = msg.getArgs();
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
 
     Message response;
     response.setType(0x02);
 
-    // Check if client authenticated
-    if (!client->isAuthenticated())
-    {
-        response.setCommand(0x02); // Not Authenticated error
-        Server::sendClient(client_sd, response);
-        return;
-    }
-
-    // Check if args exist
-    if (args.size() < 3)
-    {
-        response.setCommand(0x00); // Client Side Error
-        Server::sendClient(client_sd, response);
-        return;
-    }
+    std::string name(args[0]);
+    std::string filename(args[1]);
+    int client_id = client->getID();
 
-    std::string name = args[0];
-    std::string filename = args[1];
-    std::string file_data = args[2];
+    Channel *channel = nullptr;
 
     // Channel name check
-    if (!name.starts_with("#"))
+    if (name.starts_with("#"))
     {
-        // Check if client exists
-        int recipient_id;
-        if (!db.getClientByUsername(name, recipient_id))
+        // Check if channel exists
+        channel = getChannel(name.substr(1));
+        if (!channel)
         {
             response.setCommand(0x72); // File upload failed
             Server::sendClient(client_sd, response);
             return;
         }
 
-        std::string uid_file = Server::savefile(filename, file_data);
-        if (uid_file.empty())
+        // If the client not in the channel
+        if (!channel->isMember(client->getID()))
         {
-            response.setCommand(0x01); // Server Side Error
+            response.setCommand(0x72); // File upload failed
             Server::sendClient(client_sd, response);
             return;
         }
+    }
 
-        if (!this->db.insertFile(filename, client->getID(), recipient_id, 0, uid_file))
-        {
-            response.setCommand(0x01); // Server Side Error
-            Server::sendClient(client_sd, response);
-            return;
-        }
+    int channel_id = channel ? channel->getId() : 0;
+    std::string sender = client->getUserName();
 
-        std::string text = "Sent a file " + filename + " -> " + uid_file;
+    // [recipient, filename, size, transfer_id] opens or resumes a streaming upload
+    if (args.size() >= 4)
+    {
+        Server::openUpload(client_sd, client_id, channel_id, name, filename, args.number(2, UINT64_MAX), std::string(args[3]));
+        return;
+    }
 
-        if (!this->db.insertPrivateMessage(client->getID(), recipient_id, text))
-        {
-            response.setCommand(0x01); // Server Side Error
-            Server::sendClient(client_sd, response);
-            return;
-        }
+    // [recipient, filename, contents] is a whole file in one frame
+    std::string file_data(args[2]);
 
-        int recipient_sd = -1;
-        for (auto &[client_id, client_ptr] : clients)
+    dbExec.submit(
+        [this, channel_id, name]()
         {
-            if (client_ptr->getID() == recipient_id)
+            // Check if client exists
+            int recipient_id = 0;
+            bool found = channel_id or users.resolve(name, recipient_id);
+            return std::make_pair(found, recipient_id);
+        },
+        [this, client_sd, client_id, channel_id, channel, sender, filename, file_data](const std::pair<bool, int> &recipient)
+        {
+            if (!recipient.first)
             {
-                recipient_sd = client_ptr->getClientfd();
-                break;
+                Server::uploadDone(client_sd, channel, sender, std::make_tuple(0x72, 0, std::string())); // File upload failed
+                return;
             }
-        }
 
-        if (recipient_sd == -1)
+            io.submit(
+                filename,
+                [this, file_data]()
+                {
+                    std::string hash;
+                    std::string uid_file = Server::savefile(file_data, hash);
+                    return std::make_pair(uid_file, hash);
+                },
+                [this, client_sd, client_id, channel_id, channel, sender, filename, recipient_id = recipient.second, size = file_data.size()](const std::pair<std::string, std::string> &saved)
+                {
+                    if (saved.first.empty())
+                    {
+                        Server::uploadDone(client_sd, channel, sender, std::make_tuple(0x01, 0, std::string())); // Server Side Error
+                        return;
+                    }
+
+                    dbExec.submit(
+                        [this, client_id, channel_id, recipient_id, filename, saved, size]()
+                        {
+                            return Server::recordUpload(client_id, channel_id, recipient_id, filename, saved.first, saved.second, size);
+                        },
+                        [this, client_sd, channel, sender](const std::tuple<int, int, std::string> &result)
+                        {
+                            Server::uploadDone(client_sd, channel, sender, result);
+                        });
+                });
+        });
+}
+
+void Server::openUpload(int client_sd, int client_id, int channel_id, const std::string &name, const std::string &filename, uint64_t total, const std::string &transfer_id)
+{
+    Message response;
+    response.setType(0x02);
+
+    // Resume, the client continues from the offset already on disk
+    if (!transfer_id.empty())
+    {
+        std::shared_ptr<Transfer> transfer = transfers.find(transfer_id, client_id);
+        if (!transfer)
         {
-            response.setCommand(0x70);
+            response.setCommand(0x72); // File upload failed
             Server::sendClient(client_sd, response);
             return;
         }
 
-        // Broadcast
-        Message toRecipient;
-        toRecipient.setType(0x02);
-        toRecipient.setCommand(0x32);
-        toRecipient.addArg("1");
-        toRecipient.addArg(client->getUserName()); // Sender name
-        toRecipient.addArg(text);                  // Message
-        toRecipient.addArg(date_time());
-        Server::sendClient(recipient_sd, toRecipient);
-
-        // Response
-        response.setCommand(0x70);
+        std::lock_guard<std::mutex> lock(transfer->mutex);
+        transfer->touched = std::chrono::steady_clock::now();
+        response.setCommand(0x74); // Upload open
+        response.addArg(transfer->id);
+        response.addArg(std::to_string(transfer->accepted));
         Server::sendClient(client_sd, response);
+        return;
     }
-    else
+
+    // Missing or malformed size
+    if (total == UINT64_MAX)
     {
-        // Check if channel exists
-        Channel *channel = getChannel(name.substr(1));
-        if (!channel)
-        {
-            response.setCommand(0x72); // File upload failed
-            Server::sendClient(client_sd, response);
-            return;
-        }
+        response.setCommand(0x00); // Client Side Error
+        Server::sendClient(client_sd, response);
+        return;
+    }
 
-        // If the client not in the channel
-        if (!channel->isMember(client->getID()))
+    dbExec.submit(
+        [this, channel_id, name]()
         {
-            response.setCommand(0x72); // File upload failed
-            Server::sendClient(client_sd, response);
-            return;
-        }
-        int channel_id = channel->getId();
-
-        std::string uid_file = Server::savefile(filename, file_data);
-        if (uid_file.empty())
+            // Check if client exists
+            int recipient_id = 0;
+            bool found = channel_id or users.resolve(name, recipient_id);
+            return std::make_pair(found, recipient_id);
+        },
+        [this, client_sd, client_id, channel_id, filename, total](const std::pair<bool, int> &result)
         {
-            response.setCommand(0x01); // Server Side Error
-            Server::sendClient(client_sd, response);
-            return;
-        }
+            if (!result.first)
+            {
+                Message response;
+                response.setType(0x02);
+                response.setCommand(0x72); // File upload failed
+                Server::sendClient(client_sd, response);
+                return;
+            }
 
-        if (!this->db.insertFile(filename, client->getID(), 0, channel_id, uid_file))
-        {
-            response.setCommand(0x01); // Server Side Error
-            Server::sendClient(client_sd, response);
-            return;
-        }
+            // The part file is created on the transfer's I/O thread
+            std::string id = Server::generateUniqueId();
+            io.submit(
+                id,
+                [this, id, client_id, channel_id, recipient_id = result.second, filename, total]()
+                {
+                    transfers.expire();
+                    return transfers.open(id, client_id, channel_id, recipient_id, filename, total) != nullptr;
+                },
+                [this, client_sd, id](bool opened)
+                {
+                    Message response;
+                    response.setType(0x02);
+
+                    if (!opened)
+                    {
+                        response.setCommand(0x72); // File upload failed
+                        Server::sendClient(client_sd, response);
+                        return;
+                    }
+
+                    response.setCommand(0x74); // Upload open
+                    response.addArg(id);
+                    response.addArg("0");
+                    Server::sendClient(client_sd, response);
+                });
+        });
+}
 
-        std::string text = "Sent a file " + filename + " -> " + uid_file;
+void Server::uploadChunk(int client_sd, const MessageView &msg)
+{
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
 
-        if (!this->db.insertChannelMessage(client->getID(), channel_id, text))
-        {
-            response.setCommand(0x01); // Server Side Error
-            Server::sendClient(client_sd, response);
-            return;
-        }
+    // [transfer_id, offset, bytes] as typed fields, or [transfer_id, offset] then raw bytes up to the end of the frame
+    MessageView::Args args = msg.args();
+    if (args.size() < (msg.isTyped() ? 3 : 2))
+    {
+        return;
+    }
+
+    std::string transfer_id(args[0]);
+    uint64_t offset = args.number(1);
+    const uint8_t *data;
+    size_t len;
+    if (msg.isTyped())
+    {
+        data = reinterpret_cast<const uint8_t *>(args[2].data());
+        len = args[2].size();
+    }
+    else
+    {
+        data = reinterpret_cast<const uint8_t *>(args[1].data() + args[1].size() + 1);
+        len = msg.data() + msg.size() - data;
+    }
+
+    std::shared_ptr<Transfer> transfer = transfers.find(transfer_id, client->getID());
+    if (!transfer)
+    {
+        Message response;
+        response.setType(0x02);
+        response.setCommand(0x72); // File upload failed
+        Server::sendClient(client_sd, response);
+        return;
+    }
 
-        // Broadcast
-        Message toChannel;
-        toChannel.setType(0x02);
-        toChannel.setCommand(0x33);
-        toChannel.addArg("1");
-        toChannel.addArg("#" + channel->getName()); // Channel name
-        toChannel.addArg(client->getUserName());    // Username
-        toChannel.addArg(text);
-        toChannel.addArg(date_time());
+    std::lock_guard<std::mutex> lock(transfer->mutex);
+    transfer->touched = std::chrono::steady_clock::now();
 
-        std::vector<int> recipients;
+    if (offset != transfer->accepted)
+    {
+        // Out of place chunk, tell the client where to continue from
+        Message response;
+        response.setType(0x02);
+        response.setCommand(0x75); // Chunk acknowledgement
+        response.addArg(transfer->id);
+        response.addArg(std::to_string(transfer->accepted));
+        Server::sendClient(client_sd, response);
+        return;
+    }
 
-        // TODO Lock the channelsMutex and clientMutex to safely access the clients map
+    if (offset + len > transfer->size)
+    {
+        transfer->failed = true;
+        transfers.remove(transfer_id);
+        io.submit(transfer_id, [transfer]()
+                  { std::remove(transfer->partPath().c_str()); });
+
+        Message response;
+        response.setType(0x02);
+        response.setCommand(0x72); // File upload failed
+        Server::sendClient(client_sd, response);
+        return;
+    }
+    transfer->accepted += len;
 
-        // Collect all clients who are members of the channel (excluding the sender)
-        for (auto &[client_id, client_ptr] : clients)
+    // Written in order on the transfer's I/O thread, acknowledged once on disk
+    io.submit(
+        transfer_id,
+        [transfer, chunk = std::vector<uint8_t>(data, data + len)]()
         {
-            if (channel->isMember(client_ptr->getID()) and client_ptr->isAuthenticated() and client_sd != client_ptr->getClientfd())
+            // -2 reports a failure, -1 sends nothing, otherwise the offset to acknowledge
+            if (transfer->failed)
             {
-                recipients.push_back(client_id);
+                return int64_t(-1);
             }
-        }
-
-        for (int recipient_id : recipients)
+            if (!transfer->write(chunk.data(), chunk.size()))
+            {
+                transfer->failed = true;
+                std::remove(transfer->partPath().c_str());
+                return int64_t(-2);
+            }
+            if (transfer->offset - transfer->acked < UPLOAD_ACK_BYTES and transfer->offset != transfer->size)
+            {
+                return int64_t(-1);
+            }
+            transfer->acked = transfer->offset;
+            return int64_t(transfer->offset);
+        },
+        [this, client_sd, transfer](int64_t ack)
         {
-            Client *recipient = this->clients[recipient_id].get();
-            Server::sendClient(recipient->getClientfd(), toChannel);
-        }
+            if (ack == -1)
+            {
+                return;
+            }
 
-        // Response
-        response.setCommand(0x70);
-        Server::sendClient(client_sd, response);
-    }
+            Message response;
+            response.setType(0x02);
+            if (ack == -2)
+            {
+                transfers.remove(transfer->id);
+                response.setCommand(0x72); // File upload failed
+            }
+            else
+            {
+                response.setCommand(0x75); // Chunk acknowledgement
+                response.addArg(transfer->id);
+                response.addArg(std::to_string(ack));
+            }
+            Server::sendClient(client_sd, response);
+        });
 }
 
-void Server::download(int client_sd, Message &msg)
+void Server::uploadEnd(int client_sd, const MessageView &msg)
 {
-    Client *client = Server::getClient(client_sd);
-    std::vector<std::string> args = msg.getArgs();
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
 
     Message response;
     response.setType(0x02);
 
-    // Check if client authenticated
-    if (!client->isAuthenticated())
+    std::shared_ptr<Transfer> transfer = args.empty() ? nullptr : transfers.find(std::string(args[0]), client->getID());
+    if (!transfer)
     {
-        response.setCommand(0x02); // Not Authenticated error
+        response.setCommand(0x72); // File upload failed
         Server::sendClient(client_sd, response);
         return;
     }
 
-    // Check if args exist
-    if (args.size() < 2)
     {
-        response.setCommand(0x00); // Client Side Error
-        Server::sendClient(client_sd, response);
-        return;
+        // Incomplete uploads stay open for a resume
+        std::lock_guard<std::mutex> lock(transfer->mutex);
+        if (transfer->accepted != transfer->size)
+        {
+            response.setCommand(0x72); // File upload failed
+            Server::sendClient(client_sd, response);
+            return;
+        }
+        transfers.remove(transfer->id);
     }
 
-    std::string name = args[0];
-    std::string uuid = args[1];
+    Channel *channel = transfer->channelId ? getChannelById(transfer->channelId) : nullptr;
+    std::string sender = client->getUserName();
 
-    int recipientId, channelId;
-    std::string filename;
+    // After the queued chunks, durable before the file is recorded
+    io.submitSynced(
+        transfer->id, transfer->fd,
+        [this, transfer](bool synced)
+        {
+            if (!synced or transfer->failed)
+            {
+                std::remove(transfer->partPath().c_str());
+                return std::string();
+            }
 
-    if (!db.getFileByUUID(uuid, filename, recipientId, channelId))
+            // Stored once per distinct content, a duplicate only adds a reference
+            std::string hash = transfer->hasher.final();
+            return blobs.adopt(transfer->partPath(), hash, transfer->size) ? hash : std::string();
+        },
+        [this, client_sd, channel, sender, transfer](const std::string &hash)
+        {
+            if (hash.empty())
+            {
+                Server::uploadDone(client_sd, channel, sender, std::make_tuple(0x01, 0, std::string())); // Server Side Error
+                return;
+            }
+
+            dbExec.submit(
+                [this, transfer, hash]()
+                {
+                    return Server::recordUpload(transfer->clientId, transfer->channelId, transfer->recipientId, transfer->filename, transfer->id, hash, transfer->size);
+                },
+                [this, client_sd, channel, sender](const std::tuple<int, int, std::string> &result)
+                {
+                    Server::uploadDone(client_sd, channel, sender, result);
+                });
+        });
+}
+
+std::tuple<int, int, std::string> Server::recordUpload(int client_id, int channel_id, int recipient_id, const std::string &filename, const std::string &uid_file, const std::string &hash, uint64_t size)
+{
+    if (!this->db.insertFile(filename, client_id, recipient_id, channel_id, uid_file, hash, size))
     {
-        response.setCommand(0x73); // Server Side Error
-        Server::sendClient(client_sd, response);
-        return;
+        return std::make_tuple(0x01, 0, std::string()); // Server Side Error
     }
 
-    if (name.starts_with("#") and channelId)
+    // A duplicate of a blob that expired after adopt() kept it has no contents left
+    if (!hash.empty() and !blobs.contains(hash))
     {
-        Channel *channel = getChannel(name.substr(1));
+        Server::releaseFile(uid_file);
+        return std::make_tuple(0x01, 0, std::string()); // Server Side Error
+    }
 
-        // If the client not in the channel
-        if (!channel->isMember(client->getID()))
+    std::string text = "Sent a file " + filename + " -> " + uid_file;
+
+    bool ok = channel_id ? this->db.insertChannelMessage(client_id, channel_id, text)
+                         : this->db.insertPrivateMessage(client_id, recipient_id, text);
+    if (!ok)
+    {
+        // Never announced, nobody can ask for it
+        Server::releaseFile(uid_file);
+        return std::make_tuple(0x01, 0, std::string()); // Server Side Error
+    }
+    return std::make_tuple(0x70, recipient_id, text);
+}
+
+void Server::uploadDone(int client_sd, Channel *channel, const std::string &sender, const std::tuple<int, int, std::string> &result)
+{
+    Message response;
+    response.setType(0x02);
+    response.setCommand(std::get<0>(result));
+
+    if (std::get<0>(result) == 0x70)
+    {
+        Message toRecipient;
+        toRecipient.setType(0x02);
+
+        if (channel)
         {
-            response.setCommand(0x73); // Failed to download file
-            Server::sendClient(client_sd, response);
-            return;
+            toRecipient.setCommand(0x33);
+            toRecipient.addArg("1");
+            toRecipient.addArg("#" + channel->getName()); // Channel name
         }
-
-        // File not in channel
-        if (channel->getId() != channelId)
+        else
         {
-            response.setCommand(0x73); // Failed to download file
-            Server::sendClient(client_sd, response);
-            return;
+            toRecipient.setCommand(0x32);
+            toRecipient.addArg("1");
         }
+        toRecipient.addArg(sender);              // Sender name
+        toRecipient.addArg(std::get<2>(result)); // Message
+        char stamp[CLOCK_TEXT_SIZE];
+        toRecipient.addArg(date_time(stamp));
 
-        std::string fileContents;
-
-        if (!Server::getfile(uuid, fileContents))
+        if (channel)
         {
-            response.setCommand(0x73); // Failed to download file
-            Server::sendClient(client_sd, response);
-            return;
+            Server::broadcast(channel, client_sd, toRecipient);
+        }
+        else
+        {
+            int recipient_sd = Server::getClientSdById(std::get<1>(result));
+            if (recipient_sd != -1)
+            {
+                Server::pushClient(recipient_sd, toRecipient);
+            }
         }
-
-        response.setCommand(0x71);
-        response.addArg(filename);
-        response.addArg(fileContents);
-        Server::sendClient(client_sd, response);
-        return;
     }
-    else if (recipientId)
+
+    // Response
+    Server::sendClient(client_sd, response);
+}
+
+void Server::download(int client_sd, const MessageView &msg)
+{
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    MessageView::Args args = msg.args();
+
+    Message response;
+    response.setType(0x02);
+
+    std::string name(args[0]);
+    std::string uuid(args[1]);
+
+    // [from, uuid, offset, length] streams the range after a 0x77 header, without length up to the end
+    // [from, uuid] sends the file in one frame
+    // Typed requests get typed answers, the contents travel as a bytes field
+    bool stream = args.size() >= 3;
+    bool typed = msg.isTyped();
+    uint64_t offset = args.number(2);
+    uint64_t length = args.number(3, UINT64_MAX);
+
+    int client_id = client->getID();
+
+    // Membership check for channel downloads
+    Channel *channel = nullptr;
+    if (name.starts_with("#"))
     {
-        if (client->getID() != recipientId)
+        channel = getChannel(name.substr(1));
+        if (!channel or !channel->isMember(client_id))
         {
             response.setCommand(0x73); // Failed to download file
             Server::sendClient(client_sd, response);
             return;
         }
+    }
 
-        std::string fileContents;
+    int member_of = channel ? channel->getId() : 0;
 
-        if (!Server::getfile(uuid, fileContents))
+    dbExec.submit(
+        [this, client_id, member_of, uuid, stream]()
         {
-            response.setCommand(0x73); // Failed to download file
-            Server::sendClient(client_sd, response);
-            return;
-        }
+            int recipientId, channelId;
+            std::string filename, hash;
 
-        response.setCommand(0x71);
-        response.addArg(filename);
-        response.addArg(fileContents);
-        Server::sendClient(client_sd, response);
-        return;
-    }
-    else
+            if (!db.getFileByUUID(uuid, filename, recipientId, channelId, hash))
+            {
+                return std::make_tuple(false, filename, std::string());
+            }
+
+            // File must be in the requested channel, or sent to this client
+            bool allowed = (member_of and channelId == member_of) or (recipientId and recipientId == client_id);
+            return std::make_tuple(allowed, filename, Server::filePath(uuid, hash));
+        },
+        [this, client_sd, stream, typed, offset, length](const std::tuple<bool, std::string, std::string> &result)
+        {
+            if (!std::get<0>(result))
+            {
+                Message response;
+                response.setType(0x02);
+                response.setCommand(0x73); // Failed to download file
+                Server::sendClient(client_sd, response);
+                return;
+            }
+
+            if (stream)
+            {
+                Server::streamFile(client_sd, std::get<1>(result), std::get<2>(result), offset, length, typed);
+                return;
+            }
+
+            std::string filename = std::get<1>(result);
+            std::string path = std::get<2>(result);
+            io.submit(
+                path,
+                [this, path]()
+                {
+                    std::string fileContents;
+                    bool ok = Server::getfile(path, fileContents);
+                    return std::make_pair(ok, fileContents);
+                },
+                [this, client_sd, filename, path, typed](const std::pair<bool, std::string> &file)
+                {
+                    // Too large for one bytes field or for the frames of the client, the file is streamed after a 0x77 header instead
+                    std::shared_ptr<Client> client = Server::getClient(client_sd);
+                    size_t limit = client and client->session.load()->maxFrame ? MAX_MESSAGE : MAX_PAYLOAD;
+                    size_t size = filename.size() + file.second.size() + (typed ? 6 : 2);
+                    if (file.first and (size > limit or (typed and file.second.size() > MAX_FIELD)))
+                    {
+                        Server::streamFile(client_sd, filename, path, 0, UINT64_MAX, typed);
+                        return;
+                    }
+
+                    Message response;
+                    response.setType(0x02);
+                    response.setTyped(typed);
+
+                    if (!file.first)
+                    {
+                        response.setCommand(0x73); // Failed to download file
+                        Server::sendClient(client_sd, response);
+                        return;
+                    }
+
+                    response.setCommand(0x71);
+                    response.addArg(filename);
+                    if (typed)
+                    {
+                        response.addBytes(reinterpret_cast<const uint8_t *>(file.second.data()), file.second.size());
+                    }
+                    else
+                    {
+                        response.addArg(file.second);
+                    }
+                    Server::sendClient(client_sd, response);
+                });
+        });
+}
+
+void Server::streamFile(int client_sd, const std::string &filename, const std::string &path, uint64_t offset, uint64_t length, bool typed)
+{
+    // Opened on the I/O stage, the body is queued once the file is ready
+    io.submit(
+        path,
+        [this, path, offset, length]()
+        {
+            FileSource source;
+
+            // Popular files are sent from the shared mapping
+            source.region = fileCache.get(path);
+            if (source.region)
+            {
+                source.size = source.region->size();
+                return source;
+            }
+
+            struct stat st;
+            source.fd = open(path.c_str(), O_RDONLY);
+            if (source.fd == -1 or fstat(source.fd, &st) == -1)
+            {
+                std::cerr << "Error opening file: " << path << std::endl;
+                if (source.fd != -1)
+                {
+                    close(source.fd);
+                    source.fd = -1;
+                }
+                return source;
+            }
+            source.size = st.st_size;
+
+            // Start reading ahead so sendfile finds the pages cached
+            posix_fadvise(source.fd, offset, length == UINT64_MAX ? 0 : length, POSIX_FADV_WILLNEED);
+            return source;
+        },
+        [this, client_sd, filename, offset, length, typed](const FileSource &source)
+        {
+            Message response;
+            response.setType(0x02);
+            response.setTyped(typed);
+
+            if ((!source.region and source.fd == -1) or offset > source.size)
+            {
+                if (source.fd != -1)
+                {
+                    close(source.fd);
+                }
+                response.setCommand(0x73); // Failed to download file
+                Server::sendClient(client_sd, response);
+                return;
+            }
+
+            // Ranges past the end are cut at the end of the file, a zero length range only sends the header
+            uint64_t count = std::min(length, source.size - offset);
+
+            // Header, then count raw bytes from the mapping or the page cache
+            response.setCommand(0x77);
+            response.addArg(filename);
+            if (typed)
+            {
+                response.addUint(source.size);
+                response.addUint(offset);
+                response.addUint(count);
+            }
+            else
+            {
+                response.addArg(std::to_string(source.size));
+                response.addArg(std::to_string(offset));
+                response.addArg(std::to_string(count));
+            }
+            if (source.region)
+            {
+                Server::sendFile(client_sd, response, source.region, offset, count);
+            }
+            else
+            {
+                Server::sendFile(client_sd, response, source.fd, offset, count);
+            }
+        });
+}
+
+std::string Server::filePath(const std::string &uniqueId, const std::string &hash)
+{
+    // Files stored before the blob store keep their per-upload name
+    if (hash.empty())
     {
-        response.setCommand(0x73); // Failed to download file
-        Server::sendClient(client_sd, response);
-        return;
+        return std::string(UPLOAD_DIR) + "/file_" + uniqueId;
     }
+    return blobs.path(hash);
 }
 
-std::string Server::savefile(std::string filename, std::string contents)
+bool Server::removeFile(const std::string &uniqueId, const std::string &hash)
 {
-    std::string directory = "./files";
-    // Create the directory if it doesn't exist
-    // if (!std::filesystem::exists(directory))
-    // {
-    //     std::filesystem::create_directory(directory); // Create the directory if it doesn't exist
-    // }
+    // Unlinked before the cache entry is dropped, so a racing download can not map it again
+    // Downloads holding the mapping or a descriptor keep reading the old contents
+    std::string path = Server::filePath(uniqueId, hash);
+    bool removed = std::remove(path.c_str()) == 0;
+    fileCache.invalidate(path);
+    return removed;
+}
 
-    // Generate a unique ID
-    std::string uniqueId = generateUniqueId();
-    std::string newFilename = directory + "/file_" + uniqueId;
-    std::ofstream file(newFilename);
+bool Server::releaseFile(const std::string &uniqueId)
+{
+    std::string hash;
+    bool unreferenced;
+    if (!this->db.deleteFile(uniqueId, hash, unreferenced))
+    {
+        return false;
+    }
+    if (unreferenced)
+    {
+        Server::removeFile(uniqueId, hash);
+    }
+    return true;
+}
 
-    // Check if the file is opened successfully
-    if (!file.is_open())
+bool Server::expireFiles()
+{
+    std::vector<std::pair<std::string, std::string>> expired;
+    if (!this->db.getExpiredFiles(RETENTION_MONTHS, expired))
     {
-        std::cerr << "Error opening file: " << newFilename << std::endl;
-        return "";
+        return false;
     }
 
-    // Write the contents to the file
-    file << contents;
+    bool ok = true;
+    for (const auto &[uniqueId, hash] : expired)
+    {
+        ok = Server::releaseFile(uniqueId) and ok;
+    }
+    return ok;
+}
 
-    // Check if writing succeeded
-    if (!file)
+std::string Server::savefile(const std::string &contents, std::string &hash)
+{
+    // Content addressed, the same contents are kept once
+    hash = Hasher::digest(contents);
+    if (!blobs.store(contents, hash))
     {
-        std::cerr << "Error writing to file: " << newFilename << std::endl;
         return "";
     }
 
-    file.close();
-    return uniqueId;
+    // Generate a unique ID
+    return generateUniqueId();
 }
 
-bool Server::getfile(const std::string &uniqueId, std::string &contents)
+bool Server::getfile(const std::string &path, std::string &contents)
 {
-    std::string directory = "./files";
-    std::string filename = directory + "/file_" + uniqueId;
+    std::shared_ptr<const MappedFile> region = fileCache.get(path);
+    if (region)
+    {
+        contents.assign(reinterpret_cast<const char *>(region->data()), region->size());
+        return true;
+    }
+
+    std::string filename = path;
     std::ifstream file(filename);
 
     // Check if the file is opened successfully
@@ -988,22 +1784,6 @@ bool Server::getfile(const std::string &uniqueId, std::string &contents)
 
 std::string Server::generateUniqueId()
 {
-    // Get the current time in milliseconds
-    auto now = std::chrono::high_resolution_clock::now();
-    auto duration = now.time_since_epoch();
-    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
-
-    // Random number generator
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(1000, 9999);
-    
-    // Generate a random number
-    int randomNum = dis(gen);
-
-    // Combine the timestamp and random number to create a unique ID
-    std::stringstream ss;
-    ss << millis << "_" << randomNum;
-
-    return ss.str();
+    // Time ordered, collision free across upload threads
+    return ids.nextBase32();
 }
@@ -1,14 +1,26 @@
 #include "helper.hpp"
+#include "clock.hpp"
 
+#include <ctime>
+
+// Served from the clock service cache, refreshed once per second
 const std::string date_time()
 {
-    time_t t;
-    struct tm *tmp;
-    char buf[100];
-    time(&t);
-    tmp = localtime(&t);
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", tmp);
-    return buf;
+    return ClockService::instance().formatted();
+}
+
+std::string_view date_time(char (&buffer)[CLOCK_TEXT_SIZE])
+{
+    return std::string_view(buffer, ClockService::instance().formatted(buffer));
+}
+
+std::string sent_at_text(int64_t ms)
+{
+    time_t t = ms / 1000;
+    struct tm tm;
+    char buffer[CLOCK_TEXT_SIZE];
+    gmtime_r(&t, &tm);
+    return std::string(buffer, strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm));
 }
 
 [[noreturn]] void throwError(const std::string& errorMessage) {
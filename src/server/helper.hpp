@@ -3,9 +3,16 @@
 #include <string>
 #include <stdexcept>
 #include <iostream>
+#include <string_view>
+
+#include "clock.hpp"
 
 // Function to get the current date and time in the format "DD/MM/YYYY - HH:MMAM/PM"
 const std::string date_time();
+std::string_view date_time(char (&buffer)[CLOCK_TEXT_SIZE]); // Into buffer, for the request path
+
+// Stored sent_at, epoch milliseconds, as "YYYY-MM-DD HH:MM:SS" in UTC for text responses
+std::string sent_at_text(int64_t ms);
 
 // Function to print an error message and throw a runtime error
 [[noreturn]] void throwError(const std::string& errorMessage);
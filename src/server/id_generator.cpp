@@ -0,0 +1,65 @@
+#include "id_generator.hpp"
+#include "clock.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+static const char alphabet[] = "0123456789ABCDEFGHJKMNPQRSTVWXYZ";
+
+IdGenerator::IdGenerator(uint64_t node) : node(node)
+{
+    if (node >= (1u << ID_NODE_BITS))
+    {
+        throw std::runtime_error("Node id out of range: " + std::to_string(node));
+    }
+}
+
+uint64_t IdGenerator::next()
+{
+    uint64_t now = (ClockService::instance().nowMs() - ID_EPOCH_MS) << ID_SEQUENCE_BITS;
+    uint64_t prev = last.load(std::memory_order_relaxed);
+    uint64_t state;
+
+    // A full sequence carries into the next millisecond, the clock catches up later
+    do
+    {
+        state = std::max(now, prev + 1);
+    } while (!last.compare_exchange_weak(prev, state, std::memory_order_relaxed));
+
+    uint64_t ms = state >> ID_SEQUENCE_BITS;
+    uint64_t sequence = state & ((1u << ID_SEQUENCE_BITS) - 1);
+    return ms << (ID_NODE_BITS + ID_SEQUENCE_BITS) | node << ID_SEQUENCE_BITS | sequence;
+}
+
+std::string IdGenerator::toBase32(uint64_t id)
+{
+    // 13 digits of 5 bits cover the 64 bits
+    std::string text(13, '0');
+    for (int i = 12; i >= 0; --i)
+    {
+        text[i] = alphabet[id & 31];
+        id >>= 5;
+    }
+    return text;
+}
+
+bool IdGenerator::fromBase32(const std::string &text, uint64_t &id)
+{
+    if (text.size() != 13 or text[0] > '1')
+    {
+        return false;
+    }
+
+    id = 0;
+    for (char c : text)
+    {
+        const char *digit = std::char_traits<char>::find(alphabet, 32, std::toupper(c));
+        if (!digit)
+        {
+            return false;
+        }
+        id = id << 5 | (digit - alphabet);
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#define ID_EPOCH_MS 1704067200000LL // 2024-01-01T00:00:00Z
+#define ID_NODE_BITS 10
+#define ID_SEQUENCE_BITS 12
+
+// Snowflake style ids: 41 bits of milliseconds since ID_EPOCH_MS, 10 bits of node id, 12 bits of sequence.
+// Ids sort by creation time and never repeat on a node, even across threads
+class IdGenerator
+{
+private:
+    uint64_t node;
+
+    // Last issued (milliseconds << ID_SEQUENCE_BITS | sequence)
+    std::atomic<uint64_t> last{0};
+
+public:
+    explicit IdGenerator(uint64_t node);
+
+    uint64_t next();
+    std::string nextBase32() { return toBase32(next()); }
+
+    // Fixed width Crockford base32, text order matches numeric order
+    static std::string toBase32(uint64_t id);
+    static bool fromBase32(const std::string &text, uint64_t &id);
+};
@@ -27,6 +27,7 @@ CREATE TABLE channel_memberships (
 );
 
 -- Table to store channel messages (messages within channels)
+-- Messages are moved into the shard files (chatapp.msg<N>.db) when the server starts
 CREATE TABLE channel_messages (
     message_id INTEGER PRIMARY KEY AUTOINCREMENT,       -- Unique ID for each message
     sender_id INTEGER NOT NULL,                         -- ID of the client who sent the message
@@ -56,6 +57,7 @@ CREATE TABLE files (
     recipient_id INTEGER,                                -- ID of the client receiving the file (nullable if sent to channel)
     channel_id INTEGER,                                  -- ID of the channel receiving the file (nullable if sent to client)
     uuid CHAR(36) NOT NULL,                              -- UUID of the file (unique identifier)
+    hash TEXT,                                           -- SHA-256 of the contents, key in the blob store
     sent_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,         -- Timestamp of when the file was sent
     FOREIGN KEY (sender_id) REFERENCES clients(client_id) ON DELETE CASCADE,  -- Cascade delete if sender is removed
     FOREIGN KEY (recipient_id) REFERENCES clients(client_id) ON DELETE CASCADE, -- Cascade delete if recipient is removed
@@ -66,6 +68,13 @@ CREATE TABLE files (
     )  -- Ensures file is either sent to a client or to a channel, not both
 );
 
+-- Content addressed file blobs, shared by every files row with the same hash
+CREATE TABLE blobs (
+    hash TEXT PRIMARY KEY,                               -- SHA-256 of the contents
+    size INTEGER NOT NULL,                               -- Size in bytes
+    refcount INTEGER NOT NULL                            -- files rows pointing at this blob
+) WITHOUT ROWID;
+
 -- Create indexes after the table creation
 CREATE INDEX idx_owner_id ON channels(owner_id);
 CREATE INDEX idx_channel_id_memberships ON channel_memberships(channel_id);
@@ -7,7 +7,7 @@ int main(int argc, char const *argv[])
         std::cerr << "Usage: " << argv[0] << " <port>" << std::endl;
         return -1;
     }
-    Server srv("CS744", atoi(argv[1]), 1, 1);
+    Server srv("CS744", atoi(argv[1]), 1, 4);
     srv.startServer();
     return 0;
 }
@@ -0,0 +1,128 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <bit>
+
+void Histogram::record(uint64_t value)
+{
+    size_t idx = std::min<size_t>(std::bit_width(value), BUCKETS - 1);
+    buckets[idx].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::quantile(double q) const
+{
+    uint64_t total = count.load(std::memory_order_relaxed);
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = static_cast<uint64_t>(q * total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen > rank)
+        {
+            return i == 0 ? 0 : (uint64_t(1) << i) - 1;
+        }
+    }
+    return (uint64_t(1) << (BUCKETS - 1)) - 1;
+}
+
+std::string Histogram::summary() const
+{
+    uint64_t n = count.load(std::memory_order_relaxed);
+    uint64_t total = sum.load(std::memory_order_relaxed);
+
+    std::string out = "count=" + std::to_string(n) +
+                      " mean=" + std::to_string(n ? total / n : 0) +
+                      " p50<=" + std::to_string(quantile(0.50)) +
+                      " p99<=" + std::to_string(quantile(0.99)) +
+                      " buckets=";
+
+    bool first = true;
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+        uint64_t c = buckets[i].load(std::memory_order_relaxed);
+        if (c == 0)
+        {
+            continue;
+        }
+
+        if (!first)
+        {
+            out += ",";
+        }
+        out += std::to_string(i == 0 ? 0 : (uint64_t(1) << i) - 1) + ":" + std::to_string(c);
+        first = false;
+    }
+    return out;
+}
+
+Metrics &Metrics::instance()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+Counter &Metrics::counter(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &slot = counters[name];
+    if (!slot)
+    {
+        slot = std::make_unique<Counter>();
+    }
+    return *slot;
+}
+
+Gauge &Metrics::gauge(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &slot = gauges[name];
+    if (!slot)
+    {
+        slot = std::make_unique<Gauge>();
+    }
+    return *slot;
+}
+
+Histogram &Metrics::histogram(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &slot = histograms[name];
+    if (!slot)
+    {
+        slot = std::make_unique<Histogram>();
+    }
+    return *slot;
+}
+
+std::vector<std::string> Metrics::report()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, std::string> lines;
+
+    for (const auto &[name, counter] : counters)
+    {
+        lines[name] = std::to_string(counter->get());
+    }
+    for (const auto &[name, gauge] : gauges)
+    {
+        lines[name] = std::to_string(gauge->get());
+    }
+    for (const auto &[name, histogram] : histograms)
+    {
+        lines[name] = histogram->summary();
+    }
+
+    std::vector<std::string> out;
+    for (const auto &[name, value] : lines)
+    {
+        out.push_back(name + " " + value);
+    }
+    return out;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Monotonic counter
+class Counter
+{
+private:
+    std::atomic<uint64_t> value{0};
+
+public:
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// Point in time value
+class Gauge
+{
+private:
+    std::atomic<int64_t> value{0};
+
+public:
+    void set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+    void add(int64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+    int64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// Lock free histogram with power of two buckets
+// Bucket i counts samples in [2^(i-1), 2^i), bucket 0 counts zeros
+class Histogram
+{
+public:
+    static constexpr size_t BUCKETS = 32;
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+
+public:
+    void record(uint64_t value);
+
+    // Upper bound of the bucket holding the given quantile (0.0 - 1.0)
+    uint64_t quantile(double q) const;
+
+    // "count=.. mean=.. p50<=.. p99<=.. buckets=bound:count,..."
+    std::string summary() const;
+};
+
+// Process wide registry, metrics live as long as the process
+class Metrics
+{
+private:
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Gauge>> gauges;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+
+public:
+    static Metrics &instance();
+
+    Counter &counter(const std::string &name);
+    Gauge &gauge(const std::string &name);
+    Histogram &histogram(const std::string &name);
+
+    // One "<name> <value>" line per metric, sorted by name
+    std::vector<std::string> report();
+};
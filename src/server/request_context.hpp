@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+#include "../protocol/buffer_pool.hpp"
+
+class Batch;
+struct CompressionStats;
+
+// Request handled by the current thread, its responses echo the correlation id
+// Completions run on other threads carry the context of the request that submitted them
+struct RequestContext
+{
+    int client_sd = -1;
+    uint64_t connection = 0; // Connection of client_sd the request came on, 0 outside of requests
+    bool correlated = false;
+    uint32_t correlation = 0;
+    const char *command = nullptr; // Name of the request, for per command metrics
+    const CompressionStats *compression = nullptr; // Compression metrics of the command, see Server::frames
+    size_t reserve = 0;            // Payload bytes its responses start with, see BufferPool::hint()
+
+    std::shared_ptr<Batch> batch; // Collects the responses while handling a sub-request of a batch
+    size_t slot = 0;              // Position of the sub-request in its batch
+
+    static RequestContext &current()
+    {
+        thread_local RequestContext context;
+        return context;
+    }
+};
+
+// Installs a request context, and its buffer size hint, until the end of the scope
+class RequestScope
+{
+private:
+    RequestContext saved;
+    size_t savedHint;
+
+public:
+    explicit RequestScope(const RequestContext &context) : saved(RequestContext::current()), savedHint(BufferPool::hint())
+    {
+        RequestContext::current() = context;
+        BufferPool::hint() = context.reserve;
+    }
+    ~RequestScope()
+    {
+        RequestContext::current() = saved;
+        BufferPool::hint() = savedHint;
+    }
+
+    RequestScope(const RequestScope &) = delete;
+    RequestScope &operator=(const RequestScope &) = delete;
+};
@@ -1,8 +1,8 @@
 #include "server.hpp"
 
 Server::Server(const std::string &_name, int port, int threadPoolSize, int dbPoolSize)
-    : name(std::move(_name)), channels(), clients(), epoll_fd(-1), events(),
-      db("chatapp.db", dbPoolSize), pool(threadPoolSize)
+    : name(std::move(_name)), pool(threadPoolSize), channels(), clients(), epoll_fd(-1), events(),
+      db("chatapp.db", dbPoolSize), users(db), dbExec(dbPoolSize, pool), ids(NODE_ID), blobs(BLOB_DIR), fileCache(FILE_CACHE_BYTES), io(FILE_IO_THREADS, pool)
 {
     createSocket(port);
 }
@@ -80,9 +80,25 @@ void Server::initChannels(void)
     }
 }
 
+void Server::startArchiver(void)
+{
+    // Periodic archive job, runs on the database executor like any other query
+    std::thread([this]()
+                {
+                    while (true)
+                    {
+                        dbExec.submit([this]()
+                                      { return db.maintainArchive(RETENTION_MONTHS) and (RETENTION_MONTHS == 0 or Server::expireFiles()); });
+                        std::this_thread::sleep_for(std::chrono::seconds(ARCHIVE_INTERVAL_S));
+                    } })
+        .detach();
+}
+
 void Server::startServer(void)
 {
     initChannels();
+    users.load();
+    startArchiver();
 
     std::cout << "Server started" << std::endl;
 
@@ -122,10 +138,18 @@ void Server::startServer(void)
                 pool.enqueueTask([this]()
                                  { addClient(); });
             }
-            else if (this->events[i].events & EPOLLIN)
+            else
             {
-                pool.enqueueTask([this, fd]()
-                                 { clientRequest(fd); });
+                if (this->events[i].events & EPOLLOUT)
+                {
+                    pool.enqueueTask([this, fd]()
+                                     { flushClient(fd); });
+                }
+                if (this->events[i].events & EPOLLIN)
+                {
+                    pool.enqueueTask([this, fd]()
+                                     { clientRequest(fd); });
+                }
             }
         }
     }
@@ -172,7 +196,7 @@ void Server::addClient()
             events.resize(events.size() * 2);
         }
 
-        auto client = std::make_unique<Client>(newSd, newSockAddr);
+        auto client = std::make_shared<Client>(newSd, newSockAddr, ++connections);
 
         this->clients[newSd] = std::move(client);
     }
@@ -197,55 +221,394 @@ void Server::removeClient(int client_sd)
 
 void Server::clientRequest(int client_sd)
 {
-    std::vector<uint8_t> buffer(1024);
-    ssize_t sz = recv(client_sd, buffer.data(), buffer.size(), 0);
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    if (!client)
+    {
+        return;
+    }
 
-    if (sz == 0)
+    bool hungUp = false;
+    {
+        std::lock_guard<std::mutex> lock(client->readMutex);
+        std::vector<uint8_t> &buffer = client->readBuffer;
+
+        // Edge triggered, drain the socket
+        uint8_t chunk[16384];
+        while (true)
+        {
+            ssize_t sz = recv(client_sd, chunk, sizeof(chunk), 0);
+            if (sz > 0)
+            {
+                buffer.insert(buffer.end(), chunk, chunk + sz);
+                continue;
+            }
+
+            if (sz == 0)
+            {
+                // Client disconnected
+                std::cerr << std::format("[{}]: socket {} hung up\n", date_time(), client_sd);
+                hungUp = true;
+            }
+            else if (errno != EAGAIN and errno != EWOULDBLOCK)
+            {
+                // recv() error occurred
+                std::cerr << std::format("recv() error: {}\n", strerror(errno));
+                hungUp = true;
+            }
+            break;
+        }
+
+        // Handle every complete frame, keep the partial one for the next read
+        size_t used = 0;
+        while (!hungUp)
+        {
+            size_t size;
+            MessageView msg;
+            try
+            {
+                std::shared_ptr<const Session> session = client->session.load();
+                size_t limit = session->maxFrame ? session->maxFrame : MAX_PAYLOAD;
+                size = Message::frameSize(buffer.data() + used, buffer.size() - used, limit, session->cipher.get());
+                if (size == 0)
+                {
+                    break;
+                }
+
+                // Decoded in place, arguments are views into the read buffer
+                msg = MessageView::decode(buffer.data() + used, size, session->cipher.get());
+            }
+            catch (const std::exception &e)
+            {
+                // The stream can not be resynchronised
+                std::cerr << std::format("Deserialisation Error: {}\n", e.what());
+                hungUp = true;
+                break;
+            }
+            used += size;
+
+            // Only responses are compressed
+            if (msg.getType() != 0x01 or msg.isCompressed())
+            {
+                std::cout << std::format("{}: invalid request\n", client_sd);
+                continue;
+            }
+
+            // Continued frames are joined before the request is handled
+            if (client->continuing or msg.isContinued())
+            {
+                if (!client->continuing)
+                {
+                    client->continued = msg.toMessage();
+                    client->continuing = true;
+                }
+                else
+                {
+                    client->continued.append(msg.toMessage());
+                }
+
+                if (client->continued.getPayload().size() > MAX_MESSAGE)
+                {
+                    std::cerr << std::format("{}: continued request too large\n", client_sd);
+                    hungUp = true;
+                    break;
+                }
+                if (client->continued.isContinued())
+                {
+                    continue;
+                }
+
+                client->continuing = false;
+                Server::handleRequest(client_sd, client->continued.view());
+                client->continued = Message();
+                continue;
+            }
+
+            Server::handleRequest(client_sd, msg);
+        }
+        buffer.erase(buffer.begin(), buffer.begin() + used);
+    }
+
+    if (hungUp)
     {
-        // Client disconnected
-        std::cerr << std::format("[{}]: socket {} hung up\n", date_time(), client_sd);
         Server::removeClient(client_sd);
+    }
+}
+
+// Message relayed to a client, not an answer to the current request even when it goes to the same client:
+// it carries no correlation id and is not held back by a batch
+void Server::pushClient(int client_sd, const Message &msg)
+{
+    // Nothing written by a rolled back batch is relayed
+    RequestContext push = RequestContext::current();
+    if (push.batch and push.batch->isFailed())
+    {
         return;
     }
-    else if (sz < 0)
+
+    push.correlated = false;
+    push.batch = nullptr;
+    RequestScope scope(push);
+    Server::sendClient(client_sd, msg);
+}
+
+void Server::sendClient(int client_sd, const Message &msg)
+{
+    // Responses to a sub-request of a batch go out together with the batch
+    const RequestContext &context = RequestContext::current();
+    if (context.batch and context.client_sd == client_sd and msg.getType() == 0x02)
     {
-        // recv() error occurred
-        std::cerr << std::format("recv() error: {}\n", strerror(errno));
-        Server::removeClient(client_sd);
+        context.batch->add(context.slot, msg);
+        return;
+    }
+
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    if (!client)
+    {
+        // Client left before an asynchronous reply was ready
         return;
     }
 
-    Message msg;
+    Outbound out;
     try
     {
-        msg = Message::deserialize(buffer);
+        out.bytes = Server::frames(client.get(), msg);
     }
     catch (const std::exception &e)
     {
-        std::cerr << std::format("Deserialisation Error: {}\n", e.what());
+        // Too large for the frames of the client, it gets an error in place of the response
+        std::cerr << std::format("Serialisation Error: {}\n", e.what());
+        Message error;
+        error.setType(0x02);
+        error.setCommand(0x01); // Server Side Error
+        out.bytes = Server::frames(client.get(), error);
+    }
+
+    std::lock_guard<std::mutex> lock(client->mutex);
+    client->outbox.push_back(std::move(out));
+    Server::flush(client.get());
+}
+
+std::vector<uint8_t> Server::frames(Client *client, const Message &msg)
+{
+    std::shared_ptr<const Session> session = client->session.load();
+    FrameStats stats;
+    FrameOptions options = session->frameOptions(&stats);
+
+    // Only answers to the client of the current request carry its id, not messages relayed to others
+    const RequestContext &context = RequestContext::current();
+    std::vector<uint8_t> bytes;
+    if (context.correlated and session->has(FEATURE_CORRELATION) and context.client_sd == client->getClientfd() and msg.getType() == 0x02)
+    {
+        bytes = msg.serialize(options, context.correlation);
+    }
+    else
+    {
+        bytes = msg.serialize(options);
+    }
+
+    // Ratio and cost of compression, by the request that caused the frames
+    if (stats.raw > 0)
+    {
+        static const CompressionStats other = CompressionStats::lookup("other");
+        const CompressionStats &metrics = context.compression ? *context.compression : other;
+        metrics.raw->add(stats.raw);
+        metrics.sent->add(stats.compressed);
+        metrics.ratio->set(metrics.sent->get() * 100 / std::max<uint64_t>(metrics.raw->get(), 1));
+        metrics.ns->record(stats.ns);
+    }
+    return bytes;
+}
+
+CompressionStats CompressionStats::lookup(const std::string &command)
+{
+    std::string name = "compress." + command;
+    Metrics &metrics = Metrics::instance();
+    return {&metrics.counter(name + ".raw_bytes"), &metrics.counter(name + ".sent_bytes"),
+            &metrics.gauge(name + ".ratio_pct"), &metrics.histogram(name + "_ns")};
+}
+
+void Server::sendFile(int client_sd, const Message &header, int fd, off_t offset, size_t length)
+{
+    Outbound body;
+    body.fd = fd;
+    body.offset = offset;
+    body.remaining = length;
+    Server::sendBody(client_sd, header, std::move(body));
+}
+
+void Server::sendFile(int client_sd, const Message &header, std::shared_ptr<const MappedFile> region, off_t offset, size_t length)
+{
+    Outbound body;
+    body.region = std::move(region);
+    body.offset = offset;
+    body.remaining = length;
+    Server::sendBody(client_sd, header, std::move(body));
+}
+
+void Server::sendBody(int client_sd, const Message &header, Outbound body)
+{
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    if (!client)
+    {
+        if (body.fd != -1)
+        {
+            close(body.fd);
+        }
         return;
     }
 
-    if (msg.getType() != 0x01)
+    Outbound head;
+    try
+    {
+        head.bytes = Server::frames(client.get(), header);
+    }
+    catch (const std::exception &e)
     {
-        std::cout << std::format("{}: invalid request\n", client_sd);
+        std::cerr << std::format("Serialisation Error: {}\n", e.what());
+        if (body.fd != -1)
+        {
+            close(body.fd);
+        }
+
+        Message error;
+        error.setType(0x02);
+        error.setCommand(0x01); // Server Side Error
+        Server::sendClient(client_sd, error);
         return;
     }
 
-    std::cout << std::format("{}: Request Code: {}\n", client_sd, msg.getCommand());
-    Server::handleRequest(client_sd, msg);
+    // Header and body are queued together, no other frame can land inside the body
+    std::lock_guard<std::mutex> lock(client->mutex);
+    client->outbox.push_back(std::move(head));
+    client->outbox.push_back(std::move(body));
+    Server::flush(client.get());
 }
 
-void Server::sendClient(int client_sd, const Message &msg)
+void Server::flushClient(int client_sd)
 {
-    Client *client = Server::getClient(client_sd);
+    std::shared_ptr<Client> client = Server::getClient(client_sd);
+    if (!client)
+    {
+        return;
+    }
+
     std::lock_guard<std::mutex> lock(client->mutex);
+    Server::flush(client.get());
+}
 
-    std::vector<uint8_t> requestData = msg.serialize();
-    ssize_t bytesSent = send(client_sd, requestData.data(), requestData.size(), 0);
-    if (bytesSent < 0)
+void Server::flush(Client *client)
+{
+    int client_sd = client->getClientfd();
+
+    while (!client->outbox.empty())
     {
-        std::cerr << "Error sending request to client" << std::endl;
+        Outbound &out = client->outbox.front();
+
+        ssize_t n;
+        if (out.region)
+        {
+            // Shared mapping, no per download open or read
+            n = out.remaining ? send(client_sd, out.region->data() + out.offset, out.remaining, MSG_NOSIGNAL) : 0;
+        }
+        else if (out.fd == -1)
+        {
+            n = send(client_sd, out.bytes.data() + out.sent, out.bytes.size() - out.sent, MSG_NOSIGNAL);
+        }
+        else
+        {
+            // Page cache to socket, the file never enters user space
+            n = out.remaining ? sendfile(client_sd, out.fd, &out.offset, out.remaining) : 0;
+        }
+
+        if (n < 0)
+        {
+            if (errno == EAGAIN or errno == EWOULDBLOCK)
+            {
+                // Socket buffer full, continue once it drains
+                if (!client->writeArmed)
+                {
+                    struct epoll_event ev;
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+                    ev.data.fd = client_sd;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_sd, &ev);
+                    client->writeArmed = true;
+                }
+                return;
+            }
+
+            std::cerr << "Error sending request to client" << std::endl;
+            for (Outbound &pending : client->outbox)
+            {
+                if (pending.fd != -1)
+                {
+                    close(pending.fd);
+                }
+            }
+            client->outbox.clear();
+            return;
+        }
+
+        bool done;
+        if (out.region)
+        {
+            out.offset += n;
+            out.remaining -= n;
+            done = out.remaining == 0;
+        }
+        else if (out.fd == -1)
+        {
+            out.sent += n;
+            done = out.sent == out.bytes.size();
+        }
+        else
+        {
+            // sendfile advanced the offset, 0 means the file ended early
+            out.remaining = n == 0 ? 0 : out.remaining - n;
+            done = out.remaining == 0;
+            if (done)
+            {
+                close(out.fd);
+            }
+        }
+
+        if (done)
+        {
+            // Frames go back to the pool of the sending thread, usually the one that built them
+            BufferPool::give(std::move(out.bytes));
+            client->outbox.pop_front();
+        }
+    }
+
+    if (client->writeArmed)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = client_sd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_sd, &ev);
+        client->writeArmed = false;
+    }
+}
+
+void Server::broadcast(Channel *channel, int sender_sd, const Message &msg)
+{
+    std::vector<int> recipients;
+
+    // Collect all clients who are members of the channel (excluding the sender)
+    {
+        std::lock_guard<std::mutex> lock(this->clientsMutex);
+
+        for (auto &[client_id, client_ptr] : clients)
+        {
+            if (channel->isMember(client_ptr->getID()) and client_ptr->isAuthenticated() and sender_sd != client_ptr->getClientfd())
+            {
+                recipients.push_back(client_id);
+            }
+        }
+    }
+
+    for (int recipient_sd : recipients)
+    {
+        Server::pushClient(recipient_sd, msg);
     }
 }
 
@@ -277,8 +640,35 @@ Channel *Server::getChannelById(int channel_id)
     return nullptr;
 }
 
-Client *Server::getClient(int client_sd)
+std::shared_ptr<Client> Server::getClient(int client_sd)
 {
     std::lock_guard<std::mutex> lock(this->clientsMutex);
-    return this->clients[client_sd].get();
+
+    auto it = this->clients.find(client_sd);
+    if (it == this->clients.end())
+    {
+        return nullptr;
+    }
+
+    // Descriptors are reused, a completion of a request from a closed connection must not reach the next one
+    const RequestContext &context = RequestContext::current();
+    if (context.connection and context.client_sd == client_sd and it->second->getConnection() != context.connection)
+    {
+        return nullptr;
+    }
+    return it->second;
+}
+
+int Server::getClientSdById(int client_id)
+{
+    std::lock_guard<std::mutex> lock(this->clientsMutex);
+
+    for (auto &[client_sd, client_ptr] : clients)
+    {
+        if (client_ptr->getID() == client_id)
+        {
+            return client_sd;
+        }
+    }
+    return -1;
 }
\ No newline at end of file
@@ -13,6 +13,8 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <fstream>
 #include <chrono>
 #include <random>
@@ -23,7 +25,32 @@
 #include "client.hpp"
 #include "channel.hpp"
 #include "database.hpp"
+#include "user_directory.hpp"
+#include "db_executor.hpp"
+#include "metrics.hpp"
+#include "id_generator.hpp"
+#include "transfer.hpp"
+#include "file_cache.hpp"
+#include "file_io.hpp"
+#include "command.hpp"
+#include "request_context.hpp"
+#include "batch.hpp"
 #include "../protocol/message.hpp"
+#include "../protocol/schema.hpp"
+
+#define ARCHIVE_INTERVAL_S 3600 // Seconds between message archive runs
+#define NODE_ID 0               // Id generator node, unique per server instance
+
+// Compression metrics of the responses of one command, looked up once per command
+struct CompressionStats
+{
+    Counter *raw;
+    Counter *sent;
+    Gauge *ratio;
+    Histogram *ns;
+
+    static CompressionStats lookup(const std::string &command);
+};
 
 class Server
 {
@@ -33,7 +60,8 @@ private:
     ThreadPool pool;
 
     std::map<int, std::unique_ptr<Channel>> channels;
-    std::map<int, std::unique_ptr<Client>> clients;
+    std::map<int, std::shared_ptr<Client>> clients; // Completions hold on to their client until they are done
+    uint64_t connections = 0;                        // Connections accepted so far, guarded by clientsMutex
 
     std::mutex channelsMutex;
     std::mutex clientsMutex;
@@ -42,11 +70,19 @@ private:
     std::vector<struct epoll_event> events;
 
     Database db;
+    UserDirectory users;
+    DbExecutor dbExec;
+    IdGenerator ids;
+    TransferTable transfers;
+    BlobStore blobs;
+    FileCache fileCache;
+    FileIo io;
 
 private:
     // Initialisation Function
     void createSocket(int port);
     void initChannels(void);
+    void startArchiver(void);
 
 public:
     Server(const std::string &name, int port, int threadPoolSize, int dbPoolSize);
@@ -58,37 +94,64 @@ public:
     void removeClient(int client_sd);
     void clientRequest(int fd);
     void sendClient(int client_sd, const Message &msg);
+    void pushClient(int client_sd, const Message &msg);
+    void sendFile(int client_sd, const Message &header, int fd, off_t offset, size_t length);
+    void sendFile(int client_sd, const Message &header, std::shared_ptr<const MappedFile> region, off_t offset, size_t length);
+    void sendBody(int client_sd, const Message &header, Outbound body);
+    std::vector<uint8_t> frames(Client *client, const Message &msg);
+    void flushClient(int client_sd);
+    void flush(Client *client);
+    void broadcast(Channel *channel, int sender_sd, const Message &msg);
 
     // Handlers
-    void handleRequest(int client_sd, Message &msg);
+    void handleRequest(int client_sd, const MessageView &msg);
+    void dispatch(int client_sd, const MessageView &msg, bool batched);
 
     // User operations
-    void login(int client_sd, Message &msg);
-    // void register_(int client_sd, Message &msg);
+    void hello(int client_sd, const MessageView &msg);
+    void batch(int client_sd, const MessageView &msg);
+    void setDictionary(int client_sd, const MessageView &msg);
+    void login(int client_sd, const MessageView &msg);
+    void setNickname(int client_sd, const MessageView &msg);
+    // void register_(int client_sd, const MessageView &msg);
     
     // Message handler
-    void channelMsg(int client_sd, Message &msg);
-    void getChannelMsg(int cliend_sd, Message &msg);
-    void userMsg(int client_sd, Message &msg);
-    void getUserMsg(int cliend_sd, Message &msg);
+    void channelMsg(int client_sd, const MessageView &msg);
+    void getChannelMsg(int cliend_sd, const MessageView &msg);
+    void userMsg(int client_sd, const MessageView &msg);
+    void getUserMsg(int cliend_sd, const MessageView &msg);
+    void searchMsg(int client_sd, const MessageView &msg);
 
-    void joinChannel(int cliend_sd, Message &msg);
+    void joinChannel(int cliend_sd, const MessageView &msg);
 
     // Non Database operations
-    void listChannels(int client_sd, Message &msg);
-    void listOnlineUsers(int client_sd, Message &msg);
+    void listChannels(int client_sd, const MessageView &msg);
+    void listOnlineUsers(int client_sd, const MessageView &msg);
+    void getStats(int client_sd, const MessageView &msg);
     void invalidCommand(int client_sd);
 
     // File transfer
     std::string generateUniqueId();
-    void upload(int client_sd, Message &msg);
-    void download(int client_sd, Message &msg);
-    std::string savefile(std::string filename, std::string contents);
-    bool getfile(const std::string& uniqueId, std::string& contents);
+    void upload(int client_sd, const MessageView &msg);
+    void openUpload(int client_sd, int client_id, int channel_id, const std::string &name, const std::string &filename, uint64_t total, const std::string &transfer_id);
+    void uploadChunk(int client_sd, const MessageView &msg);
+    void uploadEnd(int client_sd, const MessageView &msg);
+    std::tuple<int, int, std::string> recordUpload(int client_id, int channel_id, int recipient_id, const std::string &filename, const std::string &uid_file, const std::string &hash, uint64_t size);
+    void uploadDone(int client_sd, Channel *channel, const std::string &sender, const std::tuple<int, int, std::string> &result);
+    void download(int client_sd, const MessageView &msg);
+    void streamFile(int client_sd, const std::string &filename, const std::string &path, uint64_t offset, uint64_t length, bool typed);
+    std::string filePath(const std::string &uniqueId, const std::string &hash);
+    bool removeFile(const std::string &uniqueId, const std::string &hash); // Once no files row refers to it, drops its cached mapping too
+    bool releaseFile(const std::string &uniqueId);                         // Delete the row, and the stored file once unreferenced
+    bool expireFiles();                                                    // Files sent before the retention window, with their messages
+    std::string savefile(const std::string &contents, std::string &hash);
+    bool getfile(const std::string &path, std::string &contents);
 
     // Others
     Channel *getChannel(const std::string &channel_name);
     Channel *getChannelById(int channel_id);
-    Client *getClient(int client_sd);
+    // nullptr once the client left, or when the descriptor now belongs to a later connection than the current request's
+    std::shared_ptr<Client> getClient(int client_sd);
+    int getClientSdById(int client_id);
 
 };
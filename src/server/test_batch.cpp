@@ -0,0 +1,197 @@
+// Batch test: a batch whose commit fails is answered 0x01 and relays nothing to other clients
+// Usage: ./test_batch, run from src/server, it works on a copy of chatapp.db in a temporary directory
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <poll.h>
+#include <sqlite3.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "server.hpp"
+
+// Every commit of the process fails while set, as a full disk or I/O error at COMMIT would
+static std::atomic<bool> failCommits{false};
+
+static int commitHook(void *)
+{
+    return failCommits.load() ? 1 : 0;
+}
+
+static int installHook(sqlite3 *db, const char **, const sqlite3_api_routines *)
+{
+    sqlite3_commit_hook(db, commitHook, nullptr);
+    return SQLITE_OK;
+}
+
+// Connection speaking version 1 frames
+class TestClient
+{
+private:
+    int sd;
+    std::vector<uint8_t> buffer;
+
+public:
+    explicit TestClient(int port) : sd(socket(AF_INET, SOCK_STREAM, 0))
+    {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(sd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            throw std::runtime_error("Can not connect to the test server");
+        }
+    }
+    ~TestClient() { close(sd); }
+
+    void send(const Message &msg)
+    {
+        std::vector<uint8_t> frame = msg.serialize();
+        ::send(sd, frame.data(), frame.size(), MSG_NOSIGNAL);
+    }
+
+    // Next message, nothing once timeoutMs passed without one
+    std::optional<Message> receive(int timeoutMs)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        while (true)
+        {
+            if (size_t size = Message::frameSize(buffer.data(), buffer.size()))
+            {
+                Message msg = Message::deserialize(buffer.data(), size);
+                buffer.erase(buffer.begin(), buffer.begin() + size);
+                return msg;
+            }
+
+            int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            pollfd p{sd, POLLIN, 0};
+            if (left <= 0 or poll(&p, 1, left) <= 0)
+            {
+                return std::nullopt;
+            }
+            uint8_t chunk[4096];
+            ssize_t n = recv(sd, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+            {
+                return std::nullopt;
+            }
+            buffer.insert(buffer.end(), chunk, chunk + n);
+        }
+    }
+
+    // Send a request and return the command of its answer, -1 without one
+    int request(int command, const std::vector<std::string> &args)
+    {
+        Message msg;
+        msg.setType(0x01);
+        msg.setCommand(command);
+        for (const std::string &arg : args)
+        {
+            msg.addArg(arg);
+        }
+        send(msg);
+        std::optional<Message> answer = receive(2000);
+        return answer ? answer->getCommand() : -1;
+    }
+};
+
+static Message channelBatch(const std::string &text)
+{
+    Message sub;
+    sub.setType(0x01);
+    sub.setCommand(0x30);
+    sub.addArg("#chat");
+    sub.addArg(text);
+
+    BatchRequest batch;
+    batch.requests.push_back(batchEntry(sub));
+
+    Message msg;
+    msg.setType(0x01);
+    msg.setCommand(0x02);
+    msg.setBody(batch);
+    return msg;
+}
+
+// Commands answering the one sub-request of a 0x04, empty when the answer is not a 0x04
+static std::vector<uint32_t> batchAnswer(const std::optional<Message> &msg)
+{
+    BatchResponse response;
+    std::vector<uint32_t> commands;
+    if (msg and msg->getCommand() == 0x04 and msg->getBody(response) and response.results.size() == 1)
+    {
+        for (const BatchEntry &entry : response.results[0].responses)
+        {
+            commands.push_back(entry.command);
+        }
+    }
+    return commands;
+}
+
+int main()
+{
+    namespace fs = std::filesystem;
+    fs::path source = fs::absolute("chatapp.db");
+    fs::path dir = fs::temp_directory_path() / ("test_batch." + std::to_string(getpid()));
+    fs::create_directories(dir);
+    fs::copy_file(source, dir / "chatapp.db");
+    fs::current_path(dir);
+
+    sqlite3_auto_extension(reinterpret_cast<void (*)()>(installHook));
+
+    int port = 20000 + getpid() % 20000;
+    Server *server = new Server("test", port, 2, 2);
+    std::thread([server]()
+                { server->startServer(); })
+        .detach();
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    int failures = 0;
+    auto check = [&](bool ok, const std::string &what)
+    {
+        if (!ok)
+        {
+            std::cerr << "FAIL: " << what << std::endl;
+            ++failures;
+        }
+    };
+
+    {
+        std::string suffix = std::to_string(getpid());
+        TestClient sender(port), member(port);
+        int login = sender.request(0x10, {"sender" + suffix, "pw"});
+        check(login == 0x10 or login == 0x11, "sender logs in");
+        login = member.request(0x10, {"member" + suffix, "pw"});
+        check(login == 0x10 or login == 0x11, "member logs in");
+        sender.request(0x40, {"#chat"});
+        member.request(0x40, {"#chat"});
+
+        // The commit of the batch fails: the sender gets 0x01, the member is not told about the message
+        failCommits = true;
+        sender.send(channelBatch("rolled back"));
+        check(batchAnswer(sender.receive(2000)) == std::vector<uint32_t>{0x01}, "failed batch is answered 0x01");
+        check(!member.receive(500), "nothing is relayed from a failed batch");
+        failCommits = false;
+
+        // Committed, the message reaches the member
+        sender.send(channelBatch("committed"));
+        check(batchAnswer(sender.receive(2000)) == std::vector<uint32_t>{0x30}, "batch is answered 0x30");
+        std::optional<Message> relayed = member.receive(2000);
+        check(relayed and relayed->getCommand() == 0x33, "committed message is relayed");
+    }
+
+    fs::current_path(source.parent_path());
+    fs::remove_all(dir);
+    std::cout << (failures ? "FAILED" : "OK") << std::endl;
+
+    // The server runs until the process ends
+    std::_Exit(failures);
+}
@@ -0,0 +1,104 @@
+#include "transfer.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <iostream>
+
+Transfer::Transfer(const std::string &id, int clientId, int channelId, int recipientId, const std::string &filename, uint64_t size)
+    : id(id), clientId(clientId), channelId(channelId), recipientId(recipientId), filename(filename),
+      size(size), accepted(0), touched(std::chrono::steady_clock::now()),
+      offset(0), acked(0), fd(-1), failed(false)
+{
+}
+
+Transfer::~Transfer()
+{
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+std::string Transfer::partPath() const
+{
+    return std::string(UPLOAD_DIR) + "/file_" + id + ".part";
+}
+
+bool Transfer::write(const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0)
+        {
+            std::cerr << "Error writing to file: " << partPath() << std::endl;
+            return false;
+        }
+        hasher.update(data, n);
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+std::shared_ptr<Transfer> TransferTable::open(const std::string &id, int clientId, int channelId, int recipientId, const std::string &filename, uint64_t size)
+{
+    auto transfer = std::make_shared<Transfer>(id, clientId, channelId, recipientId, filename, size);
+
+    transfer->fd = ::open(transfer->partPath().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (transfer->fd == -1)
+    {
+        std::cerr << "Error opening file: " << transfer->partPath() << std::endl;
+        return nullptr;
+    }
+
+    // Contiguous extents up front, best effort on filesystems without support
+    if (size > 0)
+    {
+        fallocate(transfer->fd, FALLOC_FL_KEEP_SIZE, 0, size);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    transfers[id] = transfer;
+    return transfer;
+}
+
+std::shared_ptr<Transfer> TransferTable::find(const std::string &id, int clientId)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = transfers.find(id);
+    if (it == transfers.end() or it->second->clientId != clientId)
+    {
+        return nullptr;
+    }
+    return it->second;
+}
+
+void TransferTable::remove(const std::string &id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    transfers.erase(id);
+}
+
+void TransferTable::expire()
+{
+    auto deadline = std::chrono::steady_clock::now() - std::chrono::seconds(UPLOAD_TTL_S);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = transfers.begin(); it != transfers.end();)
+    {
+        std::unique_lock<std::mutex> busy(it->second->mutex, std::try_to_lock);
+        if (busy and it->second->touched < deadline)
+        {
+            std::remove(it->second->partPath().c_str());
+            busy.unlock();
+            it = transfers.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
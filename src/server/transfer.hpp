@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "blob_store.hpp"
+
+#define UPLOAD_DIR "./files"
+#define BLOB_DIR UPLOAD_DIR "/blobs"
+#define UPLOAD_ACK_BYTES (64 * 1024) // Bytes written between two chunk acknowledgements
+#define UPLOAD_TTL_S 3600            // Idle uploads are dropped after this long
+
+// Streaming upload, written to <UPLOAD_DIR>/file_<id>.part as chunks arrive
+struct Transfer
+{
+    std::string id;
+    int clientId;    // Owner, the only client allowed to resume it
+    int channelId;   // 0 for a private upload
+    int recipientId; // 0 for a channel upload
+    std::string filename;
+    uint64_t size;
+    uint64_t accepted; // Bytes received and queued for writing, guarded by mutex
+    std::chrono::steady_clock::time_point touched;
+    std::mutex mutex;
+
+    // Owned by the file I/O thread of this transfer
+    uint64_t offset; // Bytes on disk
+    uint64_t acked;  // Offset of the last acknowledgement
+    int fd;
+    Hasher hasher;   // Content hash, chunks are written in order
+    std::atomic<bool> failed;
+
+    Transfer(const std::string &id, int clientId, int channelId, int recipientId, const std::string &filename, uint64_t size);
+    ~Transfer();
+
+    std::string partPath() const;
+
+    // Write a chunk at the current offset
+    bool write(const uint8_t *data, size_t size);
+};
+
+// Open uploads by transfer id, kept across reconnects so they can be resumed
+class TransferTable
+{
+private:
+    std::map<std::string, std::shared_ptr<Transfer>> transfers;
+    std::mutex mutex;
+
+public:
+    // Create the part file, preallocated to the declared size, and register the upload
+    std::shared_ptr<Transfer> open(const std::string &id, int clientId, int channelId, int recipientId, const std::string &filename, uint64_t size);
+
+    // Upload owned by the client, nullptr when unknown
+    std::shared_ptr<Transfer> find(const std::string &id, int clientId);
+
+    void remove(const std::string &id);
+
+    // Drop uploads idle for UPLOAD_TTL_S and their part files
+    void expire();
+};
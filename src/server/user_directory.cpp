@@ -0,0 +1,196 @@
+#include "user_directory.hpp"
+
+UserDirectory::UserDirectory(Database &db) : db(db) {}
+
+UserDirectory::Shard &UserDirectory::shardFor(const std::string &username)
+{
+    return shards[std::hash<std::string>{}(username) % SHARDS];
+}
+
+const UserDirectory::Shard &UserDirectory::shardFor(const std::string &username) const
+{
+    return shards[std::hash<std::string>{}(username) % SHARDS];
+}
+
+void UserDirectory::load()
+{
+    std::vector<std::tuple<int, std::string, std::string>> rows;
+    if (!db.getAllClients(rows))
+    {
+        std::cerr << "Failed to load users into the directory" << std::endl;
+        return;
+    }
+
+    for (const auto &[client_id, username, nickname] : rows)
+    {
+        insert(client_id, username, nickname);
+    }
+}
+
+void UserDirectory::indexNickname(int client_id, const Name &previous, const std::string &nickname)
+{
+    if (previous and *previous != nickname)
+    {
+        auto it = nicknames.find(*previous);
+        if (it != nicknames.end() and it->second == client_id)
+        {
+            nicknames.erase(it);
+        }
+    }
+    if (!nickname.empty())
+    {
+        nicknames[nickname] = client_id;
+    }
+}
+
+void UserDirectory::insert(int client_id, const std::string &username, const std::string &nickname)
+{
+    if (client_id <= 0)
+    {
+        return;
+    }
+
+    {
+        std::unique_lock<std::shared_mutex> lock(entriesMutex);
+
+        if (entries.size() <= static_cast<size_t>(client_id))
+        {
+            entries.resize(client_id + 1);
+        }
+
+        Entry &entry = entries[client_id];
+        indexNickname(client_id, entry.nickname, nickname);
+        entry.username = std::make_shared<const std::string>(username);
+        entry.nickname = std::make_shared<const std::string>(nickname);
+    }
+
+    Shard &shard = shardFor(username);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    shard.ids[username] = client_id;
+}
+
+bool UserDirectory::find(const std::string &username, int &client_id) const
+{
+    const Shard &shard = shardFor(username);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+
+    auto it = shard.ids.find(username);
+    if (it == shard.ids.end())
+    {
+        return false;
+    }
+
+    client_id = it->second;
+    return true;
+}
+
+bool UserDirectory::resolve(const std::string &username, int &client_id)
+{
+    if (find(username, client_id))
+    {
+        return true;
+    }
+
+    // Not cached, the user may have been created by someone else
+    std::string password, nickname;
+    if (!db.getClientByUsername(username, client_id, password, nickname))
+    {
+        return false;
+    }
+
+    insert(client_id, username, nickname);
+    return true;
+}
+
+bool UserDirectory::fetchById(int client_id)
+{
+    std::string username, password, nickname;
+    if (!db.getClientById(client_id, username, password, nickname))
+    {
+        return false;
+    }
+
+    insert(client_id, username, nickname);
+    return true;
+}
+
+UserDirectory::Name UserDirectory::username(int client_id)
+{
+    {
+        std::shared_lock<std::shared_mutex> lock(entriesMutex);
+        if (client_id > 0 && static_cast<size_t>(client_id) < entries.size() && entries[client_id].username)
+        {
+            return entries[client_id].username;
+        }
+    }
+
+    if (!fetchById(client_id))
+    {
+        return std::make_shared<const std::string>();
+    }
+
+    std::shared_lock<std::shared_mutex> lock(entriesMutex);
+    return entries[client_id].username;
+}
+
+UserDirectory::Name UserDirectory::nickname(int client_id)
+{
+    {
+        std::shared_lock<std::shared_mutex> lock(entriesMutex);
+        if (client_id > 0 && static_cast<size_t>(client_id) < entries.size() && entries[client_id].nickname)
+        {
+            return entries[client_id].nickname;
+        }
+    }
+
+    if (!fetchById(client_id))
+    {
+        return std::make_shared<const std::string>();
+    }
+
+    std::shared_lock<std::shared_mutex> lock(entriesMutex);
+    return entries[client_id].nickname;
+}
+
+bool UserDirectory::nicknameInUse(const std::string &nickname) const
+{
+    std::shared_lock<std::shared_mutex> lock(entriesMutex);
+    return nicknames.contains(nickname);
+}
+
+bool UserDirectory::claimNickname(int client_id, const std::string &nickname)
+{
+    std::unique_lock<std::shared_mutex> lock(entriesMutex);
+
+    // Check and claim under one lock, two clients can not both get the name
+    auto [it, claimed] = nicknames.try_emplace(nickname, client_id);
+    return claimed or it->second == client_id;
+}
+
+void UserDirectory::setNickname(int client_id, const std::string &nickname)
+{
+    std::unique_lock<std::shared_mutex> lock(entriesMutex);
+
+    if (client_id <= 0 || static_cast<size_t>(client_id) >= entries.size() || !entries[client_id].username)
+    {
+        return;
+    }
+
+    // Readers holding the old name keep a valid copy
+    Entry &entry = entries[client_id];
+    indexNickname(client_id, entry.nickname, nickname);
+    entry.nickname = std::make_shared<const std::string>(nickname);
+}
+
+void UserDirectory::releaseNickname(int client_id, const std::string &nickname)
+{
+    std::unique_lock<std::shared_mutex> lock(entriesMutex);
+
+    // Only a claim that was not set, the current nickname of the client stays
+    auto it = nicknames.find(nickname);
+    bool current = client_id > 0 && static_cast<size_t>(client_id) < entries.size() && entries[client_id].nickname && *entries[client_id].nickname == nickname;
+    if (it != nicknames.end() and it->second == client_id and !current)
+    {
+        nicknames.erase(it);
+    }
+}
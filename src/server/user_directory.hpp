@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "database.hpp"
+
+// Server wide cache of registered users.
+// Resolves username <-> client_id and nicknames without touching SQLite.
+// Passwords are not cached, logins check them against the database.
+class UserDirectory
+{
+public:
+    // Interned, immutable string shared between all readers
+    using Name = std::shared_ptr<const std::string>;
+
+private:
+    struct Entry
+    {
+        Name username;
+        Name nickname;
+    };
+
+    // Concurrent hash map: username -> client_id, split in independently locked shards
+    struct Shard
+    {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, int> ids;
+    };
+
+    static constexpr size_t SHARDS = 16;
+
+    std::array<Shard, SHARDS> shards;
+
+    // client_id indexed table of names
+    mutable std::shared_mutex entriesMutex;
+    std::vector<Entry> entries;
+
+    // nickname -> client_id of its owner, or of the client claiming it; guarded by entriesMutex
+    std::unordered_map<std::string, int> nicknames;
+
+    Database &db;
+
+private:
+    Shard &shardFor(const std::string &username);
+    const Shard &shardFor(const std::string &username) const;
+    bool fetchById(int client_id);
+    void indexNickname(int client_id, const Name &previous, const std::string &nickname);
+
+public:
+    UserDirectory(Database &db);
+
+    // Load every registered user from the database
+    void load();
+
+    // Add or refresh a user
+    void insert(int client_id, const std::string &username, const std::string &nickname);
+
+    // Username lookup, returns false if the user is not cached
+    bool find(const std::string &username, int &client_id) const;
+
+    // Username lookup falling back to the database on a miss
+    bool resolve(const std::string &username, int &client_id);
+
+    // client_id lookups, empty name if unknown
+    Name username(int client_id);
+    Name nickname(int client_id);
+
+    // Nickname management: a nickname is claimed before it is stored, then set or released.
+    // A claim fails while another client owns or claims the nickname
+    bool nicknameInUse(const std::string &nickname) const;
+    bool claimNickname(int client_id, const std::string &nickname);
+    void setNickname(int client_id, const std::string &nickname);
+    void releaseNickname(int client_id, const std::string &nickname);
+};